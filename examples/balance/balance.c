@@ -70,7 +70,6 @@ typedef struct core_state_t{
 int balance_controller(); 
 // threads
 void* setpoint_manager(void* ptr);
-void* battery_checker(void* ptr);
 void* printf_loop(void* ptr);
 // regular functions
 int zero_out_controller();
@@ -131,11 +130,12 @@ int main(){
 	set_pause_pressed_func(&on_pause_press);
 	set_mode_released_func(&on_mode_release);
 	
-	// start a thread to slowly sample battery 
-	pthread_t  battery_thread;
-	pthread_create(&battery_thread, NULL, battery_checker, (void*) NULL);
-	// wait for the battery thread to make the first read
-	while(cstate.vBatt==0 && get_state()!=EXITING) usleep(1000);
+	// start the library's background battery monitor, the controller reads
+	// the filtered voltage from it every step
+	if(initialize_battery_monitor(BATTERY_CHECK_HZ, BATTERY_FILTER_TC)){
+		printf("WARNING: battery monitor failed, assuming nominal voltage\n");
+	}
+	cstate.vBatt = V_NOMINAL;
 	
 	// start printf_thread if running from a terminal
 	// if it was started as a background process then don't bother
@@ -288,6 +288,10 @@ int balance_controller(){
 	// steering angle gamma estimate 
 	cstate.gamma = (cstate.wheelAngleR-cstate.wheelAngleL) \
 											* (WHEEL_RADIUS_M/TRACK_WIDTH_M);
+	
+	// if the battery voltage doesn't make sense, use nominal voltage
+	cstate.vBatt = get_filtered_battery_voltage();
+	if(cstate.vBatt>9.0 || cstate.vBatt<5.0) cstate.vBatt = V_NOMINAL;
 
 	/*************************************************************
 	* check for various exit conditions AFTER state estimate
@@ -437,24 +441,6 @@ int wait_for_starting_condition(){
 	return -1;
 }
 
-/*******************************************************************************
-* battery_checker()
-*
-* Slow loop checking battery voltage. Also changes the D1 saturation limit
-* since that is dependent on the battery voltage.
-*******************************************************************************/
-void* battery_checker(void* ptr){
-	float new_v;
-	while(get_state()!=EXITING){
-		new_v = get_battery_voltage();
-		// if the value doesn't make sense, use nominal voltage
-		if (new_v>9.0 || new_v<5.0) new_v = V_NOMINAL;
-		cstate.vBatt = new_v;
-		usleep(1000000 / BATTERY_CHECK_HZ);
-	}
-	return NULL;
-}
-
 /*******************************************************************************
 * printf_loop() 
 *
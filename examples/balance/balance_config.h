@@ -66,6 +66,7 @@
 
 // Thread Loop Rates
 #define		BATTERY_CHECK_HZ		5
+#define		BATTERY_FILTER_TC		1.0
 #define 	SETPOINT_MANAGER_HZ		100
 #define		PRINTF_HZ				50
 
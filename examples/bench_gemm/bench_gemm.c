@@ -0,0 +1,152 @@
+/*******************************************************************************
+* bench_gemm.c
+*
+* Times multiply_matrices_into(), matrix_times_col_vec_into() and
+* row_vec_times_matrix_into() against plain triple loops for square sizes from
+* 3 to 128 plus a few ragged shapes, and reports GFLOP/s for both. Every
+* result is checked against the plain loop and FAIL is printed if any entry
+* differs by more than a relative tolerance that grows with the inner
+* dimension.
+*******************************************************************************/
+
+#include <bb_blue_api.h>
+
+#define MIN_FLOPS	50000000.0	// flops to time per test, sets the repeats
+#define TOL			1e-5
+
+int sizes[][3] = {	{3,3,3}, {4,4,4}, {6,6,6}, {8,8,8}, {12,12,12},
+					{16,16,16}, {24,24,24}, {32,32,32}, {48,48,48},
+					{64,64,64}, {96,96,96}, {128,128,128},
+					{100,37,65}, {7,129,13}, {130,5,70}};
+
+// C = A*B the textbook way
+void naive_multiply(matrix_t A, matrix_t B, matrix_t C){
+	int i,j,k;
+	float sum;
+	for(i=0;i<A.rows;i++){
+		for(j=0;j<B.cols;j++){
+			sum = 0;
+			for(k=0;k<A.cols;k++){
+				sum += MATRIX_ELEM(A,i,k)*MATRIX_ELEM(B,k,j);
+			}
+			MATRIX_ELEM(C,i,j) = sum;
+		}
+	}
+}
+
+// y = A*x the textbook way
+void naive_gemv(matrix_t A, vector_t x, vector_t y){
+	int i,j;
+	for(i=0;i<A.rows;i++){
+		y.data[i] = 0;
+		for(j=0;j<A.cols;j++) y.data[i] += MATRIX_ELEM(A,i,j)*x.data[j];
+	}
+}
+
+// y = x'*A the textbook way
+void naive_gevm(vector_t x, matrix_t A, vector_t y){
+	int i,j;
+	for(j=0;j<A.cols;j++){
+		y.data[j] = 0;
+		for(i=0;i<A.rows;i++) y.data[j] += x.data[i]*MATRIX_ELEM(A,i,j);
+	}
+}
+
+// true if every entry agrees to within TOL*k relative to the largest entry
+int close_enough(float* a, float* b, int n, int k){
+	int i;
+	float big = 1, err = 0;
+	for(i=0;i<n;i++){
+		if(fabs(a[i])>big) big = fabs(a[i]);
+		if(fabs(a[i]-b[i])>err) err = fabs(a[i]-b[i]);
+	}
+	return err <= TOL*k*big;
+}
+
+double gflops(double flops, uint64_t us){
+	return flops/(us*1000.0);
+}
+
+int main(){
+	int t, r, i, m, k, n, reps, bad = 0;
+	uint64_t t0, t_naive, t_fast;
+	double flops;
+	matrix_t A, B, C, D;
+	vector_t x, y, z, xr, yr, zr;
+
+	printf("\n   m    k    n      GEMM naive   blocked     GEMV naive      fast");
+	printf("     GEVM naive      fast\n");
+	for(t=0;t<(int)(sizeof(sizes)/sizeof(sizes[0]));t++){
+		m = sizes[t][0];
+		k = sizes[t][1];
+		n = sizes[t][2];
+		A = create_random_matrix(m,k);
+		B = create_random_matrix(k,n);
+		C = create_matrix(m,n);
+		D = create_matrix(m,n);
+		x = create_random_vector(k);
+		y = create_vector(m);
+		z = create_vector(m);
+		xr = create_random_vector(m);
+		yr = create_vector(k);
+		zr = create_vector(k);
+		printf("%4d %4d %4d  ", m, k, n);
+
+		// matrix times matrix
+		flops = 2.0*m*n*k;
+		reps = MIN_FLOPS/flops + 1;
+		t0 = micros_since_boot();
+		for(r=0;r<reps;r++) naive_multiply(A,B,D);
+		t_naive = micros_since_boot()-t0;
+		t0 = micros_since_boot();
+		for(r=0;r<reps;r++) multiply_matrices_into(&C,A,B);
+		t_fast = micros_since_boot()-t0;
+		printf("%14.3f %9.3f", gflops(flops*reps,t_naive), \
+									gflops(flops*reps,t_fast));
+		for(i=0;i<m;i++){
+			if(!close_enough(MATRIX_ROW(D,i), MATRIX_ROW(C,i), n, k)) bad++;
+		}
+
+		// matrix times column vector
+		flops = 2.0*m*k;
+		reps = MIN_FLOPS/flops + 1;
+		t0 = micros_since_boot();
+		for(r=0;r<reps;r++) naive_gemv(A,x,z);
+		t_naive = micros_since_boot()-t0;
+		t0 = micros_since_boot();
+		for(r=0;r<reps;r++) matrix_times_col_vec_into(&y,A,x);
+		t_fast = micros_since_boot()-t0;
+		printf("%15.3f %9.3f", gflops(flops*reps,t_naive), \
+									gflops(flops*reps,t_fast));
+		if(!close_enough(z.data, y.data, m, k)) bad++;
+
+		// row vector times matrix
+		t0 = micros_since_boot();
+		for(r=0;r<reps;r++) naive_gevm(xr,A,zr);
+		t_naive = micros_since_boot()-t0;
+		t0 = micros_since_boot();
+		for(r=0;r<reps;r++) row_vec_times_matrix_into(&yr,xr,A);
+		t_fast = micros_since_boot()-t0;
+		printf("%15.3f %9.3f\n", gflops(flops*reps,t_naive), \
+									gflops(flops*reps,t_fast));
+		if(!close_enough(zr.data, yr.data, k, m)) bad++;
+
+		destroy_matrix(&A);
+		destroy_matrix(&B);
+		destroy_matrix(&C);
+		destroy_matrix(&D);
+		destroy_vector(&x);
+		destroy_vector(&y);
+		destroy_vector(&z);
+		destroy_vector(&xr);
+		destroy_vector(&yr);
+		destroy_vector(&zr);
+		if(bad){
+			printf("FAIL: result differs from the naive product\n");
+			return -1;
+		}
+	}
+	printf("\nGFLOP/s, all results match the naive products\n");
+	printf("DONE\n");
+	return 0;
+}
@@ -0,0 +1,214 @@
+/*******************************************************************************
+* replay_dsm2.c
+*
+* Pushes DSM2/DSMX byte streams through dsm_decode() without needing a UART
+* or receiver. With no arguments a synthetic stream is generated with a 6
+* channel 1024/22ms radio followed by a 9 channel 2048/11ms radio, one frame
+* in CORRUPT_EVERY carrying an impossible channel id. Every decoded value is
+* checked against what was encoded. Given a file of back to back 16 byte
+* frames captured from the DSM2 UART, that is replayed instead.
+*
+* The stream is then replayed through dsm_decode_locked() like the service
+* does. The switch from the 10-bit to the 11-bit radio has to break the
+* 10-bit resolution lock after DSM2_RES_LOCK_FRAMES rejected frames and
+* then lock again at 11-bit without decoding anything wrong on the way.
+*
+* Reports decode errors and how many frames per second the decoder handles,
+* both detecting the resolution on every frame and with it locked.
+*******************************************************************************/
+
+#include <bb_blue_api.h>
+
+#define FRAME_BYTES		16
+#define SETS_PER_RADIO	5000
+#define CORRUPT_EVERY	100
+#define TIMING_REPEATS	50
+#define MAX_FRAMES		(SETS_PER_RADIO*3)
+
+uint8_t stream[MAX_FRAMES*FRAME_BYTES];
+int expect_res[MAX_FRAMES];		// 0 if unknown or corrupted
+int16_t expect_us[MAX_FRAMES][7];	// by word, for synthetic frames only
+int nframes;
+
+// adds one frame of up to 7 channels, id -1 marks an unused word
+void add_frame(int res, const int* ids, const int* us, int corrupt){
+	uint8_t* f = &stream[nframes*FRAME_BYTES];
+	uint16_t word;
+	int i;
+
+	f[0] = 0;		// fades
+	f[1] = 0x12;	// system byte, not used by the decoder
+	for(i=0;i<7;i++){
+		if(ids[i]<0) word = 0xFFFF;
+		else if(res==10) word = (ids[i]<<10) | ((us[i]-989) & 0x3FF);
+		else word = (ids[i]<<11) | (((us[i]-989)*2) & 0x7FF);
+		if(corrupt && i==0) word |= 0x7800; // id 15 in either layout
+		f[2+2*i] = word>>8;
+		f[3+2*i] = word&0xFF;
+		expect_us[nframes][i] = (ids[i]<0) ? 0 : us[i];
+	}
+	expect_res[nframes] = corrupt ? 0 : res;
+	nframes++;
+}
+
+// stick positions sweep slowly so values differ frame to frame
+void generate_stream(){
+	int ids_a[7] = {0,1,2,3,4,5,-1};
+	int ids_b[7] = {0,1,2,3,4,5,6};
+	int ids_c[7] = {7,8,-1,-1,-1,-1,-1};
+	int us[7];
+	int i, j;
+
+	for(i=0;i<SETS_PER_RADIO;i++){
+		for(j=0;j<7;j++) us[j] = 1000 + (i*7+j*97)%1000;
+		add_frame(10, ids_a, us, nframes%CORRUPT_EVERY==CORRUPT_EVERY-1);
+	}
+	for(i=0;i<SETS_PER_RADIO;i++){
+		for(j=0;j<7;j++) us[j] = 1000 + (i*11+j*89)%1000;
+		add_frame(11, ids_b, us, nframes%CORRUPT_EVERY==CORRUPT_EVERY-1);
+		add_frame(11, ids_c, us, nframes%CORRUPT_EVERY==CORRUPT_EVERY-1);
+	}
+}
+
+int load_capture(const char* path){
+	FILE* f = fopen(path, "rb");
+	if(f==NULL){
+		printf("ERROR: can't open %s\n", path);
+		return -1;
+	}
+	nframes = fread(stream, FRAME_BYTES, MAX_FRAMES, f);
+	fclose(f);
+	memset(expect_res, 0, sizeof(expect_res));
+	return 0;
+}
+
+// decodes every frame once, returns number of frames rejected or wrong
+int check_stream(int* rejected){
+	dsm_frame_t frame;
+	int i, w, n, wrong = 0;
+
+	*rejected = 0;
+	for(i=0;i<nframes;i++){
+		frame.resolution = 0;
+		n = dsm_decode(&stream[i*FRAME_BYTES], &frame);
+		if(n<0){
+			(*rejected)++;
+			continue;
+		}
+		if(expect_res[i]==0) continue;
+		if(frame.resolution!=expect_res[i]){
+			wrong++;
+			continue;
+		}
+		for(w=0;w<n;w++){
+			if(frame.value[w]!=expect_us[i][w]){
+				wrong++;
+				break;
+			}
+		}
+	}
+	return wrong;
+}
+
+// decodes every frame through the resolution lock, counting how often it
+// locks and unlocks. Returns number of frames decoded wrong.
+int check_locked(int* rejected, int* locks, int* unlocks){
+	dsm_res_lock_t lock;
+	dsm_frame_t frame;
+	int i, w, n, was, wrong = 0;
+
+	memset(&lock, 0, sizeof(lock));
+	*rejected = 0;
+	*locks = 0;
+	*unlocks = 0;
+	for(i=0;i<nframes;i++){
+		was = lock.locked;
+		n = dsm_decode_locked(&lock, &stream[i*FRAME_BYTES], &frame);
+		if(lock.locked && !was) (*locks)++;
+		if(was && !lock.locked) (*unlocks)++;
+		if(n<0){
+			(*rejected)++;
+			continue;
+		}
+		if(expect_res[i]==0) continue;
+		if(frame.resolution!=expect_res[i]){
+			wrong++;
+			continue;
+		}
+		for(w=0;w<n;w++){
+			if(frame.value[w]!=expect_us[i][w]){
+				wrong++;
+				break;
+			}
+		}
+	}
+	return wrong;
+}
+
+// frames per second decoding count frames from first, res 0 detects
+double time_stream(int res, int first, int count){
+	dsm_frame_t frame;
+	timespec start, end;
+	volatile int sink = 0;
+	int i, j;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(j=0;j<TIMING_REPEATS;j++){
+		for(i=first;i<first+count;i++){
+			frame.resolution = res;
+			sink += dsm_decode(&stream[i*FRAME_BYTES], &frame);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (double)count*TIMING_REPEATS*1000000.0 / \
+								timespec_to_micros(timespec_diff(start,end));
+}
+
+int main(int argc, char* argv[]){
+	int rejected, wrong, corrupted;
+	int lock_rejected, lock_wrong, locks, unlocks;
+
+	if(argc>1){
+		if(load_capture(argv[1])<0) return -1;
+		printf("\nReplaying %d frames from %s\n", nframes, argv[1]);
+		corrupted = 0;
+	}
+	else{
+		generate_stream();
+		corrupted = nframes/CORRUPT_EVERY;
+		printf("\nReplaying %d synthetic frames, %d corrupted\n", nframes, \
+																corrupted);
+	}
+	if(nframes==0){
+		printf("ERROR: nothing to replay\n");
+		return -1;
+	}
+
+	wrong = check_stream(&rejected);
+	printf("decode errors: %d rejected, %d decoded wrong\n", rejected, wrong);
+	lock_wrong = check_locked(&lock_rejected, &locks, &unlocks);
+	printf("with resolution lock: %d rejected, %d decoded wrong, " \
+			"locked %d times, unlocked %d times\n", lock_rejected, \
+			lock_wrong, locks, unlocks);
+	printf("detecting resolution: %10.0f frames/s\n", \
+											time_stream(0, 0, nframes));
+	if(argc<=1){
+		// lock each radio's part of the stream to its own resolution
+		printf("locked 10-bit:        %10.0f frames/s\n", \
+									time_stream(10, 0, SETS_PER_RADIO));
+		printf("locked 11-bit:        %10.0f frames/s\n", \
+					time_stream(11, SETS_PER_RADIO, 2*SETS_PER_RADIO));
+	}
+
+	// breaking the lock costs at most DSM2_RES_LOCK_FRAMES good frames,
+	// fewer if corrupted ones happen to be among the errors in a row
+	if(wrong>0 || lock_wrong>0 || (argc<=1 && (rejected!=corrupted || \
+		lock_rejected<=corrupted || \
+		lock_rejected>corrupted+DSM2_RES_LOCK_FRAMES || \
+		locks!=2 || unlocks!=1))){
+		printf("FAIL\n");
+		return -1;
+	}
+	printf("DONE\n");
+	return 0;
+}
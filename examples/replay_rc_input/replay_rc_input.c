@@ -0,0 +1,173 @@
+/*******************************************************************************
+* replay_rc_input.c
+*
+* Runs the SBUS or CRSF receiver service against a pty instead of the DSM2
+* socket, so the whole path from UART reactor to rc_input_get_raw() can be
+* tested without a receiver. Bytes from a capture file are written into the
+* pty in small paced chunks. Without a file, synthetic frames are sent, one
+* in CORRUPT_EVERY with a bad footer or crc, and every received frame is
+* checked against what was sent. SBUS frames are sent with a quiet gap in
+* front like a real receiver's, since the service frames SBUS by those gaps,
+* and every other corrupted SBUS frame is cut short instead.
+*
+* usage: replay_rc_input sbus|crsf [capture_file]
+*******************************************************************************/
+
+#include <bb_blue_api.h>
+#include <pty.h>
+
+#define FRAMES			1000
+#define CORRUPT_EVERY	50
+#define CHUNK_BYTES		32
+#define CHUNK_US		1000
+#define SBUS_GAP_US		4000	// quiet line between frames at 7ms
+
+int master;
+rc_protocol_t protocol;
+
+// same CRC-8/DVB-S2 as the receiver uses
+uint8_t crc8(const uint8_t* p, int len){
+	uint8_t crc = 0;
+	int i;
+	while(len--){
+		crc ^= *p++;
+		for(i=0;i<8;i++) crc = (crc & 0x80) ? (crc<<1)^0xD5 : crc<<1;
+	}
+	return crc;
+}
+
+// 16 channels of 11 bits, least significant bit first
+void pack_channels(uint8_t* out, const int* v){
+	uint32_t acc = 0;
+	int i, bits = 0;
+	for(i=0;i<RC_MAX_CHANNELS;i++){
+		acc |= (uint32_t)v[i] << bits;
+		bits += 11;
+		while(bits>=8){
+			*out++ = acc & 0xFF;
+			acc >>= 8;
+			bits -= 8;
+		}
+	}
+}
+
+// builds frame k into f, returns its length
+int make_frame(int k, const int* v, uint8_t* f){
+	int corrupt = (k%CORRUPT_EVERY)==CORRUPT_EVERY/2;
+	if(protocol==RC_PROTOCOL_SBUS){
+		f[0] = 0x0F;
+		pack_channels(&f[1], v);
+		f[23] = 0;							// flags
+		f[24] = corrupt ? 0x55 : 0x00;		// footer
+		// alternate corruptions lose the end of the frame instead
+		if(corrupt && (k/CORRUPT_EVERY)%2) return 12;
+		return 25;
+	}
+	f[0] = 0xC8;
+	f[1] = 24;
+	f[2] = 0x16;
+	pack_channels(&f[3], v);
+	f[25] = crc8(&f[2], 23) ^ (corrupt ? 1 : 0);
+	return 26;
+}
+
+int replay_synthetic(){
+	uint8_t f[32];
+	int v[RC_MAX_CHANNELS];
+	int k, i, n, wrong = 0, received = 0;
+	rc_input_data_t d;
+	uint64_t last_us;
+
+	for(k=0;k<FRAMES && get_state()!=EXITING;k++){
+		for(i=0;i<RC_MAX_CHANNELS;i++) v[i] = 172 + (k*13+i*100)%1640;
+		n = make_frame(k, v, f);
+		if(protocol==RC_PROTOCOL_SBUS) usleep(SBUS_GAP_US);
+		rc_input_get_data(&d);
+		last_us = d.timestamp_us;
+		if(write(master, f, n)!=n){
+			printf("ERROR: write to pty failed\n");
+			return -1;
+		}
+		if((k%CORRUPT_EVERY)==CORRUPT_EVERY/2) continue;
+		// the service publishes from the reactor thread, sleep until it does.
+		// The frame may land before the wait starts so check the timestamp
+		// too, and give up after a second
+		for(n=0;n<10;n++){
+			rc_input_get_data(&d);
+			if(d.timestamp_us!=last_us) break;
+			rc_input_wait_frame(0.1);
+		}
+		received++;
+		for(i=0;i<RC_MAX_CHANNELS;i++){
+			if(rc_input_get_raw(i+1)!=(v[i]*5)/8+880){
+				wrong++;
+				break;
+			}
+		}
+	}
+	usleep(20000); // let the reactor finish the last frame
+	printf("sent %d frames, %d corrupted\n", FRAMES, FRAMES/CORRUPT_EVERY);
+	printf("checked %d frames, %d wrong, %llu errors counted\n", received, \
+						wrong, (unsigned long long)rc_input_errors());
+	if(wrong>0 || rc_input_errors()!=FRAMES/CORRUPT_EVERY){
+		printf("FAIL\n");
+		return -1;
+	}
+	return 0;
+}
+
+int replay_file(const char* path){
+	uint8_t buf[CHUNK_BYTES];
+	int n, total = 0;
+	FILE* f = fopen(path, "rb");
+	if(f==NULL){
+		printf("ERROR: can't open %s\n", path);
+		return -1;
+	}
+	while((n=fread(buf, 1, CHUNK_BYTES, f))>0 && get_state()!=EXITING){
+		if(write(master, buf, n)!=n){
+			printf("ERROR: write to pty failed\n");
+			fclose(f);
+			return -1;
+		}
+		total += n;
+		usleep(CHUNK_US);
+	}
+	fclose(f);
+	usleep(50000);
+	printf("replayed %d bytes, %d channels, %llu errors\n", total, \
+		rc_input_num_channels(), (unsigned long long)rc_input_errors());
+	for(n=1;n<=rc_input_num_channels();n++){
+		printf("%d:%d ", n, rc_input_get_raw(n));
+	}
+	printf("\n");
+	return 0;
+}
+
+int main(int argc, char* argv[]){
+	int slave, ret;
+	char name[64];
+
+	if(argc<2 || (strcmp(argv[1],"sbus") && strcmp(argv[1],"crsf"))){
+		printf("usage: replay_rc_input sbus|crsf [capture_file]\n");
+		return -1;
+	}
+	protocol = strcmp(argv[1],"sbus") ? RC_PROTOCOL_CRSF : RC_PROTOCOL_SBUS;
+	if(openpty(&master, &slave, name, NULL, NULL)<0){
+		printf("ERROR: can't open a pty\n");
+		return -1;
+	}
+	uart_set_device_path(4, name);
+	if(rc_input_start(protocol)<0){
+		printf("ERROR: failed to start rc input\n");
+		return -1;
+	}
+
+	if(argc>2) ret = replay_file(argv[2]);
+	else ret = replay_synthetic();
+
+	rc_input_stop();
+	stop_uart_reactor();
+	if(ret==0) printf("DONE\n");
+	return ret;
+}
@@ -5,12 +5,405 @@
 * This tests some of the more common functions in linear_algebra.c, it is not a
 * complete test of all available linear algebra functions but should get you
 * started.
+*
+* It then checks the allocation-free *_into functions against the allocating
+* versions and times both. The *_arena solvers are checked the same way, with
+* malloc counted to make sure they never touch the heap and with arenas too
+* small to hold the result. Any mismatch prints FAIL.
 *******************************************************************************/
 
+#define _GNU_SOURCE
 #include <bb_blue_api.h>
+#include <dlfcn.h>
 
 #define DIM 5
+#define BENCH_CALLS	20000
+#define TOL			1e-4
+
+int bench_sizes[] = {3, 6, 12, 24};
+
+// heap allocations seen while counting is set, see check_arena()
+int counting = 0;
+int allocs = 0;
+
+// count every heap allocation made by this process, the library included
+void* malloc(size_t n){
+	static void* (*real)(size_t) = NULL;
+	if(real==NULL) real = (void*(*)(size_t))dlsym(RTLD_NEXT, "malloc");
+	if(counting) allocs++;
+	return real(n);
+}
+
+void* calloc(size_t n, size_t size){
+	void* ptr;
+	if(size!=0 && n > (size_t)-1/size) return NULL;
+	ptr = malloc(n*size);
+	if(ptr!=NULL) memset(ptr, 0, n*size);
+	return ptr;
+}
+
+int posix_memalign(void** ptr, size_t align, size_t n){
+	static int (*real)(void**, size_t, size_t) = NULL;
+	if(real==NULL){
+		real = (int(*)(void**,size_t,size_t))dlsym(RTLD_NEXT,"posix_memalign");
+	}
+	if(counting) allocs++;
+	return real(ptr, align, n);
+}
+
+// largest absolute difference between two same sized matrices
+float matrix_diff(matrix_t A, matrix_t B){
+	int i,j;
+	float d = 0;
+	for(i=0;i<A.rows;i++){
+		for(j=0;j<A.cols;j++){
+			if(fabs(MATRIX_ELEM(A,i,j)-MATRIX_ELEM(B,i,j))>d){
+				d = fabs(MATRIX_ELEM(A,i,j)-MATRIX_ELEM(B,i,j));
+			}
+		}
+	}
+	return d;
+}
+
+// largest absolute difference between two same length vectors
+float vector_diff(vector_t a, vector_t b){
+	int i;
+	float d = 0;
+	for(i=0;i<a.len;i++){
+		if(fabs(a.data[i]-b.data[i])>d) d = fabs(a.data[i]-b.data[i]);
+	}
+	return d;
+}
+
+// compares the *_into functions against the allocating ones and reports the
+// time per call of each, returns -1 on any mismatch
+int bench_into(int n){
+	int i, bad = 0;
+	uint64_t t0, t_alloc, t_into;
+	matrix_t A = create_random_matrix(n,n);
+	matrix_t B = create_random_matrix(n,n);
+	matrix_t C = create_matrix(n,n);
+	matrix_t M;
+	vector_t v = create_random_vector(n);
+	vector_t w = create_random_vector(n);
+	vector_t y = create_vector(n);
+	vector_t p = create_vector(2*n-1);
+	vector_t u;
+
+	// matrix multiply
+	t0 = micros_since_boot();
+	for(i=0;i<BENCH_CALLS;i++){
+		M = multiply_matrices(A,B);
+		destroy_matrix(&M);
+	}
+	t_alloc = micros_since_boot()-t0;
+	t0 = micros_since_boot();
+	for(i=0;i<BENCH_CALLS;i++) multiply_matrices_into(&C,A,B);
+	t_into = micros_since_boot()-t0;
+	M = multiply_matrices(A,B);
+	if(matrix_diff(M,C)>TOL) bad++;
+	destroy_matrix(&M);
+	printf("%3d multiply_matrices    %8.0fns %8.0fns\n", n, \
+		t_alloc*1000.0/BENCH_CALLS, t_into*1000.0/BENCH_CALLS);
+
+	// matrix times vector
+	t0 = micros_since_boot();
+	for(i=0;i<BENCH_CALLS;i++){
+		u = matrix_times_col_vec(A,v);
+		destroy_vector(&u);
+	}
+	t_alloc = micros_since_boot()-t0;
+	t0 = micros_since_boot();
+	for(i=0;i<BENCH_CALLS;i++) matrix_times_col_vec_into(&y,A,v);
+	t_into = micros_since_boot()-t0;
+	u = matrix_times_col_vec(A,v);
+	if(vector_diff(u,y)>TOL) bad++;
+	destroy_vector(&u);
+	printf("%3d matrix_times_col_vec %8.0fns %8.0fns\n", n, \
+		t_alloc*1000.0/BENCH_CALLS, t_into*1000.0/BENCH_CALLS);
+
+	// vector times matrix
+	t0 = micros_since_boot();
+	for(i=0;i<BENCH_CALLS;i++){
+		u = row_vec_times_matrix(v,A);
+		destroy_vector(&u);
+	}
+	t_alloc = micros_since_boot()-t0;
+	t0 = micros_since_boot();
+	for(i=0;i<BENCH_CALLS;i++) row_vec_times_matrix_into(&y,v,A);
+	t_into = micros_since_boot()-t0;
+	u = row_vec_times_matrix(v,A);
+	if(vector_diff(u,y)>TOL) bad++;
+	destroy_vector(&u);
+	printf("%3d row_vec_times_matrix %8.0fns %8.0fns\n", n, \
+		t_alloc*1000.0/BENCH_CALLS, t_into*1000.0/BENCH_CALLS);
+
+	// matrix addition, the _into version in place
+	t0 = micros_since_boot();
+	for(i=0;i<BENCH_CALLS;i++){
+		M = add_matrices(A,B);
+		destroy_matrix(&M);
+	}
+	t_alloc = micros_since_boot()-t0;
+	M = add_matrices(A,B);
+	duplicate_matrix_into(&C,A);
+	t0 = micros_since_boot();
+	for(i=0;i<BENCH_CALLS;i++) add_matrices_into(&C,C,B);
+	t_into = micros_since_boot()-t0;
+	duplicate_matrix_into(&C,A);
+	add_matrices_into(&C,C,B);
+	if(matrix_diff(M,C)>TOL) bad++;
+	destroy_matrix(&M);
+	printf("%3d add_matrices         %8.0fns %8.0fns\n", n, \
+		t_alloc*1000.0/BENCH_CALLS, t_into*1000.0/BENCH_CALLS);
+
+	// polynomial convolution
+	t0 = micros_since_boot();
+	for(i=0;i<BENCH_CALLS;i++){
+		u = poly_conv(v,w);
+		destroy_vector(&u);
+	}
+	t_alloc = micros_since_boot()-t0;
+	t0 = micros_since_boot();
+	for(i=0;i<BENCH_CALLS;i++) poly_conv_into(&p,v,w);
+	t_into = micros_since_boot()-t0;
+	u = poly_conv(v,w);
+	if(vector_diff(u,p)>TOL) bad++;
+	destroy_vector(&u);
+	printf("%3d poly_conv            %8.0fns %8.0fns\n", n, \
+		t_alloc*1000.0/BENCH_CALLS, t_into*1000.0/BENCH_CALLS);
+
+	destroy_matrix(&A);
+	destroy_matrix(&B);
+	destroy_matrix(&C);
+	destroy_vector(&v);
+	destroy_vector(&w);
+	destroy_vector(&y);
+	destroy_vector(&p);
+	return bad ? -1 : 0;
+}
+
+// in place and aliasing cases of the *_into functions
+int check_in_place(){
+	int bad = 0;
+	float mem[3*MATRIX_STRIDE(3)] __attribute__((aligned(MATRIX_ALIGN)));
+	float buf[7];
+	matrix_t S = wrap_matrix(3,3,0,mem);
+	matrix_t T, R = create_random_matrix(3,3);
+	vector_t a = create_random_vector(3);
+	vector_t b = create_random_vector(3);
+	vector_t c = cross_product_3d(a,b);
+	vector_t q = create_vector_from_array(3, a.data);
+	vector_t sq, pw, bw;
+
+	// cross product written over its first input
+	cross_product_3d_into(&q,q,b);
+	if(vector_diff(q,c)>TOL) bad++;
+
+	// transpose of a stack matrix in place
+	duplicate_matrix_into(&S,R);
+	transpose_matrix_into(&S,S);
+	T = duplicate_matrix(R);
+	transpose_matrix(&T);
+	if(matrix_diff(S,T)>TOL) bad++;
+
+	// (a)^2 built up in place inside a longer buffer
+	sq = poly_conv(a,a);
+	memcpy(buf, a.data, 3*sizeof(float));
+	pw = wrap_vector(5, buf);
+	poly_conv_into(&pw, wrap_vector(3,buf), a);
+	if(vector_diff(sq,pw)>TOL) bad++;
+	destroy_vector(&sq);
+	sq = poly_power(a,3);
+	pw = wrap_vector(7, buf);
+	poly_power_into(&pw, a, 3);
+	if(vector_diff(sq,pw)>TOL) bad++;
+
+	// second order butterworth at 1 rad/s is s^2 + 1.414s + 1
+	bw = poly_butter(2,1);
+	if(fabs(bw.data[1]-sqrt(2))>TOL || fabs(bw.data[0]-1)>TOL) bad++;
+
+	destroy_matrix(&R);
+	destroy_matrix(&T);
+	destroy_vector(&a);
+	destroy_vector(&b);
+	destroy_vector(&c);
+	destroy_vector(&q);
+	destroy_vector(&sq);
+	destroy_vector(&bw);
+	return bad ? -1 : 0;
+}
 	
+// Cholesky and LDL' against the general solvers on a symmetric positive
+// definite A = M'M + nI, including updates, downdates and in place use
+int check_symmetric(int n){
+	int i, bad = 0;
+	la_arena_t ws = create_la_arena(64*1024);
+	matrix_t M = create_random_matrix(n,n);
+	matrix_t Mt = duplicate_matrix(M);
+	transpose_matrix(&Mt);
+	matrix_t A = multiply_matrices(Mt,M);
+	for(i=0;i<n;i++) MATRIX_ELEM(A,i,i) += n;
+	vector_t b = create_random_vector(n);
+	vector_t u = create_random_vector(n);
+	vector_t x = create_vector(n);
+	vector_t d = create_vector(n);
+	vector_t xref = lin_system_solve(A,b);
+	matrix_t Aref = invert_matrix(A);
+	matrix_t L = create_matrix(n,n);
+	matrix_t L0 = create_matrix(n,n);
+	matrix_t Ainv = create_matrix(n,n);
+	matrix_t Lt, LLt, Aup, U;
+
+	// factor, check L*L' = A, solve and invert
+	if(cholesky_factor(&L,A)<0) bad++;
+	Lt = duplicate_matrix(L);
+	transpose_matrix(&Lt);
+	LLt = multiply_matrices(L,Lt);
+	if(matrix_diff(LLt,A)>TOL*n*n) bad++;
+	cholesky_solve(&x,L,b);
+	if(vector_diff(x,xref)>TOL) bad++;
+	cholesky_inverse(&Ainv,L,&ws);
+	if(matrix_diff(Ainv,Aref)>TOL) bad++;
+
+	// update to A + u*u' matches a fresh factor, downdate undoes it
+	duplicate_matrix_into(&L0,L);
+	U = vector_outer_product(u,u);
+	Aup = add_matrices(A,U);
+	cholesky_update(&L,u,&ws);
+	cholesky_factor(&Lt,Aup);
+	if(matrix_diff(L,Lt)>TOL*n) bad++;
+	if(cholesky_downdate(&L,u,NULL)<0) bad++;
+	if(matrix_diff(L,L0)>TOL*n) bad++;
+	// a downdate that would break positive definiteness leaves L alone
+	duplicate_matrix_into(&L0,L);
+	vector_times_scalar(&u, 100);
+	if(cholesky_downdate(&L,u,&ws)==0) bad++;
+	if(matrix_diff(L,L0)>0) bad++;
+	vector_times_scalar(&u, 0.01);
+
+	// LDL' written over a copy of A, solve in place, invert
+	duplicate_matrix_into(&L,A);
+	if(ldl_factor(&L,&d,L)<0) bad++;
+	duplicate_vector_into(&x,b);
+	ldl_solve(&x,L,d,x);
+	if(vector_diff(x,xref)>TOL) bad++;
+	ldl_update(&L,&d,u,1,&ws);
+	ldl_update(&L,&d,u,-1,&ws);
+	ldl_inverse(&Ainv,L,d,&ws);
+	if(matrix_diff(Ainv,Aref)>TOL*n) bad++;
+	if(ws.used!=0) bad++;
+
+	destroy_la_arena(&ws);
+	destroy_matrix(&M);
+	destroy_matrix(&Mt);
+	destroy_matrix(&A);
+	destroy_matrix(&Aref);
+	destroy_matrix(&L);
+	destroy_matrix(&L0);
+	destroy_matrix(&Lt);
+	destroy_matrix(&LLt);
+	destroy_matrix(&Ainv);
+	destroy_matrix(&Aup);
+	destroy_matrix(&U);
+	destroy_vector(&b);
+	destroy_vector(&u);
+	destroy_vector(&x);
+	destroy_vector(&d);
+	destroy_vector(&xref);
+	return bad ? -1 : 0;
+}
+
+// the *_arena solvers against the allocating ones. Repeated solves out of one
+// arena must not allocate, and any failure, out of space or singular, must
+// leave the arena as it was with nothing initialized handed back
+int check_arena(int n){
+	int i, k, bad = 0;
+	float t;
+	size_t used;
+	la_arena_t ws = create_la_arena(64*1024);
+	la_arena_t tiny;
+	matrix_t A = create_random_matrix(n,n);
+	for(i=0;i<n;i++) MATRIX_ELEM(A,i,i) += n;
+	vector_t b = create_random_vector(n);
+	matrix_t S = duplicate_matrix(A);
+	for(i=0;i<n;i++) MATRIX_ELEM(S,i,n-1) = 0;
+	matrix_t pts = create_matrix(24,3);
+	vector_t cref, lref, c, l, x;
+	matrix_t Qref, Rref, Q, R, Ainv, Aref;
+	vector_t xref = lin_system_solve(A,b);
+	vector_t xqref = lin_system_solve_qr(A,b);
+	QR_decomposition(A,&Qref,&Rref);
+	Aref = invert_matrix(A);
+	// points on an ellipsoid centered at (1,2,3) with lengths 2,3,4
+	for(i=0;i<pts.rows;i++){
+		t = i*0.7;
+		MATRIX_ELEM(pts,i,0) = 1 + 2*cos(t)*sin(i*0.3+0.2);
+		MATRIX_ELEM(pts,i,1) = 2 + 3*sin(t)*sin(i*0.3+0.2);
+		MATRIX_ELEM(pts,i,2) = 3 + 4*cos(i*0.3+0.2);
+	}
+	fit_ellipsoid(pts,&cref,&lref);
+
+	// warm up once so the count only covers steady state solves
+	QR_decomposition_arena(A,&Q,&R,&ws);
+	la_arena_reset(&ws);
+	allocs = 0;
+	counting = 1;
+	for(k=0;k<100;k++){
+		if(QR_decomposition_arena(A,&Q,&R,&ws)<0) bad++;
+		else if(matrix_diff(Q,Qref)>TOL || matrix_diff(R,Rref)>TOL*n) bad++;
+		Ainv = invert_matrix_arena(A,&ws);
+		if(!Ainv.initialized || matrix_diff(Ainv,Aref)>TOL) bad++;
+		x = lin_system_solve_arena(A,b,&ws);
+		if(!x.initialized || vector_diff(x,xref)>TOL) bad++;
+		x = lin_system_solve_qr_arena(A,b,&ws);
+		if(!x.initialized || vector_diff(x,xqref)>TOL) bad++;
+		if(fit_ellipsoid_arena(pts,&c,&l,&ws)<0) bad++;
+		else if(vector_diff(c,cref)>TOL*10 || vector_diff(l,lref)>TOL*10) bad++;
+		la_arena_reset(&ws);
+	}
+	counting = 0;
+	if(allocs!=0){
+		printf("%d heap allocations in the arena solvers\n", allocs);
+		bad++;
+	}
+
+	// singular A, nothing is kept
+	x = lin_system_solve_arena(S,b,&ws);
+	if(x.initialized || ws.used!=0) bad++;
+	Ainv = invert_matrix_arena(S,&ws);
+	if(Ainv.initialized || ws.used!=0) bad++;
+
+	// arenas with room for the first output only, nothing is kept
+	tiny = create_la_arena(la_matrix_bytes(n,n));
+	if(QR_decomposition_arena(A,&Q,&R,&tiny)==0 || tiny.used!=0) bad++;
+	if(invert_matrix_arena(A,&tiny).initialized || tiny.used!=0) bad++;
+	destroy_la_arena(&tiny);
+	tiny = create_la_arena(la_vector_bytes(n));
+	if(lin_system_solve_arena(A,b,&tiny).initialized || tiny.used!=0) bad++;
+	if(lin_system_solve_qr_arena(A,b,&tiny).initialized || tiny.used!=0) bad++;
+	destroy_la_arena(&tiny);
+	tiny = create_la_arena(2*la_vector_bytes(3));
+	used = tiny.used;
+	if(fit_ellipsoid_arena(pts,&c,&l,&tiny)==0 || tiny.used!=used) bad++;
+	if(c.initialized || l.initialized) bad++;
+	destroy_la_arena(&tiny);
+
+	destroy_la_arena(&ws);
+	destroy_matrix(&A);
+	destroy_matrix(&S);
+	destroy_matrix(&pts);
+	destroy_matrix(&Qref);
+	destroy_matrix(&Rref);
+	destroy_matrix(&Aref);
+	destroy_vector(&b);
+	destroy_vector(&xref);
+	destroy_vector(&xqref);
+	destroy_vector(&cref);
+	destroy_vector(&lref);
+	return bad ? -1 : 0;
+}
+
 int main(){
 	printf("Let's test some linear algebra functions....\n\n");
 	
@@ -86,6 +479,37 @@ int main(){
 	destroy_matrix(&Q);
 	destroy_matrix(&R);
 
+	// allocating vs allocation-free operations
+	printf("\nTime per call, allocating vs *_into, %d calls each\n", \
+															BENCH_CALLS);
+	int i;
+	for(i=0;i<(int)(sizeof(bench_sizes)/sizeof(int));i++){
+		if(bench_into(bench_sizes[i])<0){
+			printf("FAIL: *_into result differs at size %d\n",bench_sizes[i]);
+			return -1;
+		}
+	}
+	if(check_in_place()<0){
+		printf("FAIL: in place *_into result differs\n");
+		return -1;
+	}
+	for(i=0;i<(int)(sizeof(bench_sizes)/sizeof(int));i++){
+		if(check_symmetric(bench_sizes[i])<0){
+			printf("FAIL: Cholesky/LDL' result differs at size %d\n", \
+															bench_sizes[i]);
+			return -1;
+		}
+	}
+	printf("Cholesky and LDL' match the general solvers\n");
+	for(i=0;i<(int)(sizeof(bench_sizes)/sizeof(int));i++){
+		if(check_arena(bench_sizes[i])<0){
+			printf("FAIL: *_arena solver wrong or leaked at size %d\n", \
+															bench_sizes[i]);
+			return -1;
+		}
+	}
+	printf("*_arena solvers match, never allocate and leak nothing\n");
+
 	printf("DONE\n");
 	return 0;
 }
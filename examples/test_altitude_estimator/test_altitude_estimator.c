@@ -0,0 +1,99 @@
+/*******************************************************************************
+* test_altitude_estimator.c
+*
+* Replays a synthetic flight through the altitude estimator without needing
+* any hardware. A known altitude trajectory is sampled by a simulated 25hz
+* barometer with gaussian noise and a 200hz accelerometer with noise and a
+* constant bias. The estimate is compared against the true trajectory and
+* against the raw barometer, then the replay is repeated to time each step.
+*******************************************************************************/
+
+#include <bb_blue_api.h>
+
+#define IMU_HZ			200
+#define BARO_HZ			25
+#define DURATION_S		120
+#define SETTLE_S		10		// ignore the initial transient in statistics
+#define TIME_CONSTANT	1.5
+
+#define BARO_NOISE		0.5		// std deviation in m
+#define ACCEL_NOISE		0.1		// std deviation in m/s^2
+#define ACCEL_BIAS		0.15	// m/s^2
+#define TIMING_REPEATS	100
+
+#define STEPS (IMU_HZ*DURATION_S)
+
+float true_alt[STEPS], true_vel[STEPS];
+float accel_z[STEPS], baro_alt[STEPS];
+
+// approximately normal with unit variance, sum of 3 uniform(-1,1)
+float gaussian(){
+	return get_random_float() + get_random_float() + get_random_float();
+}
+
+// slow climb and descent with a faster bob on top
+void generate_trajectory(){
+	int i;
+	float t, baro = 0;
+	srand(1);
+	for(i=0;i<STEPS;i++){
+		t = (float)i/IMU_HZ;
+		true_alt[i] = 10.0*(1.0-cos(0.2*t)) + sin(1.5*t);
+		true_vel[i] = 2.0*sin(0.2*t) + 1.5*cos(1.5*t);
+		accel_z[i]  = 0.4*cos(0.2*t) - 2.25*sin(1.5*t);
+		accel_z[i] += ACCEL_BIAS + ACCEL_NOISE*gaussian();
+		// barometer holds its last value between samples
+		if(i%(IMU_HZ/BARO_HZ)==0) baro = true_alt[i] + BARO_NOISE*gaussian();
+		baro_alt[i] = baro;
+	}
+}
+
+int main(){
+	int i, j, n = 0;
+	float e, alt_sq = 0, vel_sq = 0, baro_sq = 0;
+	altitude_estimator_t est;
+	timespec start, end;
+
+	printf("\nReplaying %ds of synthetic flight at %dhz\n", DURATION_S, IMU_HZ);
+	generate_trajectory();
+
+	est = create_altitude_estimator(1.0/IMU_HZ, TIME_CONSTANT);
+	reset_altitude_estimator(&est, baro_alt[0]);
+	for(i=0;i<STEPS;i++){
+		march_altitude_estimator(&est, accel_z[i], baro_alt[i]);
+		if(i < SETTLE_S*IMU_HZ) continue;
+		e = est.alt - true_alt[i];
+		alt_sq += e*e;
+		e = est.climb_rate - true_vel[i];
+		vel_sq += e*e;
+		e = baro_alt[i] - true_alt[i];
+		baro_sq += e*e;
+		n++;
+	}
+
+	printf("raw barometer   rms altitude error: %6.3f m\n", sqrt(baro_sq/n));
+	printf("estimator       rms altitude error: %6.3f m\n", sqrt(alt_sq/n));
+	printf("estimator     rms climb rate error: %6.3f m/s\n", sqrt(vel_sq/n));
+	printf("estimated accel bias: %6.3f m/s^2 (true %6.3f)\n", \
+												est.accel_bias, ACCEL_BIAS);
+
+	// time the replay on its own
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(j=0;j<TIMING_REPEATS;j++){
+		reset_altitude_estimator(&est, baro_alt[0]);
+		for(i=0;i<STEPS;i++){
+			march_altitude_estimator(&est, accel_z[i], baro_alt[i]);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	e = timespec_to_micros(timespec_diff(start,end))*1000.0;
+	printf("%6.1f ns per step over %d steps\n", e/(STEPS*TIMING_REPEATS), \
+													STEPS*TIMING_REPEATS);
+
+	if(sqrt(alt_sq/n) >= sqrt(baro_sq/n)){
+		printf("FAIL: estimate is no better than the raw barometer\n");
+		return -1;
+	}
+	printf("DONE\n");
+	return 0;
+}
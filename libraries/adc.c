@@ -7,9 +7,46 @@ Description: Userspace API for TSC-ADC module in beaglebone black**/
 #include "sensor_config.h"
 
 
+/*******************************************************************************
+* Battery monitor service state
+*******************************************************************************/
+typedef struct battery_snapshot_t{
+	float lipo_v;		// filtered LiPo voltage
+	float jack_v;		// filtered DC jack voltage
+	float motor_scale;	// duty multiplier applied by set_motor()
+} battery_snapshot_t;
+
+int batt_running;
+int batt_lipo_fd;
+int batt_jack_fd;
+float batt_sample_rate_hz;
+float batt_time_constant_s;
+float motor_comp_nominal_v; // 0 when compensation is disabled
+pthread_t batt_thread;
+seqlock_t batt_lock;
+battery_snapshot_t batt_snapshot = {0, 0, 1.0};
+
+void* battery_monitor_thread(void* ptr);
+
+
+/*******************************************************************************
+* int adc_read_raw_fd(int fd)
+*
+* reads the ascii raw value from an already open in_voltageX_raw sysfs file.
+* pread from offset 0 lets the same descriptor be sampled repeatedly without
+* reopening the file.
+*******************************************************************************/
+int adc_read_raw_fd(int fd){
+	char buf[MAX_BUF];
+	int len = pread(fd, buf, sizeof(buf)-1, 0);
+	if(len<=0) return -1;
+	buf[len] = 0;
+	return atoi(buf);
+}
+
 int adc_read_raw(int ch){
 
-	int fd;
+	int fd, raw;
 	char buf[MAX_BUF];
 
 	snprintf(buf, sizeof(buf), SYSFS_ADC_DIR "/in_voltage%d_raw", ch);
@@ -21,9 +58,9 @@ int adc_read_raw(int ch){
 		return fd;
 	}
 
-	read(fd, &ch, 4);
+	raw = adc_read_raw_fd(fd);
 	close(fd);
-	return ch;
+	return raw;
 
 }
 
@@ -75,3 +112,237 @@ float get_dc_jack_voltage(){
 	if(v<0.3) v = 0.0;
 	return v;
 }
+
+
+/*******************************************************************************
+* float raw_to_divider_voltage(int raw, float offset)
+*
+* converts a raw adc reading of one of the two voltage dividers on the board
+* to the voltage on the high side of the divider.
+*******************************************************************************/
+float raw_to_divider_voltage(int raw, float offset){
+	float v = (raw*1.8/4095.0*V_DIV_RATIO)-offset;
+	if(v<0.3) v = 0.0;
+	return v;
+}
+
+/*******************************************************************************
+* int initialize_battery_monitor(float sample_rate_hz, float time_constant_s)
+*
+* Opens the LiPo and DC jack adc channels once and starts a background thread
+* which samples both at sample_rate_hz through a first order lowpass filter
+* with the given time constant. Results are read back with
+* get_filtered_battery_voltage() and get_filtered_dc_jack_voltage().
+*******************************************************************************/
+int initialize_battery_monitor(float sample_rate_hz, float time_constant_s){
+	char buf[MAX_BUF];
+
+	if(sample_rate_hz<=0 || sample_rate_hz>1000){
+		printf("ERROR: battery monitor rate must be between 0 & 1000hz\n");
+		return -1;
+	}
+	if(time_constant_s<(1.0/sample_rate_hz)){
+		printf("ERROR: battery monitor time constant must be >= 1/rate\n");
+		return -1;
+	}
+	if(batt_running){
+		printf("WARNING: battery monitor already running\n");
+		return 0;
+	}
+
+	snprintf(buf, sizeof(buf), SYSFS_ADC_DIR "/in_voltage%d_raw", LIPO_ADC_CH);
+	batt_lipo_fd = open(buf, O_RDONLY);
+	if(batt_lipo_fd<0){
+		perror("in_voltage_raw");
+		return -1;
+	}
+	snprintf(buf, sizeof(buf), SYSFS_ADC_DIR "/in_voltage%d_raw", DC_JACK_ADC_CH);
+	batt_jack_fd = open(buf, O_RDONLY);
+	if(batt_jack_fd<0){
+		perror("in_voltage_raw");
+		close(batt_lipo_fd);
+		return -1;
+	}
+
+	batt_sample_rate_hz = sample_rate_hz;
+	batt_time_constant_s = time_constant_s;
+	batt_running = 1;
+	if(pthread_create(&batt_thread, NULL, battery_monitor_thread, NULL)){
+		printf("ERROR: failed to start battery monitor thread\n");
+		batt_running = 0;
+		close(batt_lipo_fd);
+		close(batt_jack_fd);
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int stop_battery_monitor()
+*
+* signals the battery monitor thread to stop and allows up to 1 second for it
+* to shut down before closing the adc file descriptors. Once the thread has
+* exited the published values are cleared and motor voltage compensation
+* falls back to a scale of 1.0. If it fails to exit in time the values and
+* the file descriptors are left alone since the thread is still using them.
+*******************************************************************************/
+int stop_battery_monitor(){
+	battery_snapshot_t s;
+
+	if(batt_running){
+		batt_running = 0;
+		timespec thread_timeout;
+		clock_gettime(CLOCK_REALTIME, &thread_timeout);
+		timespec_add(&thread_timeout, 1.0);
+		if(pthread_timedjoin_np(batt_thread, NULL, &thread_timeout)==ETIMEDOUT){
+			printf("WARNING: battery monitor thread exit timeout\n");
+			return -1;
+		}
+		close(batt_lipo_fd);
+		close(batt_jack_fd);
+	}
+
+	// the monitor thread is gone so this is now the only writer
+	memset(&s, 0, sizeof(s));
+	s.motor_scale = 1.0;
+	seqlock_write_begin(&batt_lock);
+	batt_snapshot = s;
+	seqlock_write_end(&batt_lock);
+	return 0;
+}
+
+/*******************************************************************************
+* int is_battery_monitor_running()
+*
+* returns 1 if the background battery monitor is running, 0 otherwise
+*******************************************************************************/
+int is_battery_monitor_running(){
+	return batt_running;
+}
+
+/*******************************************************************************
+* battery_snapshot_t read_battery_snapshot()
+*
+* consistent copy of the latest values published by the monitor thread
+*******************************************************************************/
+battery_snapshot_t read_battery_snapshot(){
+	battery_snapshot_t s;
+	unsigned int seq;
+	do{
+		seq = seqlock_read_begin(&batt_lock);
+		s = batt_snapshot;
+	}while(seqlock_read_retry(&batt_lock, seq));
+	return s;
+}
+
+/*******************************************************************************
+* float get_filtered_battery_voltage()
+* float get_filtered_dc_jack_voltage()
+*
+* return the latest lowpass filtered voltages from the battery monitor. These
+* never touch the adc and are safe to call from any thread at any rate.
+* Return 0 if the monitor has not been started.
+*******************************************************************************/
+float get_filtered_battery_voltage(){
+	return read_battery_snapshot().lipo_v;
+}
+
+float get_filtered_dc_jack_voltage(){
+	return read_battery_snapshot().jack_v;
+}
+
+/*******************************************************************************
+* int enable_motor_voltage_compensation(float nominal_v)
+*
+* When enabled, set_motor() scales every duty cycle by nominal_v divided by
+* the filtered battery voltage so motors see the same average voltage as the
+* pack discharges. The division happens in the monitor thread, set_motor()
+* only multiplies. If the measured battery voltage is implausible (for example
+* running from the DC jack with no pack) the scale falls back to 1.0.
+* The battery monitor must be running.
+*******************************************************************************/
+int enable_motor_voltage_compensation(float nominal_v){
+	if(nominal_v<=0){
+		printf("ERROR: nominal voltage must be positive\n");
+		return -1;
+	}
+	if(batt_running==0){
+		printf("ERROR: start the battery monitor before enabling compensation\n");
+		return -1;
+	}
+	__atomic_store(&motor_comp_nominal_v, &nominal_v, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*******************************************************************************
+* int disable_motor_voltage_compensation()
+*
+* set_motor() goes back to writing the requested duty unmodified. Only the
+* nominal voltage is cleared here, the monitor thread stays the sole writer
+* of the snapshot and publishes a scale of 1.0 from its next sample on.
+*******************************************************************************/
+int disable_motor_voltage_compensation(){
+	float zero = 0;
+	__atomic_store(&motor_comp_nominal_v, &zero, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*******************************************************************************
+* float get_motor_voltage_compensation()
+*
+* returns the duty cycle multiplier currently applied by set_motor(). This is
+* 1.0 as soon as compensation is disabled, even before the monitor thread
+* publishes its next sample.
+*******************************************************************************/
+float get_motor_voltage_compensation(){
+	float nominal;
+	__atomic_load(&motor_comp_nominal_v, &nominal, __ATOMIC_ACQUIRE);
+	if(nominal<=0) return 1.0;
+	return read_battery_snapshot().motor_scale;
+}
+
+/*******************************************************************************
+* void* battery_monitor_thread(void* ptr)
+*
+* background thread started by initialize_battery_monitor(). The filters are
+* prefilled with the first reading so the output doesn't ramp up from 0.
+*******************************************************************************/
+void* battery_monitor_thread(void* ptr){
+	float dt = 1.0/batt_sample_rate_hz;
+	float lipo, jack, nominal;
+	battery_snapshot_t s;
+	d_filter_t lipo_lp, jack_lp;
+
+	lipo_lp = create_first_order_lowpass(dt, batt_time_constant_s);
+	jack_lp = create_first_order_lowpass(dt, batt_time_constant_s);
+	lipo = raw_to_divider_voltage(adc_read_raw_fd(batt_lipo_fd), LIPO_OFFSET);
+	jack = raw_to_divider_voltage(adc_read_raw_fd(batt_jack_fd), DC_JACK_OFFSET);
+	prefill_filter_inputs(&lipo_lp, lipo);
+	prefill_filter_outputs(&lipo_lp, lipo);
+	prefill_filter_inputs(&jack_lp, jack);
+	prefill_filter_outputs(&jack_lp, jack);
+
+	while(batt_running && get_state()!=EXITING){
+		lipo = raw_to_divider_voltage(adc_read_raw_fd(batt_lipo_fd),LIPO_OFFSET);
+		jack = raw_to_divider_voltage(adc_read_raw_fd(batt_jack_fd),DC_JACK_OFFSET);
+		s.lipo_v = march_filter(&lipo_lp, lipo);
+		s.jack_v = march_filter(&jack_lp, jack);
+
+		// only compensate when the pack voltage is plausible for the nominal
+		s.motor_scale = 1.0;
+		__atomic_load(&motor_comp_nominal_v, &nominal, __ATOMIC_ACQUIRE);
+		if(nominal>0 && s.lipo_v>(0.6*nominal) && s.lipo_v<(1.4*nominal)){
+			s.motor_scale = nominal/s.lipo_v;
+		}
+
+		seqlock_write_begin(&batt_lock);
+		batt_snapshot = s;
+		seqlock_write_end(&batt_lock);
+
+		usleep(1000000/batt_sample_rate_hz);
+	}
+
+	destroy_filter(&lipo_lp);
+	destroy_filter(&jack_lp);
+	return NULL;
+}
@@ -161,6 +161,7 @@ int initialize_board(){
 *	you should call this before your main() function returns
 *******************************************************************************/
 int cleanup_board(){
+	int i;
 	// just in case the user forgot, set state to exiting
 	set_state(EXITING);
 	
@@ -211,8 +212,19 @@ int cleanup_board(){
 	#ifdef DEBUG
 	printf("stopping dsm2 service\n");
 	#endif
+	rc_input_stop();
 	stop_dsm2_service();
 	
+	#ifdef DEBUG
+	printf("stopping background services\n");
+	#endif
+	stop_battery_monitor();
+	stop_barometer_sampler();
+	i2c_async_stop(1);
+	i2c_async_stop(2);
+	stop_uart_reactor();
+	for(i=0;i<6;i++) stop_uart_tx_queue(i);
+	
 	/* only turn off pru if it was enbaled, otherwise segfaults
 	if(pru_initialized){	
 		#ifdef DEBUG
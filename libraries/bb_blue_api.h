@@ -32,6 +32,8 @@
 #include <math.h>		// atan2 and fabs
 #include <signal.h>		// capture ctrl-c
 #include <linux/input.h>// buttons
+#include <linux/i2c.h>	// i2c_msg for batched transactions
+#include <linux/i2c-dev.h>
 #include <poll.h> 		// interrupt events
 #include <sys/mman.h>	// mmap for accessing eQep
 #include <sys/socket.h>	// mavlink udp socket	
@@ -313,12 +315,43 @@ int set_encoder_pos(int ch, int value);
 * 12-bit ADC. get_adc_volt(int ch) additionally converts this raw value to 
 * a voltage. ch must be from 0 to 6.
 *
+* @ int initialize_battery_monitor(float sample_rate_hz, float time_constant_s)
+* @ int stop_battery_monitor()
+*
+* Starts or stops a background thread which samples both voltage dividers at
+* sample_rate_hz through a first order lowpass filter with the given time
+* constant in seconds. cleanup_board() stops it for you.
+*
+* @ float get_filtered_battery_voltage()
+* @ float get_filtered_dc_jack_voltage()
+*
+* Return the latest filtered voltages published by the battery monitor. Unlike
+* get_battery_voltage() these never read the ADC so they are cheap enough to
+* call from a control loop.
+*
+* @ int enable_motor_voltage_compensation(float nominal_v)
+* @ int disable_motor_voltage_compensation()
+* @ float get_motor_voltage_compensation()
+*
+* Optional motor-layer battery compensation. While enabled, set_motor()
+* multiplies every duty cycle by nominal_v over the filtered battery voltage
+* so a controller tuned at nominal_v behaves the same as the pack discharges.
+* get_motor_voltage_compensation() returns the multiplier currently in use.
+*
 * See the test_adc example for sample use case.
 ******************************************************************************/
 float get_battery_voltage();
 float get_dc_jack_voltage();
 int   get_adc_raw(int ch);
 float get_adc_volt(int ch);
+int   initialize_battery_monitor(float sample_rate_hz, float time_constant_s);
+int   stop_battery_monitor();
+int   is_battery_monitor_running();
+float get_filtered_battery_voltage();
+float get_filtered_dc_jack_voltage();
+int   enable_motor_voltage_compensation(float nominal_v);
+int   disable_motor_voltage_compensation();
+float get_motor_voltage_compensation();
 
 
 /******************************************************************************
@@ -438,9 +471,50 @@ int send_servo_pulse_us_all(int us);
 * returns the number of milliseconds since the last dsm2 packet was received.
 * if no packet has ever been received, return -1;
 *
+* @ int get_dsm2_data(dsm2_data_t* data)
+*
+* Copies the last complete set of channels along with its resolution and the
+* micros_since_boot() time it was completed. Unlike calling get_dsm2_ch_raw()
+* once per channel, every value is guaranteed to come from the same frame.
+* Lock-free, never waits for the parser.
+*
+* @ int wait_dsm2_frame(float timeout_s)
+*
+* Sleeps until the next complete frame is published, then returns 0. Returns
+* -1 if none arrives within timeout_s, negative timeouts wait until a frame
+* arrives or the program state becomes EXITING. Lets
+* a control loop run exactly once per frame instead of polling
+* is_new_dsm2_data().
+*
+* @ uint64_t get_dsm2_sync_losses()
+*
+* DSM2 frames are found from the quiet gap between them rather than by
+* counting bytes. This returns how many frames were cut short by a gap, each
+* one meaning a single frame was dropped before the parser realigned.
+*
+* @ uint64_t get_dsm2_decode_errors()
+*
+* Number of complete frames dsm_decode() rejected because of an impossible
+* channel id, usually line noise.
+*
+* @ int dsm_decode(const uint8_t* buf, dsm_frame_t* frame)
+*
+* The decoder used by the service, exposed so recorded streams can be decoded
+* and tested without a UART. Decodes one 16 byte frame into frame and touches
+* nothing else. Set frame->resolution to 10 or 11 to force that layout or to
+* 0 to have it detected and written back. Returns the number of channel
+* words decoded or -1 for a bad frame.
+*
+* @ int dsm_decode_locked(dsm_res_lock_t* lock, const uint8_t* buf,
+*													dsm_frame_t* frame)
+*
+* dsm_decode() the way the service runs it. The resolution is detected until
+* DSM2_RES_LOCK_FRAMES frames in a row agree, then locked until as many
+* frames in a row fail to decode. Zero lock before the first frame.
+*
 * @ int stop_dsm2_service()
 *
-* stops the background thread. Not necessary to be called by the user as
+* stops parsing DSM2 data. Not necessary to be called by the user as
 * cleanup_cape() calls this anyway.
 *
 * @ int bind_dsm2()
@@ -454,6 +528,29 @@ int send_servo_pulse_us_all(int us);
 *
 * see test_dsm2, calibrate_dsm2, and dsm2_passthroguh examples for use cases.
 ******************************************************************************/
+#define DSM2_MAX_CHANNELS 9
+#define DSM2_RES_LOCK_FRAMES 8	// agreeing frames before resolution locks
+
+typedef struct dsm2_data_t{
+	int ch[DSM2_MAX_CHANNELS];	// microseconds, 0 for unused channels
+	int num_channels;
+	int resolution;				// 10 or 11 bit, 0 before the first frame
+	uint64_t timestamp_us;		// micros_since_boot() when completed
+} dsm2_data_t;
+
+typedef struct dsm_frame_t{
+	int resolution;		// 10 or 11, 0 to detect
+	int num_words;		// channel words decoded, up to 7
+	uint8_t ch_id[7];	// 0 indexed channel of each word
+	int16_t value[7];	// microseconds
+} dsm_frame_t;
+
+typedef struct dsm_res_lock_t{
+	int locked;		// 10 or 11 once stable, 0 while detecting
+	int seen;		// last detected resolution
+	int count;		// agreeing detections or errors in a row
+} dsm_res_lock_t;
+
 int   initialize_dsm2();
 int   is_new_dsm2_data();
 int   is_dsm2_active();
@@ -461,6 +558,13 @@ int   set_new_dsm2_data_func(int (*func)(void));
 int   get_dsm2_ch_raw(int channel);
 float get_dsm2_ch_normalized(int channel);
 int   ms_since_last_dsm2_packet();
+int   get_dsm2_data(dsm2_data_t* data);
+int   wait_dsm2_frame(float timeout_s);
+uint64_t get_dsm2_sync_losses();
+uint64_t get_dsm2_decode_errors();
+int   dsm_decode(const uint8_t* buf, dsm_frame_t* frame);
+int   dsm_decode_locked(dsm_res_lock_t* lock, const uint8_t* buf, \
+													dsm_frame_t* frame);
 int   get_dsm2_frame_resolution();
 int   get_num_dsm2_channels();
 int   stop_dsm2_service();
@@ -468,6 +572,91 @@ int   bind_dsm2();
 int   calibrate_dsm2_routine();
 
 
+/******************************************************************************
+* RC input
+*
+* SBUS and CRSF receivers can be plugged into the DSM2 socket instead of a
+* DSM2 satellite. These functions work the same whichever protocol is
+* running, with up to RC_MAX_CHANNELS channels.
+*
+* @ int rc_input_start(rc_protocol_t protocol)
+* @ int rc_input_stop()
+*
+* Starts or stops receiving. RC_PROTOCOL_DSM2 runs the DSM2 service above.
+* RC_PROTOCOL_SBUS expects 100000 baud 8E2. The BeagleBone UART can't invert
+* its input so SBUS needs an inverter, or a receiver with uninverted output.
+* RC_PROTOCOL_CRSF expects 420000 baud 8N1, which is what a CRSF receiver
+* sends at up to 500 frames per second.
+*
+* @ int rc_input_get_data(rc_input_data_t* data)
+* @ int rc_input_wait_frame(float timeout_s)
+*
+* Lock-free copy of the latest frame, and a sleep until the next one arrives
+* which returns -1 on timeout. See get_dsm2_data() and wait_dsm2_frame().
+*
+* @ int rc_input_get_raw(int ch)
+* @ float rc_input_get_normalized(int ch)
+*
+* Channel 1 to RC_MAX_CHANNELS in microseconds, or scaled -1 to 1 between
+* the calibrated min and max exactly like get_dsm2_ch_normalized(). SBUS and
+* CRSF read calibration from sbus.cal and crsf.cal in the same format as
+* dsm2.cal, one "min max" line per channel.
+*
+* @ int rc_input_num_channels()
+* @ int rc_input_ms_since_last_frame()
+* @ int rc_input_is_active()
+* @ uint64_t rc_input_errors()
+*
+* rc_input_is_active() returns 0 once frames stop or the receiver reports
+* failsafe. rc_input_errors() counts frames dropped for bad framing or crc.
+*
+* @ int sbus_parse_byte(rc_parser_t* p, uint8_t b, rc_input_data_t* out)
+* @ int crsf_parse_byte(rc_parser_t* p, uint8_t b, rc_input_data_t* out)
+*
+* The streaming parsers used by the service, for decoding recorded data.
+* Clear an rc_parser_t with rc_parser_reset() then feed bytes one at a time.
+* Returns 1 when b completed a channel frame, written to out. A bad frame
+* costs only itself, the bytes after it are searched for the next one.
+******************************************************************************/
+#define RC_MAX_CHANNELS		16
+#define RC_PARSER_BUF_BYTES	64
+
+typedef enum rc_protocol_t{
+	RC_PROTOCOL_DSM2,
+	RC_PROTOCOL_SBUS,
+	RC_PROTOCOL_CRSF
+} rc_protocol_t;
+
+typedef struct rc_input_data_t{
+	int ch[RC_MAX_CHANNELS];	// microseconds, 0 for unused channels
+	int num_channels;
+	int failsafe;				// receiver reports lost link
+	uint64_t timestamp_us;		// micros_since_boot() when received
+} rc_input_data_t;
+
+typedef struct rc_parser_t{
+	uint8_t buf[RC_PARSER_BUF_BYTES];
+	int pos;
+	int resyncing;		// searching for a frame start after an error
+	uint64_t frames;	// good frames of any type
+	uint64_t errors;	// times a bad frame was dropped
+} rc_parser_t;
+
+int   rc_input_start(rc_protocol_t protocol);
+int   rc_input_stop();
+int   rc_input_get_data(rc_input_data_t* data);
+int   rc_input_wait_frame(float timeout_s);
+int   rc_input_get_raw(int ch);
+float rc_input_get_normalized(int ch);
+int   rc_input_num_channels();
+int   rc_input_ms_since_last_frame();
+int   rc_input_is_active();
+uint64_t rc_input_errors();
+void  rc_parser_reset(rc_parser_t* p);
+int   sbus_parse_byte(rc_parser_t* p, uint8_t b, rc_input_data_t* out);
+int   crsf_parse_byte(rc_parser_t* p, uint8_t b, rc_input_data_t* out);
+
+
 /******************************************************************************
 * 9-AXIS IMU
 *
@@ -661,7 +850,36 @@ uint64_t micros_since_last_interrupt();
 *
 * The robotics cape features a barometer for measuring altitude. 
 *
-* int initialize_barometer()
+* @ int initialize_barometer(bmp_oversample_t oversampling)
+*
+* Opens the sensor's sysfs files once, sets the oversampling and takes a first
+* reading. power_down_barometer() stops the sampler and closes them again.
+*
+* @ int read_barometer()
+*
+* Reads temperature and pressure, computes altitude and publishes all three.
+* While the sampler is running it leaves the sampler's snapshot alone and
+* returns 0.
+*
+* @ int start_barometer_sampler()
+* @ int stop_barometer_sampler()
+*
+* Instead of calling read_barometer() yourself, a background thread can do it
+* at the measurement rate of the chosen oversampling. 
+*
+* @ int bmp_get_data(bmp_data_t* data)
+* @ float bmp_get_temperature_c()
+* @ float bmp_get_pressure_pa()
+* @ float bmp_get_altitude_m()
+*
+* Return the latest published values. These are lock-free copies of memory
+* and never wait for the sensor or the sampler thread. bmp_get_data() returns
+* all values from the same reading along with its timestamp.
+*
+* @ float bmp_pressure_to_altitude_m(float pressure_pa, float sea_level_pa)
+*
+* Single precision barometric altitude formula, accurate to 0.01m between
+* -800m and 6200m. Used internally and exposed for your own conversions.
 *******************************************************************************/
 typedef enum bmp_oversample_t{
 	BMP_OVERSAMPLE_1,
@@ -671,13 +889,24 @@ typedef enum bmp_oversample_t{
 	BMP_OVERSAMPLE_16
 } bmp_oversample_t;
 
+typedef struct bmp_data_t{
+	float temp_c;			// degrees Celsius
+	float pressure_pa;		// pascals
+	float alt_m;			// meters above sea level pressure
+	uint64_t timestamp_us;	// micros_since_epoch() when read
+} bmp_data_t;
+
 int initialize_barometer(bmp_oversample_t oversampling);
 int power_down_barometer();
 int read_barometer();
+int start_barometer_sampler();
+int stop_barometer_sampler();
+int bmp_get_data(bmp_data_t* data);
 float bmp_get_temperature_c();
 float bmp_get_pressure_pa();
 float bmp_get_altitude_m();
 int set_sea_level_pressure_pa(float pa);
+float bmp_pressure_to_altitude_m(float pressure_pa, float sea_level_pa);
 
 
 /*******************************************************************************
@@ -695,7 +924,8 @@ int set_sea_level_pressure_pa(float pa);
 * without initializing. i2c_init only needs to be called once per bus.
 * 
 * @ int set_device_address(int bus, uint8_t devAddr)
-* Use this to change to another device address after initialization.
+* Use this to change to another device address after initialization. This
+* only records the address, it costs no system call.
 * 
 * @ int i2c_close(int bus) 
 * Closes the bus and device file descriptors.
@@ -703,9 +933,17 @@ int set_sea_level_pressure_pa(float pa);
 * @int i2c_claim_bus(int bus)
 * @int i2c_release_bus(int bus)
 * @int i2c_get_in_use_state(int bus)
-* Claim and release bus are purely for the convenience of the user and are not 
-* necessary. They simply set a flag indicating that the bus is in use to help 
-* manage multiple device access in multithreaded applications.
+* Every transaction already takes the bus's mutex internally so individual
+* reads and writes from different threads never interleave. Claim the bus to
+* hold that mutex across several transactions, for example a read-modify-write
+* sequence, then release it from the same thread. Claims nest. The mutex uses
+* priority inheritance so a low priority thread holding the bus is boosted
+* rather than stalling a high priority IMU thread.
+*
+* @ int i2c_get_bus_stats(int bus, i2c_bus_stats_t* stats)
+* @ int i2c_reset_bus_stats(int bus)
+* Read or zero the bus lock counters: number of lock acquisitions, how many
+* had to wait for another thread, and the total and worst wait in ns.
 *
 * @ int i2c_read_byte(int bus, uint8_t regAddr, uint8_t *data)
 * @ int i2c_read_bytes(int bus, uint8_t regAddr, uint8_t length, uint8_t *data)
@@ -713,8 +951,35 @@ int set_sea_level_pressure_pa(float pa);
 * @ int i2c_read_words(int bus, uint8_t regAddr, uint8_t length, uint16_t *data)
 * @ int i2c_read_bit(int bus, uint8_t regAddr, uint8_t bitNum, uint8_t *data)
 * These i2c_read functions are for reading data from a particular register.
-* This sends the device address and register address to be read from before
-* reading the response. 
+* The register address is written and the response read back in a single
+* I2C_RDWR transaction with a repeated start in between.
+*
+* @ int i2c_read_bytes_from(int bus, uint8_t devAddr, uint8_t regAddr,
+*										uint8_t length, uint8_t *data)
+* @ int i2c_read_words_from(int bus, uint8_t devAddr, uint8_t regAddr,
+*										uint8_t length, uint16_t *data)
+* @ int i2c_write_bytes_to(int bus, uint8_t devAddr, uint8_t regAddr,
+*										uint8_t length, uint8_t* data)
+* Same as above but talk to devAddr for this call only, leaving the bus's
+* current device address alone. Useful when several devices share a bus
+* like the IMU and barometer do on bus 2.
+*
+* @ int i2c_read_block(int bus, uint8_t devAddr, uint8_t regAddr,
+*							size_t length, uint8_t* data, int fifo)
+* Reads any number of bytes into one contiguous buffer, for example a whole
+* 512 byte MPU FIFO. The read is split into messages of at most the bus's
+* block chunk and sent in as few I2C_RDWR transactions as possible while
+* holding the bus. Set fifo to 1 for a FIFO data register which doesn't
+* auto-increment, then the register address is only sent at the start of
+* each transaction. With fifo 0 successive registers are read. Returns 0 on
+* success.
+*
+* @ int i2c_set_block_chunk(int bus, size_t bytes)
+* @ size_t i2c_get_block_chunk(int bus)
+* Sets or gets the longest single read message i2c_read_block and async
+* requests will use, defaults to 256 bytes and can be at most 8192, the
+* longest message i2c-dev accepts. Lower it if an adapter rejects long
+* messages.
 *
 * @ int i2c_write_byte(int bus, uint8_t regAddr, uint8_t data);
 * @ int i2c_write_bytes(int bus, uint8_t regAddr, uint8_t length, uint8_t* data)
@@ -731,6 +996,13 @@ int set_sea_level_pressure_pa(float pa);
 * send only the data given by the data argument. This is useful for more
 * complicated IO such as uploading firmware to a device.
 *******************************************************************************/
+typedef struct i2c_bus_stats_t{
+	uint64_t transactions;	// times the bus lock was taken
+	uint64_t contended;		// times another thread already held it
+	uint64_t total_wait_ns;
+	uint64_t max_wait_ns;
+} i2c_bus_stats_t;
+
 int i2c_init(int bus, uint8_t devAddr);
 int i2c_close(int bus);
 int i2c_set_device_address(int bus, uint8_t devAddr);
@@ -738,22 +1010,195 @@ int i2c_set_device_address(int bus, uint8_t devAddr);
 int i2c_claim_bus(int bus);
 int i2c_release_bus(int bus);
 int i2c_get_in_use_state(int bus);
+int i2c_get_bus_stats(int bus, i2c_bus_stats_t* stats);
+int i2c_reset_bus_stats(int bus);
 
 int i2c_read_byte(int bus, uint8_t regAddr, uint8_t *data);
 int i2c_read_bytes(int bus, uint8_t regAddr, uint8_t length,  uint8_t *data);
 int i2c_read_word(int bus, uint8_t regAddr, uint16_t *data);
 int i2c_read_words(int bus, uint8_t regAddr, uint8_t length, uint16_t *data);
 int i2c_read_bit(int bus, uint8_t regAddr, uint8_t bitNum, uint8_t *data);
+int i2c_read_bytes_from(int bus, uint8_t devAddr, uint8_t regAddr, \
+									uint8_t length, uint8_t *data);
+int i2c_read_words_from(int bus, uint8_t devAddr, uint8_t regAddr, \
+									uint8_t length, uint16_t *data);
+int i2c_read_block(int bus, uint8_t devAddr, uint8_t regAddr, \
+							size_t length, uint8_t* data, int fifo);
+int i2c_set_block_chunk(int bus, size_t bytes);
+size_t i2c_get_block_chunk(int bus);
 
 int i2c_write_byte(int bus, uint8_t regAddr, uint8_t data);
 int i2c_write_bytes(int bus, uint8_t regAddr, uint8_t length, uint8_t* data);
 int i2c_write_word(int bus, uint8_t regAddr, uint16_t data);
 int i2c_write_words(int bus, uint8_t regAddr, uint8_t length, uint16_t* data);
 int i2c_write_bit(int bus, uint8_t regAddr, uint8_t bitNum, uint8_t data);
+int i2c_write_bytes_to(int bus, uint8_t devAddr, uint8_t regAddr, \
+									uint8_t length, uint8_t* data);
 
 int i2c_send_bytes(int bus, uint8_t length, uint8_t* data);
 int i2c_send_byte(int bus, uint8_t data);
 
+/*******************************************************************************
+* I2C batched transactions
+*
+* A batch queues up register reads and writes, possibly for different device
+* addresses on the same bus, and submits them all in one I2C_RDWR ioctl so a
+* full IMU and barometer poll costs a single system call. Each read lands
+* directly in the buffer given when it was queued. A batch keeps its queue
+* after being submitted so a polling loop can build it once and just call
+* i2c_batch_submit() every cycle. Queued messages point into the batch itself
+* so don't copy a built batch by value.
+*
+* @ int i2c_batch_init(i2c_batch_t* batch, int bus)
+* Empties the batch and points it at bus 1 or 2.
+*
+* @ int i2c_batch_add_read(i2c_batch_t* batch, uint8_t devAddr,
+*							uint8_t regAddr, uint16_t length, uint8_t* data)
+* Queues a read of length bytes starting at regAddr into data. data must
+* stay valid until the batch is submitted.
+*
+* @ int i2c_batch_add_write(i2c_batch_t* batch, uint8_t devAddr,
+*							uint8_t regAddr, uint8_t length, uint8_t* data)
+* Queues a register write. data is copied so the caller may reuse it.
+*
+* @ int i2c_batch_submit(i2c_batch_t* batch)
+* Sends everything queued as one combined transaction. Returns 0 on success.
+*******************************************************************************/
+#define I2C_BATCH_MAX_MSGS		I2C_RDWR_IOCTL_MAX_MSGS
+#define I2C_BATCH_WRITE_BYTES	256
+
+typedef struct i2c_batch_t{
+	int bus;
+	int nmsgs;
+	int write_len;		// bytes of write_buf used
+	struct i2c_msg msgs[I2C_BATCH_MAX_MSGS];
+	uint8_t reg_addr[I2C_BATCH_MAX_MSGS];	// register byte sent before reads
+	uint8_t write_buf[I2C_BATCH_WRITE_BYTES];
+} i2c_batch_t;
+
+int i2c_batch_init(i2c_batch_t* batch, int bus);
+int i2c_batch_add_read(i2c_batch_t* batch, uint8_t devAddr, uint8_t regAddr, \
+									uint16_t length, uint8_t* data);
+int i2c_batch_add_write(i2c_batch_t* batch, uint8_t devAddr, uint8_t regAddr, \
+									uint8_t length, uint8_t* data);
+int i2c_batch_submit(i2c_batch_t* batch);
+
+/*******************************************************************************
+* I2C asynchronous requests
+*
+* A worker thread per bus owns the bus and services requests posted from any
+* thread through a lock-free queue, so posting never blocks on the bus.
+* Requests drained together which carry the same deadline_us are coalesced
+* into one I2C_RDWR batch, earlier deadlines go first. deadline_us is just a
+* tag, micros_since_epoch() of when the data is needed works well, and 0 means
+* as soon as possible.
+*
+* The caller owns each i2c_request_t and its data buffer, both must stay valid
+* until the request completes. Completion is reported through the optional
+* callback, which runs on the worker thread, and then through the status
+* field so it can also be used as a future with i2c_async_wait().
+*
+* Reads longer than the bus's block chunk are split into several messages,
+* re-addressing successive registers or, with fifo set, reading the same
+* FIFO register back to back. Writes are limited to I2C_BATCH_WRITE_BYTES-1.
+* If a shared transaction fails there's no telling which messages already
+* took effect, so every request in it fails except those marked idempotent,
+* which are retried alone. Leave idempotent clear for FIFO drains and writes
+* with side effects like clear-on-write status registers.
+*
+* @ int i2c_async_start(int bus)
+* @ int i2c_async_stop(int bus)
+* Start and stop the worker for a bus already set up with i2c_init(). Stopping
+* fails any request still queued, including ones posted while it stops.
+*
+* @ int i2c_async_post(int bus, i2c_request_t* req)
+* Queues a filled in request. Returns -1 if the queue is full.
+*
+* @ int i2c_async_wait(int bus, i2c_request_t* req, float timeout_s)
+* Blocks until req completes. Returns 0 if it succeeded.
+*
+* @ int i2c_async_status(i2c_request_t* req)
+* Non-blocking check returning I2C_REQ_PENDING, I2C_REQ_DONE or I2C_REQ_FAILED.
+*******************************************************************************/
+#define I2C_REQ_DONE		0
+#define I2C_REQ_PENDING		1
+#define I2C_REQ_FAILED		-1
+
+typedef struct i2c_request_t{
+	uint8_t devAddr;
+	uint8_t regAddr;
+	uint16_t length;
+	uint8_t is_write;		// 0 to read into data, 1 to write data out
+	uint8_t fifo;			// reads only, regAddr doesn't auto-increment
+	uint8_t idempotent;		// safe to resend if its shared batch fails
+	uint8_t* data;
+	uint64_t deadline_us;	// requests with equal deadlines share a transaction
+	void (*callback)(struct i2c_request_t* req, int status); // optional
+	void* user;				// free for the callback's use
+	int status;
+} i2c_request_t;
+
+int i2c_async_start(int bus);
+int i2c_async_stop(int bus);
+int i2c_async_post(int bus, i2c_request_t* req);
+int i2c_async_wait(int bus, i2c_request_t* req, float timeout_s);
+int i2c_async_status(i2c_request_t* req);
+
+/*******************************************************************************
+* I2C register cache
+*
+* An optional shadow copy of one device's 8-bit registers to cut bus traffic
+* while configuring it. Reads of cacheable registers are answered from memory
+* once the value is known, and writes which wouldn't change a known value are
+* skipped. Registers holding measurements, FIFO data or status flags must be
+* marked volatile, those always go to the device. Only use the cache if
+* nothing else writes the device's cacheable registers behind its back.
+*
+* @ i2c_regcache_t create_i2c_regcache(int bus, uint8_t devAddr)
+* Returns a cache where every register is cacheable and not yet known.
+*
+* @ int i2c_regcache_set_volatile(i2c_regcache_t* cache, uint8_t first,
+*															uint8_t last)
+* Marks the inclusive register range as volatile.
+*
+* @ int i2c_regcache_invalidate(i2c_regcache_t* cache)
+* Forgets everything cached and staged, for example after a device reset.
+*
+* @ int i2c_regcache_read(i2c_regcache_t* cache, uint8_t regAddr, uint8_t* data)
+* @ int i2c_regcache_write(i2c_regcache_t* cache, uint8_t regAddr, uint8_t data)
+* @ int i2c_regcache_write_bit(i2c_regcache_t* cache, uint8_t regAddr,
+*											uint8_t bitNum, uint8_t data)
+* Cached equivalents of i2c_read_byte, i2c_write_byte and i2c_write_bit.
+* Writes go straight through to the device.
+*
+* @ int i2c_regcache_stage(i2c_regcache_t* cache, uint8_t regAddr, uint8_t data)
+* @ int i2c_regcache_flush(i2c_regcache_t* cache)
+* Stage writes to cacheable registers then send them all with flush, which
+* uses one I2C_RDWR transaction per I2C_BATCH_MAX_MSGS registers.
+*******************************************************************************/
+#define I2C_REGCACHE_SIZE	256
+
+typedef struct i2c_regcache_t{
+	int bus;
+	uint8_t devAddr;
+	uint8_t value[I2C_REGCACHE_SIZE];
+	uint8_t flags[I2C_REGCACHE_SIZE];	// valid, dirty and volatile bits
+	uint64_t hits;		// reads answered from the cache
+	uint64_t skipped;	// writes which didn't need to be sent
+	int initialized;
+} i2c_regcache_t;
+
+i2c_regcache_t create_i2c_regcache(int bus, uint8_t devAddr);
+int i2c_regcache_set_volatile(i2c_regcache_t* cache, uint8_t first, \
+															uint8_t last);
+int i2c_regcache_invalidate(i2c_regcache_t* cache);
+int i2c_regcache_read(i2c_regcache_t* cache, uint8_t regAddr, uint8_t* data);
+int i2c_regcache_write(i2c_regcache_t* cache, uint8_t regAddr, uint8_t data);
+int i2c_regcache_write_bit(i2c_regcache_t* cache, uint8_t regAddr, \
+											uint8_t bitNum, uint8_t data);
+int i2c_regcache_stage(i2c_regcache_t* cache, uint8_t regAddr, uint8_t data);
+int i2c_regcache_flush(i2c_regcache_t* cache);
+
 
 
 /*******************************************************************************
@@ -776,11 +1221,106 @@ char spi1_read_reg_byte(char reg_addr);
 int spi1_read_reg_bytes(char reg_addr, char* data, int bytes);
 int spi1_transfer(char* tx_data, int tx_bytes, char* rx_data);
 
+/*******************************************************************************
+* @ int spi1_xfer_list(spi_segment_t* segs, int n)
+*
+* Sends up to SPI_MAX_SEGMENTS segments in one SPI_IOC_MESSAGE ioctl, for
+* example a register address followed by a burst read, without chip select
+* toggling in between. Each segment has its own tx and rx buffers (either may
+* be NULL), speed_hz (0 for the bus speed), a delay after the segment and
+* cs_change to deselect the chip before the next segment. All the spi1 helpers
+* above are built on this. It always runs in the mode given to
+* initialize_spi1, even after spi_device_xfer used another one. Returns the
+* total bytes transferred or -1.
+*******************************************************************************/
+#define SPI_MAX_SEGMENTS	16
+
+typedef struct spi_segment_t{
+	const void* tx;		// bytes to send, NULL sends zeros
+	void* rx;			// where to put received bytes, NULL to discard
+	uint32_t len;
+	uint32_t speed_hz;	// 0 to use the speed from initialize_spi1
+	uint16_t delay_usecs;
+	uint8_t cs_change;
+} spi_segment_t;
+
+int spi1_xfer_list(spi_segment_t* segs, int n);
+
+/*******************************************************************************
+* SPI device handles
+*
+* Lets several slaves with different settings share SPI1, for example a fast
+* ADC on SPI1.1 and a slow display on SPI1.2, without calling initialize_spi1
+* again. Initialize the bus once, then describe each slave with
+* create_spi_device and talk to it with spi_device_xfer.
+*
+* @ spi_device_t create_spi_device(int slave, int mode, int speed_hz)
+* slave is 1 or 2 for the SPI1.1 and SPI1.2 chip selects, or 0 if you drive
+* chip select yourself.
+*
+* @ int spi_device_xfer(spi_device_t* dev, spi_segment_t* segs, int n)
+* Selects the device, applies its settings, runs the segments as with
+* spi1_xfer_list and deselects it. Segments with speed_hz 0 run at the
+* device's speed. Switching devices only costs a mode ioctl if the modes
+* differ, and chip selects are driven through value files kept open since
+* initialize_spi1. Returns the total bytes transferred or -1.
+*******************************************************************************/
+typedef struct spi_device_t{
+	int slave;
+	int mode;
+	int speed_hz;
+	int initialized;
+} spi_device_t;
+
+spi_device_t create_spi_device(int slave, int mode, int speed_hz);
+int spi_device_xfer(spi_device_t* dev, spi_segment_t* segs, int n);
+
 
 /*******************************************************************************
 * UART
+*
+* Received bytes are pulled from the driver in large reads into a receive
+* buffer per bus and the read functions are served from there, so reading a
+* line costs one system call per burst of data rather than one per byte. The
+* timeout given to initialize_uart() bounds the total time each read call may
+* block. Only read a bus from one thread at a time.
+*
+* @ int initialize_uart(int bus, int baudrate, float timeout_s)
+* Opens a bus as 8N1. Standard baud rates are set the normal way, any other
+* rate from 50 to 4000000, like 100000 or 420000, goes through termios2.
+*
+* @ int initialize_uart_low_latency(int bus, int baudrate, float timeout_s,
+*														int packet_bytes)
+* Also asks the driver for ASYNC_LOW_LATENCY and the lowest RX FIFO trigger
+* level it allows, for RC and telemetry protocols where every microsecond from
+* arrival to parse counts. With packet_bytes>0 a wait on the port, including
+* the UART reactor's, only wakes once that many bytes are waiting.
+* The line is fully raw so binary frames pass untouched.
+*
+* @ int uart_set_framing(int bus, char parity, int stop_bits)
+* Switches an initialized bus from 8N1 to parity 'N', 'E' or 'O' with 1 or 2
+* stop bits, keeping the baud rate.
+*
+* @ int uart_set_device_path(int bus, char* path)
+* Open another device, like a pty, the next time bus is initialized. Handy
+* for replaying recorded serial data into a parser without the hardware.
+*
+* @ int uart_read_bytes(int bus, int bytes, char* buf)
+* Returns once bytes have been read or on timeout with however many arrived.
+*
+* @ int uart_read_line(int bus, int max_bytes, char* buf)
+* @ int uart_read_until(int bus, int max_bytes, char* buf, char delim)
+* Read up to a '\n' or the given delimiter, which is consumed but not copied,
+* or until max_bytes have been read or the timeout passes.
+*
+* @ int uart_bytes_available(int bus)
+* Bytes that can be read without waiting.
 *******************************************************************************/
 int initialize_uart(int bus, int speed, float timeout);
+int initialize_uart_low_latency(int bus, int baudrate, float timeout_s, \
+														int packet_bytes);
+int uart_set_framing(int bus, char parity, int stop_bits);
+int uart_set_device_path(int bus, char* path);
 int close_uart(int bus);
 int get_uart_fd(int bus);
 int flush_uart(int bus);
@@ -788,6 +1328,71 @@ int uart_send_bytes(int bus, int bytes, char* data);
 int uart_send_byte(int bus, char data);
 int uart_read_bytes(int bus, int bytes, char* buf);
 int uart_read_line(int bus, int max_bytes, char* buf);
+int uart_read_until(int bus, int max_bytes, char* buf, char delim);
+int uart_bytes_available(int bus);
+
+/*******************************************************************************
+* UART reactor
+*
+* Instead of a blocking reader thread per port, any number of buses opened
+* with initialize_uart() can be serviced by one thread waiting in epoll. When
+* data arrives on a bus its parser is called from the reactor thread with the
+* bus's unread bytes as one contiguous span. The parser returns how many bytes
+* it consumed, anything left over, like the start of an incomplete packet, is
+* passed again with the next data.
+*
+* @ int start_uart_reactor()
+* @ int stop_uart_reactor()
+* Start or stop the reactor thread.
+*
+* @ int uart_reactor_add(int bus, uart_parser_t parser, void* ctx)
+* @ int uart_reactor_remove(int bus)
+* Hand a bus to the running reactor with ctx passed through to the parser, or
+* take it back. Don't use the uart_read functions on a bus the reactor owns.
+* Once remove returns the parser is no longer running and won't be called.
+*
+* @ uint64_t uart_reactor_overflows(int bus)
+* Times the parser consumed nothing from a full buffer so it was discarded.
+*
+* @ int uart_reactor_dead(int bus)
+* Returns 1 if a read error or hangup made the reactor drop the bus.
+*******************************************************************************/
+typedef int (*uart_parser_t)(int bus, const char* data, int len, void* ctx);
+
+int start_uart_reactor();
+int stop_uart_reactor();
+int uart_reactor_add(int bus, uart_parser_t parser, void* ctx);
+int uart_reactor_remove(int bus);
+uint64_t uart_reactor_overflows(int bus);
+int uart_reactor_dead(int bus);
+
+/*******************************************************************************
+* UART transmit queue
+*
+* uart_send_bytes() blocks while the transmit FIFO is full. For threads which
+* must never stall, like a controller sending telemetry, start a transmit
+* queue on the bus and use uart_queue_bytes() instead. It copies the message
+* into a lock-free queue and returns at once. A writer thread per bus sends
+* queued messages, grouping several into each writev(). When the link can't
+* keep up, messages are dropped whole and counted instead of blocking.
+*
+* @ int start_uart_tx_queue(int bus)
+* @ int stop_uart_tx_queue(int bus)
+* Start the writer for an initialized bus, or stop it after it sends what is
+* already queued.
+*
+* @ int uart_queue_bytes(int bus, int bytes, const char* data)
+* Queues a message of up to UART_TX_SLOT_BYTES. Returns bytes or -1 if full.
+*
+* @ uint64_t uart_tx_dropped_bytes(int bus)
+* Bytes dropped because the queue was full or a write failed.
+*******************************************************************************/
+#define UART_TX_SLOT_BYTES	512	// longest single queued message
+
+int start_uart_tx_queue(int bus);
+int stop_uart_tx_queue(int bus);
+int uart_queue_bytes(int bus, int bytes, const char* data);
+uint64_t uart_tx_dropped_bytes(int bus);
 
 /*******************************************************************************
 * @ int kill_robot()
@@ -861,6 +1466,11 @@ int kill_robot();
 * handy function for getting current time in microseconds
 * so you don't have to deal with timespec structs
 *
+* @ uint64_t micros_since_boot()
+*
+* same but from the monotonic clock, which never jumps when the system time
+* is set. Use this for measuring intervals.
+*
 * @ int suppress_stdout(int (*func)(void))
 *
 * Executes a functiton func with all outputs to stdout suppressed. func must
@@ -893,6 +1503,7 @@ void timespec_add(timespec* start, float seconds);
 uint64_t timespec_to_micros(timespec ts);
 uint64_t timeval_to_micros(timeval tv);
 uint64_t micros_since_epoch();
+uint64_t micros_since_boot();
 int suppress_stdout(int (*func)(void));
 int suppress_stderr(int (*func)(void));
 int continue_or_quit();
@@ -924,23 +1535,47 @@ void vector3CrossProduct(float a[3], float b[3], float d[3]);
 /*******************************************************************************
 * Linear Algebra
 *
-*
+* Matrices are row major in a single 16-byte aligned block. Each row starts on
+* a 16 byte boundary, so rows are padded out to stride floats, a multiple of 4
+* which is one NEON quad register. Element (i,j) lives at mem[i*stride+j] and
+* is best reached with the MATRIX_ELEM(A,i,j) macro.
+*
+* Matrices from create_matrix() also fill in data[] with a pointer to each row
+* so existing code using A.data[i][j] keeps working. wrap_matrix() places a
+* matrix over caller-owned memory such as a stack array without allocating
+* anything. Wrapped matrices have no row pointers (data is NULL) and must be
+* accessed with MATRIX_ELEM(), get_matrix_entry() or set_matrix_entry().
+* destroy_matrix() never frees wrapped memory.
+*
+* example of a 3x3 on the stack:
+* float mem[3*MATRIX_STRIDE(3)] __attribute__((aligned(MATRIX_ALIGN)));
+* matrix_t A = wrap_matrix(3, 3, 0, mem);
 *******************************************************************************/
+#define MATRIX_ALIGN		16
+#define MATRIX_STRIDE(cols)	(((cols)+3) & ~3)
+#define MATRIX_ELEM(A,i,j)	((A).mem[(i)*(A).stride+(j)])
+#define MATRIX_ROW(A,i)		((A).mem+(i)*(A).stride)
+
 typedef struct matrix_t{
 	int rows;
 	int cols;
-	float** data;
+	int stride;		// floats from the start of one row to the next
+	float* mem;		// aligned row major storage
+	float** data;	// row pointers into mem, NULL for wrapped matrices
+	int owner;		// 1 if destroy_matrix() should free mem
 	int initialized;
 } matrix_t;
 
 typedef struct vector_t{
 	int len;
 	float* data;
+	int owner;		// 1 if destroy_vector() should free data
 	int initialized;
 } vector_t;
 
 // Basic Matrix creation, modification, and access
 matrix_t create_matrix(int rows, int cols);
+matrix_t wrap_matrix(int rows, int cols, int stride, float* mem);
 void destroy_matrix(matrix_t* A);
 matrix_t create_empty_matrix();
 matrix_t duplicate_matrix(matrix_t A);
@@ -956,6 +1591,7 @@ void print_matrix_sci_notation(matrix_t A);
 
 // Basic Vector creation, modification, and access
 vector_t create_vector(int n);
+vector_t wrap_vector(int len, float* mem);
 void destroy_vector(vector_t* v);
 vector_t create_empty_vector();
 vector_t duplicate_vector(vector_t v);
@@ -967,6 +1603,23 @@ float get_vector_entry(vector_t v, int pos);
 void print_vector(vector_t v);
 void print_vector_sci_notation(vector_t v);
 
+// Allocation-free versions of the operations below, see linear_algebra.c.
+// out must already have the size of the result, 0 on success, -1 on error.
+int duplicate_matrix_into(matrix_t* out, matrix_t A);
+int duplicate_vector_into(vector_t* out, vector_t v);
+int multiply_matrices_into(matrix_t* out, matrix_t A, matrix_t B);
+int matrix_times_col_vec_into(vector_t* out, matrix_t A, vector_t v);
+int row_vec_times_matrix_into(vector_t* out, vector_t v, matrix_t A);
+int add_matrices_into(matrix_t* out, matrix_t A, matrix_t B);
+int transpose_matrix_into(matrix_t* out, matrix_t A);
+int vector_projection_into(vector_t* out, vector_t v, vector_t e);
+int vector_outer_product_into(matrix_t* out, vector_t v1, vector_t v2);
+int cross_product_3d_into(vector_t* out, vector_t v1, vector_t v2);
+int poly_conv_into(vector_t* out, vector_t v1, vector_t v2);
+int poly_power_into(vector_t* out, vector_t v, int N);
+int poly_butter_into(vector_t* out, int N, float wc);
+int householder_matrix_into(matrix_t* out, vector_t v);
+
 // Multiplication, Addition, and other transforms
 matrix_t multiply_matrices(matrix_t A, matrix_t Bm);
 int matrix_times_scalar(matrix_t* A, float s);
@@ -1000,6 +1653,69 @@ vector_t lin_system_solve(matrix_t A, vector_t b);
 vector_t lin_system_solve_qr(matrix_t A, vector_t b);
 int fit_ellipsoid(matrix_t points, vector_t* center, vector_t* lengths);
 
+/*******************************************************************************
+* Linear Algebra Scratch Arena
+*
+* The solvers above allocate every temporary they need. Their *_arena versions
+* draw both temporaries and results from a la_arena_t instead so they run
+* without touching the heap once the arena is big enough. Results stay valid
+* until the arena is reset, released past them, or destroyed. Temporaries are
+* handed back before each solver returns. If the arena runs out of room the
+* solver prints an error and fails as it would for bad input.
+*
+* To size an arena, run the solver once on a generous arena with the largest
+* problem it will see and read arena.peak, or add up la_matrix_bytes() and
+* la_vector_bytes() for the results. Resetting is O(1) and keeps peak.
+*
+* la_arena_t ws = create_la_arena(64*1024);
+* while(running){
+*	la_arena_reset(&ws);
+*	x = lin_system_solve_arena(A, b, &ws);
+*	...
+* }
+*******************************************************************************/
+typedef struct la_arena_t{
+	char* mem;		// MATRIX_ALIGN aligned block
+	size_t size;	// bytes in mem
+	size_t used;	// bytes handed out
+	size_t peak;	// most bytes ever handed out at once
+	int owner;		// 1 if destroy_la_arena() should free mem
+	int initialized;
+} la_arena_t;
+
+la_arena_t create_la_arena(size_t bytes);
+la_arena_t wrap_la_arena(void* mem, size_t bytes);
+void destroy_la_arena(la_arena_t* a);
+void* la_arena_alloc(la_arena_t* a, size_t bytes);
+size_t la_arena_mark(la_arena_t* a);
+void la_arena_release(la_arena_t* a, size_t mark);
+void la_arena_reset(la_arena_t* a);
+size_t la_matrix_bytes(int rows, int cols);
+size_t la_vector_bytes(int len);
+matrix_t la_arena_matrix(la_arena_t* a, int rows, int cols);
+vector_t la_arena_vector(la_arena_t* a, int len);
+
+int QR_decomposition_arena(matrix_t A, matrix_t* Q, matrix_t* R, \
+														la_arena_t* a);
+matrix_t invert_matrix_arena(matrix_t A, la_arena_t* a);
+vector_t lin_system_solve_arena(matrix_t A, vector_t b, la_arena_t* a);
+vector_t lin_system_solve_qr_arena(matrix_t A, vector_t b, la_arena_t* a);
+int fit_ellipsoid_arena(matrix_t points, vector_t* center, vector_t* lengths,\
+														la_arena_t* a);
+
+// Cholesky and LDL' for symmetric systems, see linear_algebra.c. Factors and
+// solves never allocate, the rest draw scratch from ws or allocate if NULL.
+int cholesky_factor(matrix_t* L, matrix_t A);
+int cholesky_solve(vector_t* x, matrix_t L, vector_t b);
+int cholesky_update(matrix_t* L, vector_t x, la_arena_t* ws);
+int cholesky_downdate(matrix_t* L, vector_t x, la_arena_t* ws);
+int cholesky_inverse(matrix_t* Ainv, matrix_t L, la_arena_t* ws);
+int ldl_factor(matrix_t* L, vector_t* d, matrix_t A);
+int ldl_solve(vector_t* x, matrix_t L, vector_t d, vector_t b);
+int ldl_update(matrix_t* L, vector_t* d, vector_t x, float alpha, \
+														la_arena_t* ws);
+int ldl_inverse(matrix_t* Ainv, matrix_t L, vector_t d, la_arena_t* ws);
+
 
 /*******************************************************************************
 * Ring Buffer
@@ -1185,6 +1901,55 @@ d_filter_t create_double_integrator(float dt);
 d_filter_t create_pid(float kp, float ki, float kd, float Tf, float dt);
 
 
+/*******************************************************************************
+* Altitude Estimator
+*
+* Fuses barometer altitude, which is slow and noisy but doesn't drift, with
+* gravity-compensated vertical acceleration from the IMU, which is fast but
+* drifts when integrated. This is a third order complementary filter that also
+* estimates the accelerometer's vertical bias. The user creates their own
+* instance like a d_filter_t and marching it never allocates memory.
+*
+* @ altitude_estimator_t create_altitude_estimator(float dt, float tc)
+*
+* dt is the IMU sample period, tc is the crossover time constant in seconds
+* between trusting the barometer and the accelerometer.
+*
+* @ int reset_altitude_estimator(altitude_estimator_t* est, float alt)
+*
+* Restarts the estimate at alt with zero climb rate and bias.
+*
+* @ float march_altitude_estimator(altitude_estimator_t* est, float accel_z,
+*															float baro_alt)
+*
+* Call at the IMU rate with vertical acceleration (m/s^2, up positive) and the
+* latest barometer altitude. Returns altitude, climb rate is then available in
+* est->climb_rate.
+*
+* @ float gravity_compensated_accel_z(float accel[3], float q[4])
+*
+* Rotates body acceleration into the world frame with an orientation quaternion
+* and subtracts gravity, producing the accel_z input above.
+*
+* See the test_altitude_estimator example for a replay benchmark.
+*******************************************************************************/
+typedef struct altitude_estimator_t{
+	float dt;				// timestep in seconds
+	float k1, k2, k3;		// altitude, velocity and bias correction gains
+	float alt;				// estimated altitude (m)
+	float climb_rate;		// estimated vertical velocity (m/s)
+	float accel_bias;		// estimated vertical accelerometer bias (m/s^2)
+	uint64_t step;			// steps since last reset
+	int initialized;
+} altitude_estimator_t;
+
+altitude_estimator_t create_altitude_estimator(float dt, float time_constant);
+int reset_altitude_estimator(altitude_estimator_t* est, float alt);
+float march_altitude_estimator(altitude_estimator_t* est, float accel_z, \
+															float baro_alt);
+float gravity_compensated_accel_z(float accel[3], float q[4]);
+
+
 /*******************************************************************************
 * CPU Frequency Control
 *
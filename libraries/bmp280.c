@@ -7,95 +7,265 @@
 #include "sensor_config.h"
 
 
-typedef struct bmp280_data_t{
-	float temp;
-	float alt;
-	float pressure;
-	float sea_level_pa;
-}bmp280_data_t;
+// default sea level pressure until the user sets their own
+#define DEFAULT_SEA_LEVEL_PA	101325.0
 
+// bounds of p/p0 covered by the altitude polynomial, about -800m to 6200m
+#define ALT_POLY_MIN_RATIO		0.45
+#define ALT_POLY_MAX_RATIO		1.1
 
-// one global instance of the struct
-bmp280_data_t data;
+// sysfs pressure is in kPa and temperature in millidegrees C
+#define KPA_TO_PA				1000.0
+#define MILLIC_TO_C				0.001
+
+
+// everything the sampler publishes, read by the user through bmp_get_data()
+bmp_data_t bmp_snapshot;
+seqlock_t bmp_lock;
+// the seqlock allows one writer only, this keeps the sampler thread and a
+// read_barometer() racing its start or stop from publishing at the same time
+pthread_mutex_t bmp_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+float bmp_sea_level_pa = DEFAULT_SEA_LEVEL_PA;
+int bmp_temp_fd = -1;
+int bmp_pressure_fd = -1;
+int bmp_initialized;
+int bmp_sampler_running;
+int bmp_sample_period_us;
+pthread_t bmp_sampler_thread;
+
+void* bmp_sampler(void* ptr);
 
 
 /*******************************************************************************
-* int initialize_barometer()
+* float bmp_read_sysfs_float(int fd)
 *
-* Reads the factory-set coefficients
+* reads the ascii value of an already open iio sysfs file from offset 0.
+* returns NAN on failure.
 *******************************************************************************/
-int initialize_barometer(bmp_oversample_t oversampling){
-	return 0;
+float bmp_read_sysfs_float(int fd){
+	char buf[MAX_BUF];
+	int len = pread(fd, buf, sizeof(buf)-1, 0);
+	if(len<=0) return NAN;
+	buf[len] = 0;
+	return strtof(buf, NULL);
 }
 
-
-int power_down_barometer(){
-	// make sure the bus is not currently in use by another thread
-	// do not proceed to prevent interfering with that process
-	return 0;
+/*******************************************************************************
+* float bmp_pressure_to_altitude_m(float pressure_pa, float sea_level_pa)
+*
+* Float-only replacement for the barometric formula
+* 44330*(1-(p/p0)^0.1903). Between p/p0 of 0.45 and 1.1 (about -800m to 6200m)
+* a degree 7 polynomial in (p/p0 - 1) is used which stays within 0.01m of the
+* exact formula, including float rounding in the Horner evaluation. Outside of
+* that range it falls back to single precision powf().
+*******************************************************************************/
+float bmp_pressure_to_altitude_m(float pressure_pa, float sea_level_pa){
+	float r = pressure_pa/sea_level_pa;
+	if(r<ALT_POLY_MIN_RATIO || r>ALT_POLY_MAX_RATIO){
+		return 44330.0f*(1.0f - powf(r, 0.1903f));
+	}
+	float t = r - 1.0f;
+	return -0.005583636f + t*(-8436.00488f + t*(3418.4436f + t*(-2047.40747f
+			+ t*(1239.94629f + t*(-2831.77295f + t*(-3894.54224f
+			+ t*(-5693.16797f)))))));
 }
 
-
 /*******************************************************************************
-* int read_barometer()
+* int initialize_barometer()
 *
-* Reads the status bit followed by the temperature and pressure data registers.
-* If the status bit indicates no new data is available, this function returns 1.
-* Old data will still be available with the get_pressure, get_temperature, and
-* get_altitude functions.If new data was read then this function returns 0.
-* If an error occurred return -1. 
+* Opens the iio temperature and pressure files once so later reads only cost
+* a pread each, and requests the given pressure oversampling from the driver.
+* The sample period used by the background sampler is the maximum
+* measurement time from the BMP280 datasheet for that oversampling.
 *******************************************************************************/
-int read_barometer(){
-	int fd;
-	float ch;
+int initialize_barometer(bmp_oversample_t oversampling){
+	int fd, len, ratio;
 	char buf[MAX_BUF];
 
-	snprintf(buf, sizeof(buf), SYSFS_BARO_DIR "/in_temp_input");
+	if(oversampling<BMP_OVERSAMPLE_1 || oversampling>BMP_OVERSAMPLE_16){
+		printf("ERROR: invalid barometer oversampling\n");
+		return -1;
+	}
+	if(bmp_initialized) power_down_barometer();
 
-	fd = open(buf, O_RDONLY);
-	if (fd < 0) {
-		perror("in_temprature_raw error");
-		return fd;
+	// best effort, older drivers don't expose the oversampling ratio
+	ratio = 1<<oversampling;
+	fd = open(SYSFS_BARO_DIR "/in_pressure_oversampling_ratio", O_WRONLY);
+	if(fd>=0){
+		len = snprintf(buf, sizeof(buf), "%d", ratio);
+		write(fd, buf, len);
+		close(fd);
 	}
+	// t_meas = 1.25 + 2.3*osrs_t + 2.3*osrs_p + 0.575 ms with osrs_t = 1
+	bmp_sample_period_us = 1250 + 2300 + (2300*ratio) + 575;
 
-	read(fd, &ch, 4);
-	close(fd);
-	data.temp = ch;
+	bmp_temp_fd = open(SYSFS_BARO_DIR "/in_temp_input", O_RDONLY);
+	if(bmp_temp_fd<0){
+		perror("in_temp_input error");
+		return -1;
+	}
+	bmp_pressure_fd = open(SYSFS_BARO_DIR "/in_pressure_input", O_RDONLY);
+	if(bmp_pressure_fd<0){
+		perror("in_pressure_input error");
+		close(bmp_temp_fd);
+		return -1;
+	}
+	bmp_initialized = 1;
+	return read_barometer();
+}
 
-	snprintf(buf, sizeof(buf), SYSFS_BARO_DIR "/in_pressure_input");
 
-	fd = open(buf, O_RDONLY);
-	if (fd < 0) {
-		perror("in_pressure_raw error");
-		return fd;
+int power_down_barometer(){
+	stop_barometer_sampler();
+	if(bmp_initialized){
+		close(bmp_temp_fd);
+		close(bmp_pressure_fd);
 	}
+	bmp_temp_fd = -1;
+	bmp_pressure_fd = -1;
+	bmp_initialized = 0;
+	return 0;
+}
 
-	read(fd, &ch, 4);
-	close(fd);
 
-	data.pressure = ch;
-	
+/*******************************************************************************
+* int bmp_sample_and_publish()
+*
+* Reads temperature and pressure through the cached file descriptors, computes
+* altitude and publishes all three as one snapshot. Used by both
+* read_barometer() and the sampler thread. If an error occurred return -1 and
+* the previous snapshot is kept.
+*******************************************************************************/
+static int bmp_sample_and_publish(){
+	bmp_data_t new;
 
-	data.alt = 44330.0*(1.0 - pow((data.pressure/data.sea_level_pa), 0.1903));
+	new.temp_c = bmp_read_sysfs_float(bmp_temp_fd)*MILLIC_TO_C;
+	new.pressure_pa = bmp_read_sysfs_float(bmp_pressure_fd)*KPA_TO_PA;
+	if(isnan(new.temp_c) || isnan(new.pressure_pa)){
+		printf("ERROR: failed to read barometer\n");
+		return -1;
+	}
+	new.alt_m = bmp_pressure_to_altitude_m(new.pressure_pa, bmp_sea_level_pa);
+	new.timestamp_us = micros_since_epoch();
+
+	pthread_mutex_lock(&bmp_write_lock);
+	seqlock_write_begin(&bmp_lock);
+	bmp_snapshot = new;
+	seqlock_write_end(&bmp_lock);
+	pthread_mutex_unlock(&bmp_write_lock);
 	return 0;
-	
 }
 
+/*******************************************************************************
+* int read_barometer()
+*
+* Takes one reading and publishes it. If the background sampler is running
+* there is no need to call this, the sampler already keeps the snapshot fresh,
+* so this returns 0 without touching the sensor or the snapshot.
+* If an error occurred return -1 and the previous snapshot is kept.
+*******************************************************************************/
+int read_barometer(){
+	if(bmp_initialized==0){
+		printf("ERROR: barometer not initialized\n");
+		return -1;
+	}
+	if(__atomic_load_n(&bmp_sampler_running, __ATOMIC_ACQUIRE)) return 0;
+	return bmp_sample_and_publish();
+}
+
+/*******************************************************************************
+* int start_barometer_sampler()
+*
+* Starts a background thread taking one reading per measurement
+* period of the configured oversampling. The latest values are then available
+* at any time through bmp_get_data() or the individual getters.
+*******************************************************************************/
+int start_barometer_sampler(){
+	if(bmp_initialized==0){
+		printf("ERROR: call initialize_barometer first\n");
+		return -1;
+	}
+	if(bmp_sampler_running) return 0;
+	bmp_sampler_running = 1;
+	if(pthread_create(&bmp_sampler_thread, NULL, bmp_sampler, NULL)){
+		printf("ERROR: failed to start barometer sampler\n");
+		bmp_sampler_running = 0;
+		return -1;
+	}
+	return 0;
+}
 
+/*******************************************************************************
+* int stop_barometer_sampler()
+*
+* signals the sampler thread to stop and waits up to 1 second for it.
+*******************************************************************************/
+int stop_barometer_sampler(){
+	int ret = 0;
+	if(bmp_sampler_running){
+		bmp_sampler_running = 0;
+		timespec thread_timeout;
+		clock_gettime(CLOCK_REALTIME, &thread_timeout);
+		timespec_add(&thread_timeout, 1.0);
+		if(pthread_timedjoin_np(bmp_sampler_thread, NULL, &thread_timeout)
+															== ETIMEDOUT){
+			printf("WARNING: barometer sampler exit timeout\n");
+			ret = -1;
+		}
+	}
+	return ret;
+}
 
 /*******************************************************************************
+* void* bmp_sampler(void* ptr)
+*
+* background thread started by start_barometer_sampler(). Sleeps to absolute
+* deadlines so the sample period doesn't drift by the read time.
+*******************************************************************************/
+void* bmp_sampler(void* ptr){
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(bmp_sampler_running && get_state()!=EXITING){
+		bmp_sample_and_publish();
+		timespec_add(&next, bmp_sample_period_us/1000000.0);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	return NULL;
+}
 
+
+/*******************************************************************************
+* int bmp_get_data(bmp_data_t* data)
+*
+* copies a consistent snapshot of temperature, pressure, altitude and the time
+* they were read. This never blocks the sampler and never touches the sensor.
 *******************************************************************************/
+int bmp_get_data(bmp_data_t* data){
+	unsigned int seq;
+	do{
+		seq = seqlock_read_begin(&bmp_lock);
+		*data = bmp_snapshot;
+	}while(seqlock_read_retry(&bmp_lock, seq));
+	return 0;
+}
+
 float bmp_get_temperature_c(){
-	return data.temp;
+	bmp_data_t d;
+	bmp_get_data(&d);
+	return d.temp_c;
 }
 
 float bmp_get_pressure_pa(){
-	return data.pressure;
+	bmp_data_t d;
+	bmp_get_data(&d);
+	return d.pressure_pa;
 }
 
 float bmp_get_altitude_m(){
-	return data.alt;
+	bmp_data_t d;
+	bmp_get_data(&d);
+	return d.alt_m;
 }
 
 int set_sea_level_pressure_pa(float pa){
@@ -104,6 +274,6 @@ int set_sea_level_pressure_pa(float pa){
 		printf("between 80,000 & 120,000 pascals.\n");
 		return -1;
 	}
-	data.sea_level_pa = pa;
+	bmp_sea_level_pa = pa;
 	return 0;
 }
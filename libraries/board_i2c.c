@@ -27,6 +27,7 @@ USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "bb_blue_api.h"
 #include <sys/ioctl.h>
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h> //for IOCTL defs
 
 // debian enumerates the busses backwards on the BBB
@@ -36,6 +37,8 @@ USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define I2C1_FILE "/dev/i2c-2"
 #define I2C2_FILE "/dev/i2c-1"
 #define MAX_I2C_LENGTH   128
+#define I2C_DEFAULT_BLOCK_CHUNK	256
+#define I2C_MAX_BLOCK_CHUNK		8192	// i2c-dev rejects longer I2C_RDWR messages
 
 /******************************************************************
 * struct i2c_t 
@@ -49,10 +52,74 @@ typedef struct i2c_t {
   int bus;
   int file;
   int initialized;
-  int in_use;
+  size_t block_chunk;		// largest single read message, 0 for default
+  int in_use;				// lock depth held by the owning thread
+  pthread_mutex_t lock;		// recursive, priority inheriting
+  pthread_t owner;			// valid while in_use>0
+  i2c_bus_stats_t stats;	// only touched while holding lock
 } i2c_t;
 
 i2c_t i2c[3]; 
+pthread_once_t i2c_locks_once = PTHREAD_ONCE_INIT;
+
+/******************************************************************
+* i2c_init_locks
+*
+* Priority inheritance means a low priority thread holding the bus
+* mid-transaction gets boosted instead of stalling the IMU thread.
+* The lock is recursive so i2c_claim_bus() can be held around
+* several transactions which each lock again internally.
+******************************************************************/
+static void i2c_init_locks(){
+	int i;
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+	for(i=1;i<=2;i++){
+		pthread_mutex_init(&i2c[i].lock, &attr);
+	}
+	pthread_mutexattr_destroy(&attr);
+}
+
+/******************************************************************
+* i2c_lock
+*
+* try the lock first so the uncontended path never reads the clock,
+* only time how long we waited if someone else had the bus.
+******************************************************************/
+static void i2c_lock(int bus){
+	struct timespec start, end;
+	uint64_t wait_ns;
+	pthread_once(&i2c_locks_once, i2c_init_locks);
+	if(pthread_mutex_trylock(&i2c[bus].lock)==0){
+		i2c[bus].in_use++;
+		i2c[bus].owner = pthread_self();
+		i2c[bus].stats.transactions++;
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&i2c[bus].lock);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	wait_ns = (end.tv_sec-start.tv_sec)*1000000000ULL \
+										+ (end.tv_nsec-start.tv_nsec);
+	i2c[bus].in_use++;
+	i2c[bus].owner = pthread_self();
+	i2c[bus].stats.transactions++;
+	i2c[bus].stats.contended++;
+	i2c[bus].stats.total_wait_ns += wait_ns;
+	if(wait_ns > i2c[bus].stats.max_wait_ns){
+		i2c[bus].stats.max_wait_ns = wait_ns;
+	}
+}
+
+/******************************************************************
+* i2c_unlock
+******************************************************************/
+static void i2c_unlock(int bus){
+	i2c[bus].in_use--;
+	pthread_mutex_unlock(&i2c[bus].lock);
+}
 
 
 /******************************************************************
@@ -64,27 +131,17 @@ int i2c_init(int bus, uint8_t devAddr){
 		return -1;
 	}
 	// claim the bus during this operation
-	int old_in_use = i2c[bus].in_use;
-	i2c[bus].in_use = 1;
+	i2c_lock(bus);
 	
 	// start filling in the i2c state struct
 	i2c[bus].file = 0;
 	i2c[bus].devAddr = devAddr;
 	i2c[bus].bus     = bus;
-	i2c[bus].initialized = 1;
-	switch(bus){
-	case 1:
-		i2c[bus].file = open(I2C1_FILE, O_RDWR);
-		break;
-	case 2:
-		i2c[bus].file = open(I2C2_FILE, O_RDWR);
-		break;
-	default:
-		printf("i2c bus must be 1 or 2\n");
-		return -1;
-	}
+	if(bus==1) i2c[bus].file = open(I2C1_FILE, O_RDWR);
+	else       i2c[bus].file = open(I2C2_FILE, O_RDWR);
 	if(i2c[bus].file==-1){
 		printf("failed to open /dev/i2c\n");
+		i2c_unlock(bus);
 		return -1;
 	}
 	#ifdef DEBUG
@@ -92,11 +149,11 @@ int i2c_init(int bus, uint8_t devAddr){
 	#endif
 	if(ioctl(i2c[bus].file, I2C_SLAVE, devAddr) < 0){
 		printf("ioctl slave address change failed\n");
+		i2c_unlock(bus);
 		return -1;
 	}
-	i2c[bus].devAddr = devAddr;
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
+	i2c[bus].initialized = 1;
+	i2c_unlock(bus);
 	
 	#ifdef DEBUG
 	printf("successfully initialized i2c_%d\n", bus);
@@ -106,25 +163,33 @@ int i2c_init(int bus, uint8_t devAddr){
 
 /******************************************************************
 * i2c_set_device_address
+*
+* Every transaction carries its own device address through I2C_RDWR
+* so this is only bookkeeping, no ioctl is needed to switch between
+* the IMU and barometer on bus 2.
 ******************************************************************/
 int i2c_set_device_address(int bus, uint8_t devAddr){
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
-	// if the device address is already correct, just return
-	if(i2c[bus].devAddr == devAddr){
-		return 0;
-	}
-	// if not, change it with ioctl
-	#ifdef DEBUG
-	printf("calling ioctl slave address change\n");
-	#endif
-	if(ioctl(i2c[bus].file, I2C_SLAVE, devAddr) < 0){
-		printf("ioctl slave address change failed\n");
+	i2c[bus].devAddr = devAddr;
+	return 0;
+}
+
+/******************************************************************
+* i2c_transfer
+*
+* submits n messages as one combined transaction with repeated
+* starts between them. returns 0 on success, -1 on failure.
+******************************************************************/
+static int i2c_transfer(int bus, struct i2c_msg* msgs, int n){
+	struct i2c_rdwr_ioctl_data xfer;
+	xfer.msgs = msgs;
+	xfer.nmsgs = n;
+	if(ioctl(i2c[bus].file, I2C_RDWR, &xfer) != n){
 		return -1;
 	}
-	i2c[bus].devAddr = devAddr;
 	return 0;
 }
 
@@ -132,25 +197,31 @@ int i2c_set_device_address(int bus, uint8_t devAddr){
 * i2c_close
 ******************************************************************/
 int i2c_close(int bus){
+	int ret = 0;
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
+	i2c_lock(bus);
 	i2c[bus].devAddr = 0;
-	if(close(i2c[bus].file) < 0) return -1;
-	i2c[bus].initialized = 0;
-	return 0;
+	if(close(i2c[bus].file) < 0) ret = -1;
+	else i2c[bus].initialized = 0;
+	i2c_unlock(bus);
+	return ret;
 }
 
 /******************************************************************
 * i2c_claim_bus(int bus)
+*
+* holds the bus lock until i2c_release_bus so several transactions
+* from this thread can't be interleaved with another thread's
 ******************************************************************/
 int i2c_claim_bus(int bus){
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
-	i2c[bus].in_use=1;
+	i2c_lock(bus);
 	return 0;
 }
 
@@ -162,7 +233,11 @@ int i2c_release_bus(int bus){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
-	i2c[bus].in_use=0;
+	if(i2c[bus].in_use<=0 || !pthread_equal(i2c[bus].owner, pthread_self())){
+		printf("ERROR: i2c bus %d was not claimed by this thread\n", bus);
+		return -1;
+	}
+	i2c_unlock(bus);
 	return 0;
 }
 
@@ -174,113 +249,243 @@ int i2c_get_in_use_state(int bus){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
-	return i2c[bus].in_use;
+	return i2c[bus].in_use>0;
 }
 
 /******************************************************************
-* i2c_read_bytes
+* i2c_get_bus_stats(int bus, i2c_bus_stats_t* stats)
 ******************************************************************/
-int i2c_read_bytes(int bus, uint8_t regAddr, uint8_t length,\
-												uint8_t *data) {
-	int ret;
+int i2c_get_bus_stats(int bus, i2c_bus_stats_t* stats){
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	pthread_once(&i2c_locks_once, i2c_init_locks);
+	pthread_mutex_lock(&i2c[bus].lock);
+	*stats = i2c[bus].stats;
+	pthread_mutex_unlock(&i2c[bus].lock);
+	return 0;
+}
+
+/******************************************************************
+* i2c_reset_bus_stats(int bus)
+******************************************************************/
+int i2c_reset_bus_stats(int bus){
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	pthread_once(&i2c_locks_once, i2c_init_locks);
+	pthread_mutex_lock(&i2c[bus].lock);
+	memset(&i2c[bus].stats, 0, sizeof(i2c_bus_stats_t));
+	pthread_mutex_unlock(&i2c[bus].lock);
+	return 0;
+}
+
+
+/******************************************************************
+* i2c_read_bytes_from
+*
+* writes the register address and reads the response back in one
+* I2C_RDWR ioctl with a repeated start in between, so no other
+* transaction on the bus can land between the two halves.
+******************************************************************/
+int i2c_read_bytes_from(int bus, uint8_t devAddr, uint8_t regAddr, \
+									uint8_t length, uint8_t *data){
+	struct i2c_msg msgs[2];
 	
-    // Boundary checks
+	// Boundary checks
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
-    if(length > MAX_I2C_LENGTH){
-        printf("i2c_read_byte data length is enforced as MAX_I2C_LENGTH!\n");
-    }else if(length<0){
-        printf("i2c_read_byte data length must be greater than 0\n"); 
-    }
+	if(length > MAX_I2C_LENGTH){
+		printf("i2c_read_bytes length must be less than MAX_I2C_LENGTH\n");
+		return -1;
+	}
 
-	// claim the bus during this operation
-	int old_in_use = i2c[bus].in_use;
-	i2c[bus].in_use = 1;
+	// hold the bus during this operation
+	i2c_lock(bus);
 	
 	#ifdef DEBUG
-	printf("i2c devAddr:0x%x  ", i2c[bus].devAddr);
+	printf("i2c devAddr:0x%x  ", devAddr);
 	printf("reading %d bytes from 0x%x\n", length, regAddr);
 	#endif
 	
-	// write register to device 
-	ret = write(i2c[bus].file, &regAddr, 1);
-	if(ret!=1){ 
-		printf("write to i2c bus failed\n");
+	// register address out, then the response back in
+	msgs[0].addr  = devAddr;
+	msgs[0].flags = 0;
+	msgs[0].len   = 1;
+	msgs[0].buf   = &regAddr;
+	msgs[1].addr  = devAddr;
+	msgs[1].flags = I2C_M_RD;
+	msgs[1].len   = length;
+	msgs[1].buf   = data;
+	
+	if(i2c_transfer(bus, msgs, 2)<0){
+		printf("i2c read transaction failed\n");
+		i2c_unlock(bus);
 		return -1;
 	}
-	
-	// then read the response
-	//usleep(300);
-	ret = read(i2c[bus].file, data, length);
 
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
-    return ret;
+	i2c_unlock(bus);
+	return length;
 }
 
 /******************************************************************
-* i2c_read_byte
+* i2c_read_bytes
 ******************************************************************/
-int i2c_read_byte(int bus, uint8_t regAddr, uint8_t *data) {
-    return i2c_read_bytes(bus, regAddr, 1, data);
+int i2c_read_bytes(int bus, uint8_t regAddr, uint8_t length,\
+												uint8_t *data) {
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	return i2c_read_bytes_from(bus, i2c[bus].devAddr, regAddr, length, data);
 }
 
 /******************************************************************
-* i2c_read_words
+* i2c_set_block_chunk
 ******************************************************************/
-int i2c_read_words(int bus, uint8_t regAddr, uint8_t length,\
-												uint16_t *data) {
-    int ret,i;
-	char buf[MAX_I2C_LENGTH];
-	
-    // Boundary checks
+int i2c_set_block_chunk(int bus, size_t bytes){
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
-    if(length>(MAX_I2C_LENGTH/2)){
-        printf("i2c_read_words length must be less than MAX_I2C_LENGTH/2\n"); 
-		return -1;
-    }else if(length < 0){
-        printf("read_words length must be greater than 0\n");
+	if(bytes<1 || bytes>I2C_MAX_BLOCK_CHUNK){
+		printf("ERROR: i2c block chunk must be between 1 and %d bytes\n", \
+													I2C_MAX_BLOCK_CHUNK);
 		return -1;
-    }
+	}
+	i2c[bus].block_chunk = bytes;
+	return 0;
+}
+
+/******************************************************************
+* i2c_get_block_chunk
+*
+* returns the chunk in effect, the default if none was set
+******************************************************************/
+size_t i2c_get_block_chunk(int bus){
+	if(bus!=1 && bus!=2) return I2C_DEFAULT_BLOCK_CHUNK;
+	if(i2c[bus].block_chunk==0) return I2C_DEFAULT_BLOCK_CHUNK;
+	return i2c[bus].block_chunk;
+}
+
+/******************************************************************
+* i2c_read_block
+*
+* splits a long read into messages no longer than the bus's block
+* chunk and packs as many as allowed into each I2C_RDWR ioctl. For
+* a FIFO register the address is sent once and the read messages
+* follow back to back since the device doesn't advance its register
+* pointer. Otherwise every chunk re-addresses the next register.
+* The bus is held throughout so nobody else can drain the FIFO.
+******************************************************************/
+int i2c_read_block(int bus, uint8_t devAddr, uint8_t regAddr, \
+							size_t length, uint8_t* data, int fifo){
+	struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+	uint8_t regs[I2C_RDWR_IOCTL_MAX_MSGS];
+	size_t chunk, done, len;
+	int n;
 	
-	// claim the bus during this operation
-	int old_in_use = i2c[bus].in_use;
-	i2c[bus].in_use = 1;
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	if(!fifo && regAddr+length > 256){
+		printf("ERROR: i2c_read_block runs past register 0xff\n");
+		return -1;
+	}
+	chunk = i2c_get_block_chunk(bus);
 	
-	#ifdef DEBUG
-	printf("i2c devAddr:0x%x  ", i2c[bus].devAddr);
-	printf("reading %d words from 0x%x\n", length, regAddr);
-	#endif
+	i2c_lock(bus);
+	done = 0;
+	while(done<length){
+		n = 0;
+		// a FIFO register is only addressed at the start of each ioctl
+		if(fifo){
+			regs[0] = regAddr;
+			msgs[0].addr  = devAddr;
+			msgs[0].flags = 0;
+			msgs[0].len   = 1;
+			msgs[0].buf   = &regs[0];
+			n = 1;
+		}
+		while(done<length && n+(fifo?1:2) <= I2C_RDWR_IOCTL_MAX_MSGS){
+			len = length-done;
+			if(len>chunk) len = chunk;
+			if(!fifo){
+				regs[n] = regAddr+done;
+				msgs[n].addr  = devAddr;
+				msgs[n].flags = 0;
+				msgs[n].len   = 1;
+				msgs[n].buf   = &regs[n];
+				n++;
+			}
+			msgs[n].addr  = devAddr;
+			msgs[n].flags = I2C_M_RD;
+			msgs[n].len   = len;
+			msgs[n].buf   = data+done;
+			n++;
+			done += len;
+		}
+		
+		#ifdef DEBUG
+		printf("i2c block read of %d messages, %d of %d bytes done\n", \
+											n, (int)done, (int)length);
+		#endif
+		
+		if(i2c_transfer(bus, msgs, n)<0){
+			printf("i2c block read failed\n");
+			i2c_unlock(bus);
+			return -1;
+		}
+	}
+	i2c_unlock(bus);
+	return 0;
+}
 
-	// write first 
-	ret = write(i2c[bus].file, &regAddr, 1);
-	if(ret!=1){
-		printf("write to i2c bus failed\n");
+/******************************************************************
+* i2c_read_byte
+******************************************************************/
+int i2c_read_byte(int bus, uint8_t regAddr, uint8_t *data) {
+    return i2c_read_bytes(bus, regAddr, 1, data);
+}
+
+/******************************************************************
+* i2c_read_words_from
+******************************************************************/
+int i2c_read_words_from(int bus, uint8_t devAddr, uint8_t regAddr, \
+									uint8_t length, uint16_t *data){
+	int i;
+	uint8_t buf[MAX_I2C_LENGTH];
+	
+	if(length>(MAX_I2C_LENGTH/2)){
+		printf("i2c_read_words length must be less than MAX_I2C_LENGTH/2\n"); 
 		return -1;
 	}
-
-	// then read the response
-	ret = read(i2c[bus].file, buf, length*2);
-	if(ret!=(length*2)){
-		printf("i2c device returned %d bytes\n",ret);
-		printf("expected %d bytes instead\n",length);
+	if(i2c_read_bytes_from(bus, devAddr, regAddr, length*2, buf)<0){
 		return -1;
 	}
 	
 	// form words from bytes and put into user's data array
 	for(i=0;i<length;i++){
-		data[i] = (((uint16_t)buf[0])<<8 | buf[1]); 
+		data[i] = (((uint16_t)buf[2*i])<<8 | buf[(2*i)+1]); 
 	}
-	
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
-	
-    return 0;
+	return 0;
+}
+
+/******************************************************************
+* i2c_read_words
+******************************************************************/
+int i2c_read_words(int bus, uint8_t regAddr, uint8_t length,\
+												uint16_t *data) {
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	return i2c_read_words_from(bus, i2c[bus].devAddr, regAddr, length, data);
 }
 
 /******************************************************************
@@ -302,21 +507,25 @@ int i2c_read_bit(int bus, uint8_t regAddr, uint8_t bitNum,\
 }
 
 /******************************************************************
-* i2c_write_bytes
+* i2c_write_bytes_to
 ******************************************************************/
-int i2c_write_bytes(int bus, uint8_t regAddr, uint8_t length,\
-												uint8_t* data){
-	int i,ret;
-	uint8_t writeData[length+1]; 
+int i2c_write_bytes_to(int bus, uint8_t devAddr, uint8_t regAddr, \
+									uint8_t length, uint8_t* data){
+	int i;
+	uint8_t writeData[MAX_I2C_LENGTH+1]; 
+	struct i2c_msg msg;
 
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
+	if(length > MAX_I2C_LENGTH){
+		printf("i2c_write_bytes length must be less than MAX_I2C_LENGTH\n");
+		return -1;
+	}
 	
-	// claim the bus during this operation
-	int old_in_use = i2c[bus].in_use;
-	i2c[bus].in_use = 1;
+	// hold the bus during this operation
+	i2c_lock(bus);
 	
 	// assemble array to send, starting with the register address
 	writeData[0] = regAddr; 
@@ -325,7 +534,7 @@ int i2c_write_bytes(int bus, uint8_t regAddr, uint8_t length,\
 	}
 	
 	#ifdef DEBUG
-	printf("i2c devAddr:0x%x  ", i2c[bus].devAddr);
+	printf("i2c devAddr:0x%x  ", devAddr);
 	printf("writing %d bytes to 0x%x\n", length, regAddr);
 	printf("0x");
     for (i=0; i<length; i++){
@@ -335,17 +544,31 @@ int i2c_write_bytes(int bus, uint8_t regAddr, uint8_t length,\
 	#endif 
 	
 	// send the bytes
-	ret = write(i2c[bus].file, writeData, length+1);
-    // write should have returned the correct # bytes written
-	if( ret!=(length+1)){
+	msg.addr  = devAddr;
+	msg.flags = 0;
+	msg.len   = length+1;
+	msg.buf   = writeData;
+	if(i2c_transfer(bus, &msg, 1)<0){
 		printf("i2c_write failed\n");
+		i2c_unlock(bus);
 		return -1;
 	}
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
+	i2c_unlock(bus);
 	return 0;
 }
 
+/******************************************************************
+* i2c_write_bytes
+******************************************************************/
+int i2c_write_bytes(int bus, uint8_t regAddr, uint8_t length,\
+												uint8_t* data){
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	return i2c_write_bytes_to(bus, i2c[bus].devAddr, regAddr, length, data);
+}
+
 /******************************************************************
 * i2c_write_byte
 ******************************************************************/
@@ -353,46 +576,25 @@ int i2c_write_byte(int bus, uint8_t regAddr, uint8_t data) {
     return i2c_write_bytes(bus, regAddr, 1, &data);
 }
 
-
 /******************************************************************
 * i2c_write_words
 ******************************************************************/
 int i2c_write_words(int bus, uint8_t regAddr, uint8_t length,\
 												uint16_t* data){
-	int i,ret;
-	uint8_t writeData[(length*2)+1];
-   
-   // claim the bus during this operation
-	int old_in_use = i2c[bus].in_use;
-	i2c[bus].in_use = 1;
+	int i;
+	uint8_t writeData[MAX_I2C_LENGTH];
 	
-   // assemble bytes to send
-   writeData[0] = regAddr;
-	for (i=0; i<length; i++){
-		writeData[(i*2)+1] = (uint8_t)(data[i] >> 8);
-		writeData[(i*2)+2] = (uint8_t)(data[i]);
-	}
-
-#ifdef DEBUG
-	printf("i2c devAddr:0x%x  ", i2c[bus].devAddr);
-	printf("writing %d bytes to 0x%x\n", length, regAddr);
-	printf("0x");
-    for (i=0; i<(length*2)+1; i++){
-		printf("%x\t", writeData[i]);
-	}
-    printf("\n");
-#endif 
-
-    ret = write(i2c[bus].file, writeData, (length*2)+1);
-	if(ret!=(length*2)+1){
-		printf("i2c write failed\n");
+	if(length>(MAX_I2C_LENGTH/2)){
+		printf("i2c_write_words length must be less than MAX_I2C_LENGTH/2\n"); 
 		return -1;
 	}
-
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
 	
-   return 0;
+	// split words into big endian bytes
+	for (i=0; i<length; i++){
+		writeData[(i*2)]   = (uint8_t)(data[i] >> 8);
+		writeData[(i*2)+1] = (uint8_t)(data[i]);
+	}
+	return i2c_write_bytes(bus, regAddr, length*2, writeData);
 }
 
 /******************************************************************
@@ -408,28 +610,39 @@ int i2c_write_word(int bus, uint8_t regAddr, uint16_t data) {
 int i2c_write_bit(int bus, uint8_t regAddr, uint8_t bitNum,\
 												uint8_t data) {
     uint8_t b;
+    int ret;
+    if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	// hold the bus so nobody writes the register between read and write
+	i2c_lock(bus);
     // read back the current state of the register
-    i2c_read_byte(bus, regAddr, &b);
+    if(i2c_read_byte(bus, regAddr, &b)<0){
+		i2c_unlock(bus);
+		return -1;
+	}
 	// modify that bit in the register
     b = (data != 0) ? (b | (1 << bitNum)) : (b & ~(1 << bitNum));
 	// write it back
-    return i2c_write_byte(bus, regAddr, b);
+    ret = i2c_write_byte(bus, regAddr, b);
+	i2c_unlock(bus);
+	return ret;
 }
 
 /******************************************************************
 * i2c_send_bytes
 ******************************************************************/
 int i2c_send_bytes(int bus, uint8_t length, uint8_t* data){
-	int ret=0;
+	struct i2c_msg msg;
 	
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
 	
-	// claim the bus during this operation
-	int old_in_use= i2c[bus].in_use;
-	i2c[bus].in_use = 1;
+	// hold the bus during this operation
+	i2c_lock(bus);
 	
 #ifdef DEBUG
 	printf("i2c devAddr:0x%x  ", i2c[bus].devAddr);
@@ -437,10 +650,13 @@ int i2c_send_bytes(int bus, uint8_t length, uint8_t* data){
 #endif
 
 	// send the bytes
-	ret = write(i2c[bus].file, data, length);
-    // write should have returned the correct # bytes written
-	if(ret!=length){
+	msg.addr  = i2c[bus].devAddr;
+	msg.flags = 0;
+	msg.len   = length;
+	msg.buf   = data;
+	if(i2c_transfer(bus, &msg, 1)<0){
 		printf("i2c_send failed\n");
+		i2c_unlock(bus);
 		return -1;
 	}
 
@@ -453,8 +669,7 @@ int i2c_send_bytes(int bus, uint8_t length, uint8_t* data){
     printf("\n");
 #endif 
 	
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
+	i2c_unlock(bus);
 	
 	return 0;
 }
@@ -466,3 +681,98 @@ int i2c_send_byte(int bus, uint8_t data){
 	return i2c_send_bytes(bus,1,&data);
 }
 
+/******************************************************************
+* i2c_batch_init
+******************************************************************/
+int i2c_batch_init(i2c_batch_t* batch, int bus){
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	batch->bus = bus;
+	batch->nmsgs = 0;
+	batch->write_len = 0;
+	return 0;
+}
+
+/******************************************************************
+* i2c_batch_add_read
+*
+* a read is two messages, the register address then the response
+******************************************************************/
+int i2c_batch_add_read(i2c_batch_t* batch, uint8_t devAddr, uint8_t regAddr, \
+									uint16_t length, uint8_t* data){
+	int n = batch->nmsgs;
+	if(n+2 > I2C_BATCH_MAX_MSGS){
+		printf("ERROR: i2c batch is full\n");
+		return -1;
+	}
+	batch->reg_addr[n] = regAddr;
+	batch->msgs[n].addr  = devAddr;
+	batch->msgs[n].flags = 0;
+	batch->msgs[n].len   = 1;
+	batch->msgs[n].buf   = &batch->reg_addr[n];
+	batch->msgs[n+1].addr  = devAddr;
+	batch->msgs[n+1].flags = I2C_M_RD;
+	batch->msgs[n+1].len   = length;
+	batch->msgs[n+1].buf   = data;
+	batch->nmsgs += 2;
+	return 0;
+}
+
+/******************************************************************
+* i2c_batch_add_write
+*
+* register address and data are copied into the batch's own
+* buffer as one message
+******************************************************************/
+int i2c_batch_add_write(i2c_batch_t* batch, uint8_t devAddr, uint8_t regAddr, \
+									uint8_t length, uint8_t* data){
+	int n = batch->nmsgs;
+	uint8_t* buf = &batch->write_buf[batch->write_len];
+	if(n+1 > I2C_BATCH_MAX_MSGS){
+		printf("ERROR: i2c batch is full\n");
+		return -1;
+	}
+	if(batch->write_len+length+1 > I2C_BATCH_WRITE_BYTES){
+		printf("ERROR: i2c batch write buffer is full\n");
+		return -1;
+	}
+	buf[0] = regAddr;
+	memcpy(&buf[1], data, length);
+	batch->msgs[n].addr  = devAddr;
+	batch->msgs[n].flags = 0;
+	batch->msgs[n].len   = length+1;
+	batch->msgs[n].buf   = buf;
+	batch->write_len += length+1;
+	batch->nmsgs++;
+	return 0;
+}
+
+/******************************************************************
+* i2c_batch_submit
+******************************************************************/
+int i2c_batch_submit(i2c_batch_t* batch){
+	int bus = batch->bus;
+	if(bus!=1 && bus!=2){
+		printf("ERROR: i2c batch not initialized\n");
+		return -1;
+	}
+	if(batch->nmsgs==0) return 0;
+	
+	// hold the bus during this operation
+	i2c_lock(bus);
+	
+	#ifdef DEBUG
+	printf("submitting %d i2c messages on bus %d\n", batch->nmsgs, bus);
+	#endif
+	
+	if(i2c_transfer(bus, batch->msgs, batch->nmsgs)<0){
+		printf("i2c batch transaction failed\n");
+		i2c_unlock(bus);
+		return -1;
+	}
+	i2c_unlock(bus);
+	return 0;
+}
+
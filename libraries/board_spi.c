@@ -13,15 +13,38 @@
 #define SPI_MAX_SPEED 		24000000 	// 24mhz
 #define SPI_MIN_SPEED 		1000		// 1khz
 #define SPI_BITS_PER_WORD 	8
-#define SPI_BUF_SIZE		2		
 
 int fd; // file descriptor for SPI1_PATH device
 int initialized; 	// set to 1 after successful initialized. 
 int slave_selected; // set to 1 once a slave has been selected.
+int spi1_speed_hz;	// bus speed used by segments which don't set their own
+int spi1_mode;		// SPI_MODE_x currently programmed into spidev
+int spi1_default_mode;	// mode from initialize_spi1 for the plain spi1 calls
 
-struct spi_ioc_transfer xfer[2]; // ioctl transfer structs for tx & rx
-char tx_buf[SPI_BUF_SIZE];
-char rx_buf[SPI_BUF_SIZE];
+// chip select value files stay open so a toggle is a single write
+int spi1_cs_fd[3] = {-1, -1, -1};
+int spi1_cs_level[3];	// last level written, to skip redundant writes
+int spi1_cs_gpio[3] = {0, SPI1_SS1_GPIO_PIN, SPI1_SS2_GPIO_PIN};
+pthread_mutex_t spi1_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************************
+* int spi1_set_cs(int slave, int level)
+*
+* writes the slave select pin through its cached value fd unless the pin is
+* already at that level. Falls back to gpio_set_value if it isn't open.
+*******************************************************************************/
+static int spi1_set_cs(int slave, int level){
+	if(spi1_cs_fd[slave]<0){
+		return gpio_set_value(spi1_cs_gpio[slave], level ? HIGH : LOW);
+	}
+	if(spi1_cs_level[slave]==level) return 0;
+	if(pwrite(spi1_cs_fd[slave], level ? "1" : "0", 1, 0)!=1){
+		printf("ERROR: can't write to gpio %d\n", spi1_cs_gpio[slave]);
+		return -1;
+	}
+	spi1_cs_level[slave] = level;
+	return 0;
+}
 
 /*******************************************************************************
 * @ int initialize_spi1(int mode, int speed_hz)
@@ -30,7 +53,8 @@ char rx_buf[SPI_BUF_SIZE];
 *******************************************************************************/
 int initialize_spi1(int mode, int speed_hz){
 	int bits = SPI_BITS_PER_WORD;
-	int mode_proper;
+	int mode_proper, i;
+	char buf[MAX_BUF];
 	
 	// sanity checks
 	if(speed_hz>SPI_MAX_SPEED || speed_hz<SPI_MIN_SPEED){
@@ -105,15 +129,18 @@ int initialize_spi1(int mode, int speed_hz){
 		 return -1;
 	}
 
+	// keep the slave select value files open for fast toggling
+	for(i=1;i<=2;i++){
+		snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "/gpio%d/value", \
+															spi1_cs_gpio[i]);
+		spi1_cs_fd[i] = open(buf, O_WRONLY);
+		spi1_cs_level[i] = HIGH;
+	}
+
 	// store settings
-    xfer[0].cs_change = 0; // don't toggle CS
-    xfer[0].delay_usecs = 0;
-    xfer[0].speed_hz = speed_hz;
-    xfer[0].bits_per_word = SPI_BITS_PER_WORD;
-    xfer[1].cs_change = 0;
-    xfer[1].delay_usecs = 0;
-    xfer[1].speed_hz = speed_hz;
-    xfer[1].bits_per_word = SPI_BITS_PER_WORD;
+	spi1_speed_hz = speed_hz;
+	spi1_mode = mode_proper;
+	spi1_default_mode = mode_proper;
 	
 	// all done
 	initialized = 1;
@@ -143,11 +170,48 @@ int get_spi1_fd(){
 * Closes the file descriptor and sets initialized to 0.
 *******************************************************************************/
 int close_spi1(){
+	int i;
 	if(close(fd)) printf("failed to close spi1 file descriptor\n");
+	for(i=1;i<=2;i++){
+		if(spi1_cs_fd[i]>=0) close(spi1_cs_fd[i]);
+		spi1_cs_fd[i] = -1;
+	}
 	initialized = 0;
 	return 0;
 }
 
+/*******************************************************************************
+* int spi1_select(int slave)
+*
+* does the work for select_spi1_slave, caller must hold spi1_lock
+*******************************************************************************/
+static int spi1_select(int slave){
+	if(slave!=1 && slave!=2){
+		printf("SPI slave number must be 1 or 2\n");
+		return -1;
+	}
+	// deselect the other slave first so both are never low together
+	if(spi1_set_cs(3-slave, HIGH)) return -1;
+	if(spi1_set_cs(slave, LOW)) return -1;
+	slave_selected = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int spi1_deselect(int slave)
+*
+* does the work for deselect_spi1_slave, caller must hold spi1_lock
+*******************************************************************************/
+static int spi1_deselect(int slave){
+	if(slave!=1 && slave!=2){
+		printf("SPI slave number must be 1 or 2\n");
+		return -1;
+	}
+	if(spi1_set_cs(slave, HIGH)) return -1;
+	slave_selected = 0;
+	return 0;
+}
+
 /*******************************************************************************
 * @ int select_spi1_slave(int slave)
 *
@@ -155,21 +219,11 @@ int close_spi1(){
 * to ground. It also ensures the other slave is not selected.
 *******************************************************************************/
 int select_spi1_slave(int slave){
-	switch(slave){
-		case 1:
-			gpio_set_value(SPI1_SS2_GPIO_PIN, HIGH);
-			gpio_set_value(SPI1_SS1_GPIO_PIN, LOW);
-			break;
-		case 2:
-			gpio_set_value(SPI1_SS1_GPIO_PIN, HIGH);
-			gpio_set_value(SPI1_SS2_GPIO_PIN, LOW);
-			break;
-		default:
-			printf("SPI slave number must be 1 or 2\n");
-			return -1;
-	}
-	slave_selected = 1;
-	return 0;
+	int ret;
+	pthread_mutex_lock(&spi1_lock);
+	ret = spi1_select(slave);
+	pthread_mutex_unlock(&spi1_lock);
+	return ret;
 }	
 
 /*******************************************************************************
@@ -179,46 +233,87 @@ int select_spi1_slave(int slave){
 * to to 3.3V.
 *******************************************************************************/
 int deselect_spi1_slave(int slave){
-	switch(slave){
-		case 1:
-			gpio_set_value(SPI1_SS1_GPIO_PIN, HIGH);
-			break;
-		case 2:
-			gpio_set_value(SPI1_SS2_GPIO_PIN, HIGH);
-			break;
-		default:
-			printf("SPI slave number must be 1 or 2\n");
-			return -1;
+	int ret;
+	pthread_mutex_lock(&spi1_lock);
+	ret = spi1_deselect(slave);
+	pthread_mutex_unlock(&spi1_lock);
+	return ret;
+}	
+
+/*******************************************************************************
+* int spi1_set_mode(uint8_t mode)
+*
+* programs mode into spidev unless it's already there. Caller must hold
+* spi1_lock.
+*******************************************************************************/
+static int spi1_set_mode(uint8_t mode){
+	if(mode==spi1_mode) return 0;
+	if(ioctl(fd, SPI_IOC_WR_MODE, &mode)<0){
+		printf("ERROR: can't set spi mode\n");
+		return -1;
 	}
-	slave_selected = 0;
+	spi1_mode = mode;
 	return 0;
-}	
+}
 
 /*******************************************************************************
-* int spi1_send_bytes(char* data, int bytes)
+* int spi1_xfer_list(spi_segment_t* segs, int n)
 *
-* Like uart_send_bytes, this lets you send any byte sequence you like.
+* Submits n segments as one SPI_IOC_MESSAGE(n) ioctl so chip select stays
+* asserted between them unless a segment asks for cs_change. Each segment has
+* its own tx and rx buffer, either of which may be NULL, plus an optional
+* speed and a delay after it. Returns the total number of bytes clocked or
+* -1 on error. Holds spi1_lock so it can't interleave with spi_device_xfer,
+* and puts back the mode given to initialize_spi1 if a device changed it.
 *******************************************************************************/
-int spi1_send_bytes(char* data, int bytes){
+static int spi1_xfer_list_at(spi_segment_t* segs, int n, uint32_t speed_hz);
+
+int spi1_xfer_list(spi_segment_t* segs, int n){
+	int ret;
+	pthread_mutex_lock(&spi1_lock);
+	// a device transfer may have left spidev in another mode
+	if(initialized && spi1_set_mode(spi1_default_mode)){
+		pthread_mutex_unlock(&spi1_lock);
+		return -1;
+	}
+	ret = spi1_xfer_list_at(segs, n, spi1_speed_hz);
+	pthread_mutex_unlock(&spi1_lock);
+	return ret;
+}
+
+/*******************************************************************************
+* int spi1_xfer_list_at(spi_segment_t* segs, int n, uint32_t speed_hz)
+*
+* does the work for spi1_xfer_list, segments with no speed of their own run
+* at speed_hz. Caller must hold spi1_lock.
+*******************************************************************************/
+static int spi1_xfer_list_at(spi_segment_t* segs, int n, uint32_t speed_hz){
+	struct spi_ioc_transfer xfer[SPI_MAX_SEGMENTS];
+	int i, ret;
+	
 	// sanity checks
 	if(initialized==0){
 		printf("ERROR: SPI1 not yet initialized\n");
 		return -1;
-	} 
-	if(bytes<1){
-		printf("ERROR: spi_send_bytes, bytes to send must be >=1\n");
+	}
+	if(n<1 || n>SPI_MAX_SEGMENTS){
+		printf("ERROR: spi1_xfer_list needs 1 to %d segments\n", \
+														SPI_MAX_SEGMENTS);
 		return -1;
 	}
-  
-	int ret;
-
-	// fill in ioctl zfer struct. speed and bits were already set in initialize
-	xfer[0].rx_buf = 0;
-	xfer[0].tx_buf = (unsigned long) data;
-	xfer[0].len = bytes;
 	
-	// send
-	ret=ioctl(fd, SPI_IOC_MESSAGE(1), xfer);
+	memset(xfer, 0, n*sizeof(struct spi_ioc_transfer));
+	for(i=0;i<n;i++){
+		xfer[i].tx_buf = (unsigned long) segs[i].tx;
+		xfer[i].rx_buf = (unsigned long) segs[i].rx;
+		xfer[i].len = segs[i].len;
+		xfer[i].speed_hz = segs[i].speed_hz ? segs[i].speed_hz : speed_hz;
+		xfer[i].delay_usecs = segs[i].delay_usecs;
+		xfer[i].cs_change = segs[i].cs_change;
+		xfer[i].bits_per_word = SPI_BITS_PER_WORD;
+	}
+	
+	ret=ioctl(fd, SPI_IOC_MESSAGE(n), xfer);
 	if(ret<0){
 		printf("ERROR: SPI_IOC_MESSAGE_FAILED\n");
 		return -1;
@@ -227,35 +322,37 @@ int spi1_send_bytes(char* data, int bytes){
 }
 
 /*******************************************************************************
-* int spi1_read_bytes(char* data, int bytes)
+* int spi1_send_bytes(char* data, int bytes)
 *
-* Like uart_read_bytes, this lets you read a byte sequence without sending.
+* Like uart_send_bytes, this lets you send any byte sequence you like.
 *******************************************************************************/
-int spi1_read_bytes(char* data, int bytes){
-	// sanity checks
-	if(initialized==0){
-		printf("ERROR: SPI1 not yet initialized\n");
-		return -1;
-	} 
+int spi1_send_bytes(char* data, int bytes){
+	spi_segment_t seg = {0};
+	
 	if(bytes<1){
 		printf("ERROR: spi_send_bytes, bytes to send must be >=1\n");
 		return -1;
 	}
+	seg.tx = data;
+	seg.len = bytes;
+	return spi1_xfer_list(&seg, 1);
+}
 
-	int ret;
-
-	// fill in ioctl zfer struct. speed and bits were already set in initialize
-	xfer[0].rx_buf = (unsigned long) data;;
-	xfer[0].tx_buf = 0;
-	xfer[0].len = bytes;
+/*******************************************************************************
+* int spi1_read_bytes(char* data, int bytes)
+*
+* Like uart_read_bytes, this lets you read a byte sequence without sending.
+*******************************************************************************/
+int spi1_read_bytes(char* data, int bytes){
+	spi_segment_t seg = {0};
 	
-	// receive
-	ret=ioctl(fd, SPI_IOC_MESSAGE(1), xfer);
-	if(ret<0){
-		printf("ERROR: SPI_IOC_MESSAGE_FAILED\n");
+	if(bytes<1){
+		printf("ERROR: spi_read_bytes, bytes to read must be >=1\n");
 		return -1;
 	}
-	return ret;
+	seg.rx = data;
+	seg.len = bytes;
+	return spi1_xfer_list(&seg, 1);
 }
 
 /*******************************************************************************
@@ -266,28 +363,16 @@ int spi1_read_bytes(char* data, int bytes){
 * the number of bytes received or -1 on error.
 *******************************************************************************/
 int spi1_transfer(char* tx_data, int tx_bytes, char* rx_data){
-	// sanity checks
-	if(initialized==0){
-		printf("ERROR: SPI1 not yet initialized\n");
-		return -1;
-	} if(tx_bytes<1){
-		printf("ERROR: spi1_transfer, bytes must be >=1\n");
-	}
+	spi_segment_t seg = {0};
 	
-	int ret;
-
-	// fill in send struct 
-	xfer[0].tx_buf = (unsigned long) tx_data; 
-	xfer[0].rx_buf = (unsigned long) rx_data;
-	xfer[0].len = tx_bytes;
-
-	ret=ioctl(fd, SPI_IOC_MESSAGE(1), xfer);
-	if(ret<0){
-		printf("SPI_IOC_MESSAGE_FAILED\n");
+	if(tx_bytes<1){
+		printf("ERROR: spi1_transfer, bytes must be >=1\n");
 		return -1;
 	}
-
-	return ret;
+	seg.tx = tx_data;
+	seg.rx = rx_data;
+	seg.len = tx_bytes;
+	return spi1_xfer_list(&seg, 1);
 }
 
 /*******************************************************************************
@@ -299,26 +384,14 @@ int spi1_transfer(char* tx_data, int tx_bytes, char* rx_data){
 * functionality, use spi1_send_bytes() to send a byte string of your choosing.
 *******************************************************************************/
 int spi1_write_reg_byte(char reg_addr, char data){
-	// sanity checks
-	if(initialized==0){
-		printf("ERROR: SPI1 not yet initialized\n");
-		return -1;
-	} 
+	spi_segment_t seg = {0};
+	char tx_buf[2];
 	
-	//wipe TX buffer and fill in register address and data
-	memset(tx_buf, 0, sizeof tx_buf);
 	tx_buf[0] = reg_addr | 0x80; /// set MSBit = 1 to indicate it's a write
 	tx_buf[1] = data;
-  
-	// fill in ioctl zfer struct. speed and bits were already set in initialize
-	xfer[0].tx_buf = (unsigned long) tx_buf;
-	xfer[0].len = 2;
-	
-	// send
-	if(ioctl(fd, SPI_IOC_MESSAGE(1), xfer)<0){
-		printf("ERROR: SPI_IOC_MESSAGE_FAILED\n");
-		return -1;
-	}
+	seg.tx = tx_buf;
+	seg.len = 2;
+	if(spi1_xfer_list(&seg, 1)<0) return -1;
 	return 0;
 }
 
@@ -330,27 +403,9 @@ int spi1_write_reg_byte(char reg_addr, char data){
 * ICs. 
 *******************************************************************************/
 char spi1_read_reg_byte(char reg_addr){
-	// sanity checks
-	if(initialized==0){
-		printf("ERROR: SPI1 not yet initialized\n");
-		return -1;
-	} 
-	
-	// wipe buffers
-	memset(tx_buf, 0, sizeof tx_buf);
-	memset(rx_buf, 0, sizeof rx_buf);
-	
-	// fill in xfer struct 
-	tx_buf[0] = reg_addr & 0x7f; // MSBit = 0 to indicate it's a read
-	xfer[0].tx_buf = (unsigned long) tx_buf; 
-	xfer[0].rx_buf = (unsigned long) rx_buf;
-	xfer[0].len = 1;
-
-	if(ioctl(fd, SPI_IOC_MESSAGE(1), xfer)<0){
-		printf("SPI_IOC_MESSAGE_FAILED\n");
-		return -1;
-	}
-	return rx_buf[0];
+	char data;
+	if(spi1_read_reg_bytes(reg_addr, &data, 1)<0) return -1;
+	return data;
 }
 
 /*******************************************************************************
@@ -358,40 +413,88 @@ char spi1_read_reg_byte(char reg_addr){
 *
 * Reads multiple bytes located at address reg_addr. This is accomplished
 * by sending the reg_addr with the MSB set to 0 indicating a read on many
-* ICs. 
+* ICs. The address and the read go out as two segments of one transfer.
 *******************************************************************************/
 int spi1_read_reg_bytes(char reg_addr, char* data, int bytes){
-	// sanity checks
-	if(initialized==0){
-		printf("ERROR: SPI1 not yet initialized\n");
-		return -1;
-	} if(bytes<1){
+	spi_segment_t segs[2] = {{0}};
+	char addr;
+	
+	if(bytes<1){
 		printf("ERROR: spi1_read_reg_bytes, bytes must be >=1\n");
+		return -1;
+	}
+	addr = reg_addr & 0x7f; // MSBit = 0 to indicate it's a read
+	segs[0].tx = &addr;
+	segs[0].len = 1;
+	segs[1].rx = data;
+	segs[1].len = bytes;
+	if(spi1_xfer_list(segs, 2)<0) return -1;
+	return 0;
+}
+
+/*******************************************************************************
+* spi_device_t create_spi_device(int slave, int mode, int speed_hz)
+*
+* Describes one slave on SPI1. slave is 1 or 2 for the gpio chip selects on
+* the SPI1.1 and SPI1.2 sockets, or 0 if chip select is handled elsewhere.
+*******************************************************************************/
+spi_device_t create_spi_device(int slave, int mode, int speed_hz){
+	spi_device_t dev;
+	memset(&dev, 0, sizeof(dev));
+	if(slave<0 || slave>2){
+		printf("ERROR: SPI slave number must be 0, 1 or 2\n");
+		return dev;
+	}
+	if(mode<0 || mode>3){
+		printf("ERROR: SPI mode must be 0, 1, 2, or 3\n");
+		return dev;
+	}
+	if(speed_hz>SPI_MAX_SPEED || speed_hz<SPI_MIN_SPEED){
+		printf("ERROR: SPI speed_hz must be between %d & %d\n", SPI_MIN_SPEED,\
+																SPI_MAX_SPEED);
+		return dev;
 	}
+	dev.slave = slave;
+	dev.mode = mode;
+	dev.speed_hz = speed_hz;
+	dev.initialized = 1;
+	return dev;
+}
 
+/*******************************************************************************
+* int spi_device_xfer(spi_device_t* dev, spi_segment_t* segs, int n)
+*
+* Transfers segments to one device with its own settings. Speed travels with
+* each segment so it's free to change. The mode ioctl is only issued when it
+* differs from the last device used and chip select pins are only written
+* when they change. The bus is locked so devices in different threads don't
+* collide.
+*******************************************************************************/
+int spi_device_xfer(spi_device_t* dev, spi_segment_t* segs, int n){
+	uint8_t mode;
 	int ret;
 
-	// wipe buffers
-	memset(tx_buf, 0, sizeof tx_buf);
-	memset(data, 0, bytes);
+	if(dev->initialized!=1){
+		printf("ERROR: spi device not initialized\n");
+		return -1;
+	}
+	if(initialized==0){
+		printf("ERROR: SPI1 not yet initialized\n");
+		return -1;
+	}
+	mode = dev->mode; // SPI_MODE_0-3 are 0-3
 	
-	// fill in send struct 
-	tx_buf[0] = reg_addr & 0x7f; // MSBit = 0 to indicate it's a read
-	xfer[0].tx_buf = (unsigned long) tx_buf; 
-	xfer[0].rx_buf = 0;
-	xfer[0].len = 1;
-	// fill in receive struct
-	xfer[1].tx_buf = 0;
-	xfer[1].rx_buf = (unsigned long) data;
-	xfer[1].len = bytes;
-
-	ret=ioctl(fd, SPI_IOC_MESSAGE(2), xfer);
-	if (ret<0){
-		printf("SPI_IOC_MESSAGE_FAILED\n");
+	pthread_mutex_lock(&spi1_lock);
+	if(spi1_set_mode(mode)){
+		pthread_mutex_unlock(&spi1_lock);
 		return -1;
 	}
-
-	return 0;
+	if(dev->slave && spi1_select(dev->slave)){
+		pthread_mutex_unlock(&spi1_lock);
+		return -1;
+	}
+	ret = spi1_xfer_list_at(segs, n, dev->speed_hz);
+	if(dev->slave) spi1_deselect(dev->slave);
+	pthread_mutex_unlock(&spi1_lock);
+	return ret;
 }
-
-
@@ -7,12 +7,17 @@
 *******************************************************************************/
 
 #include "bb_blue_api.h"
+#include <sys/epoll.h>
+#include <linux/serial.h>	// ASYNC_LOW_LATENCY
+#include <sys/uio.h>		// writev
+#include <semaphore.h>
+#include <sched.h>
 
 #define MIN_BUS 0
 #define MAX_BUS 5
 
-// Most bytes to read at once. This is the size of the Sitara UART FIFO buffer.
-#define MAX_READ_LEN 128
+// receive buffer per bus, refilled with as much as the driver has ready
+#define UART_RX_BUF_SIZE 4096
 
 /*******************************************************************************
 * Local Global Variables
@@ -28,21 +33,154 @@ char *paths[6] = { \
 
 int fd[6]; // file descriptors for all ports
 float bus_timeout_s[6]; // user-requested timeout in seconds for each bus
+int bus_custom_baud[6]; // rate set through termios2, 0 for standard rates
+
+/*******************************************************************************
+* receive buffers
+*
+* Unread bytes live in data[start] to data[end-1]. When a refill finds no
+* room at the end the unread bytes are moved back to the front, so unread
+* data is always one contiguous span which memchr can search in one go.
+*******************************************************************************/
+typedef struct uart_rx_buf_t{
+	char data[UART_RX_BUF_SIZE];
+	int start;
+	int end;
+} uart_rx_buf_t;
+
+uart_rx_buf_t rx_buf[6];
+
+// reactor state, see start_uart_reactor()
+#define UART_REACTOR_POLL_MS 100
+int reactor_running;
+int reactor_epfd = -1;
+pthread_t reactor_thread;
+uart_parser_t reactor_parser[6];
+void* reactor_ctx[6];
+uint64_t reactor_overflows[6];
+int reactor_dead[6];		// dropped by the reactor after an error or hangup
+int reactor_active_bus = -1;	// bus whose parser the reactor is inside
+
+/*******************************************************************************
+* transmit queues
+*
+* Bounded multi-producer queue of message slots per bus. A producer claims a
+* slot with one compare-and-swap, copies its message in and publishes it by
+* bumping the slot's sequence number. The bus's writer thread gathers runs of
+* published slots into one writev(). A full queue drops the message and
+* counts it rather than blocking the caller.
+*******************************************************************************/
+#define UART_TX_SLOTS		64		// must be a power of 2
+#define UART_TX_IOV_MAX		16		// slots gathered into one writev
+#define UART_TX_POLL_S		0.1
+
+typedef struct uart_tx_slot_t{
+	unsigned int seq;
+	int len;
+	char data[UART_TX_SLOT_BYTES];
+} uart_tx_slot_t;
+
+typedef struct uart_tx_queue_t{
+	int running;
+	int posting;			// uart_queue_bytes() calls in progress
+	pthread_t thread;
+	sem_t wake;
+	unsigned int tail;		// next slot producers claim
+	unsigned int head;		// next slot the writer sends
+	uint64_t dropped_bytes;
+	uart_tx_slot_t* slots;
+} uart_tx_queue_t;
+
+uart_tx_queue_t tx_queue[6];
+
+// in uart_termios2.c, kept apart since its headers clash with termios.h
+int uart_set_custom_baud(int fd, int baudrate);
+
+static int uart_configure(int bus, int baudrate, float timeout_s, \
+										int low_latency, int packet_bytes);
 
 /*******************************************************************************
 * int initialize_uart(int bus, int baudrate)
 * 
 * bus needs to be between MIN_BUS and MAX_BUS which here is 0 & 5.
-* baudrate must be one of the standard speeds in the UART spec. 115200 and 
-* 57600 are most common.
+* baudrate is normally one of the standard speeds in the UART spec, 115200 and 
+* 57600 are most common, but any rate from 50 to 4000000 is accepted.
 * timeout is in seconds and must be >=0.1
 *
 * returns -1 for failure or 0 for success
 *******************************************************************************/ 
 int initialize_uart(int bus, int baudrate, float timeout_s){
+	return uart_configure(bus, baudrate, timeout_s, 0, 0);
+}
+
+/*******************************************************************************
+* int initialize_uart_low_latency(int bus, int baudrate, float timeout_s,
+*														int packet_bytes)
+*
+* Same as initialize_uart but tuned for packet protocols where the delay
+* from the last byte arriving to it being parsed matters. The driver is put
+* in ASYNC_LOW_LATENCY mode so bytes aren't held back for batching, and the
+* RX FIFO trigger level is lowered where the driver allows it. With
+* packet_bytes>0 VMIN is set to it and VTIME to 0 so a wait on the port only
+* wakes once a whole packet is in, otherwise it wakes on every byte.
+*******************************************************************************/
+int initialize_uart_low_latency(int bus, int baudrate, float timeout_s, \
+														int packet_bytes){
+	if(packet_bytes<0 || packet_bytes>255){
+		printf("ERROR: packet_bytes must be between 0 and 255\n");
+		return -1;
+	}
+	return uart_configure(bus, baudrate, timeout_s, 1, packet_bytes);
+}
+
+/*******************************************************************************
+* void uart_set_low_latency(int bus)
+*
+* best effort, not every serial driver supports these so failures are only
+* reported in debug mode
+*******************************************************************************/
+static void uart_set_low_latency(int bus){
+	struct serial_struct serial;
+	char path[64];
+	int trig_fd;
+
+	if(ioctl(fd[bus], TIOCGSERIAL, &serial)==0){
+		serial.flags |= ASYNC_LOW_LATENCY;
+		if(ioctl(fd[bus], TIOCSSERIAL, &serial)<0){
+			#ifdef DEBUG
+			printf("uart%d driver refused ASYNC_LOW_LATENCY\n", bus);
+			#endif
+		}
+	}
+	// interrupt on the first received byte rather than a fuller FIFO. The
+	// sysfs entry is named after the device, so only /dev/ttyXXX paths have
+	// one, not ptys or paths set with uart_set_device_path() elsewhere
+	if(strncmp(paths[bus], "/dev/tty", 8)!=0) return;
+	snprintf(path, sizeof(path), "/sys/class/tty/%s/rx_trig_bytes", \
+														paths[bus]+5);
+	trig_fd = open(path, O_WRONLY);
+	if(trig_fd>=0){
+		if(write(trig_fd, "1", 1)<0){
+			#ifdef DEBUG
+			printf("uart%d can't lower rx trigger level\n", bus);
+			#endif
+		}
+		close(trig_fd);
+	}
+}
+
+/*******************************************************************************
+* int uart_configure(int bus, int baudrate, float timeout_s, int low_latency,
+*														int packet_bytes)
+*
+* does the work for both initialize functions
+*******************************************************************************/
+static int uart_configure(int bus, int baudrate, float timeout_s, \
+										int low_latency, int packet_bytes){
 
 	struct termios config;
 	speed_t speed; //baudrate
+	int custom_baud = 0;
 	
 	// sanity checks
 	if(bus<MIN_BUS || bus>MAX_BUS){
@@ -110,8 +248,13 @@ int initialize_uart(int bus, int baudrate, float timeout_s){
 		speed=B50;
 		break;
 	default:
-		printf("ERROR: invalid speed. Please use a standard baudrate\n");
-		return -1;
+		// anything else is set with termios2 once the port is configured
+		if(baudrate<50 || baudrate>4000000){
+			printf("ERROR: invalid speed. Please use 50 to 4000000 baud\n");
+			return -1;
+		}
+		speed=B38400;
+		custom_baud = 1;
 	}
 	
 	// close the bus in case it was already open
@@ -155,6 +298,18 @@ int initialize_uart(int bus, int baudrate, float timeout_s){
 	//config.c_cc[VMIN]=MAX_READ_LEN; //
 	config.c_cc[VMIN] = 0;
 	
+	// in low latency mode reads are paced by select() and VMIN instead
+	if(low_latency){
+		config.c_cc[VTIME] = 0;
+		config.c_cc[VMIN] = packet_bytes;
+		// packet protocols are binary, no byte may be translated or eaten
+		// as a control character
+		config.c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP|INLCR|IGNCR|ICRNL| \
+															IXON|IXOFF);
+		config.c_lflag &= ~(ECHO|ECHONL|ISIG|IEXTEN);
+		config.c_oflag &= ~OPOST;
+	}
+	
 	if(cfsetispeed(&config, speed) < 0) {
 		printf("ERROR: cannot set uart%d baud rate\n", bus);
 		return -1;
@@ -171,9 +326,15 @@ int initialize_uart(int bus, int baudrate, float timeout_s){
 		return -1;
 	}
 	tcflush(fd[bus],TCIOFLUSH);
+	if(custom_baud && uart_set_custom_baud(fd[bus], baudrate)<0){
+		close(fd[bus]);
+		return -1;
+	}
+	if(low_latency) uart_set_low_latency(bus);
 	
 	initialized[bus] = 1;
 	bus_timeout_s[bus]=timeout_s;
+	bus_custom_baud[bus] = custom_baud ? baudrate : 0;
 	
 	flush_uart(bus);
 	return 0;
@@ -198,8 +359,12 @@ int close_uart(int bus){
 	if(initialized[bus]==0){
 		return 0;
 	}
+	stop_uart_tx_queue(bus);
+	uart_reactor_remove(bus);
 	tcflush(fd[bus],TCIOFLUSH);
 	close(fd[bus]);
+	rx_buf[bus].start = 0;
+	rx_buf[bus].end = 0;
 	initialized[bus]=0;
 	return 0;
 }
@@ -230,6 +395,76 @@ int get_uart_fd(int bus){
 	return fd[bus];
 }
 
+/*******************************************************************************
+* int uart_set_framing(int bus, char parity, int stop_bits)
+*
+* changes an initialized bus from 8N1 to 8 data bits with parity 'N', 'E' or
+* 'O' and 1 or 2 stop bits, for example 8E2 for SBUS. tcsetattr() knows
+* nothing of termios2 so a custom baud rate is put back afterwards.
+*******************************************************************************/
+int uart_set_framing(int bus, char parity, int stop_bits){
+	struct termios config;
+
+	if(bus<MIN_BUS || bus>MAX_BUS){
+		printf("ERROR: uart bus must be between %d & %d\n", MIN_BUS, MAX_BUS);
+		return -1;
+	}
+	if(initialized[bus]==0){
+		printf("ERROR: uart%d must be initialized first\n", bus);
+		return -1;
+	}
+	if(tcgetattr(fd[bus], &config)!=0){
+		printf("Cannot get uart attributes\n");
+		return -1;
+	}
+	switch(parity){
+	case 'N':
+		config.c_cflag &= ~PARENB;
+		break;
+	case 'E':
+		config.c_cflag |= PARENB;
+		config.c_cflag &= ~PARODD;
+		break;
+	case 'O':
+		config.c_cflag |= PARENB|PARODD;
+		break;
+	default:
+		printf("ERROR: uart parity must be 'N', 'E' or 'O'\n");
+		return -1;
+	}
+	if(stop_bits==2) config.c_cflag |= CSTOPB;
+	else if(stop_bits==1) config.c_cflag &= ~CSTOPB;
+	else{
+		printf("ERROR: uart stop bits must be 1 or 2\n");
+		return -1;
+	}
+	if(tcsetattr(fd[bus], TCSANOW, &config) < 0){
+		printf("cannot set uart%d attributes\n", bus);
+		return -1;
+	}
+	if(bus_custom_baud[bus] && \
+				uart_set_custom_baud(fd[bus], bus_custom_baud[bus])<0){
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int uart_set_device_path(int bus, char* path)
+*
+* makes the next initialize call for bus open path instead of /dev/ttyOx,
+* for example the slave side of a pty when replaying captured data. The
+* string must stay valid while the bus is in use.
+*******************************************************************************/
+int uart_set_device_path(int bus, char* path){
+	if(bus<MIN_BUS || bus>MAX_BUS){
+		printf("ERROR: uart bus must be between %d & %d\n", MIN_BUS, MAX_BUS);
+		return -1;
+	}
+	paths[bus] = path;
+	return 0;
+}
+
 /*******************************************************************************
 * int flush_uart(int bus)
 *
@@ -245,6 +480,8 @@ int flush_uart(int bus){
 		printf("ERROR: uart%d must be initialized first\n", bus);
 		return -1;
 	}
+	rx_buf[bus].start = 0;
+	rx_buf[bus].end = 0;
 	return tcflush(fd[bus],TCIOFLUSH);
 }
 
@@ -295,18 +532,100 @@ int uart_send_byte(int bus, char data){
 }
 		
 
+/*******************************************************************************
+* int uart_read_ready(int bus)
+*
+* Called once the fd is known to be readable. Makes room at the end of the
+* receive buffer by moving unread bytes to the front if needed, then pulls
+* in everything the driver has with one read(). Returns bytes added, 0 if
+* there was no room or nothing came, -1 on error.
+*******************************************************************************/
+static int uart_read_ready(int bus){
+	uart_rx_buf_t* rx = &rx_buf[bus];
+	int ret;
+
+	if(rx->start==rx->end){
+		rx->start = 0;
+		rx->end = 0;
+	}
+	else if(rx->end==UART_RX_BUF_SIZE && rx->start>0){
+		memmove(rx->data, rx->data+rx->start, rx->end-rx->start);
+		rx->end -= rx->start;
+		rx->start = 0;
+	}
+	if(rx->end==UART_RX_BUF_SIZE) return 0; // caller must consume first
+
+	// data is ready so this returns at once with all of it, up to the space
+	ret = read(fd[bus], rx->data+rx->end, UART_RX_BUF_SIZE-rx->end);
+	if(ret<0){
+		if(errno==EINTR || errno==EAGAIN) return 0;
+		printf("ERROR: uart read() returned %d\n", ret);
+		return -1;
+	}
+	rx->end += ret;
+	return ret;
+}
+
+/*******************************************************************************
+* int uart_fill_rx_buf(int bus, struct timeval* timeout)
+*
+* Waits for data with select() and then refills the receive buffer. The
+* timeval is decreased by select() so repeated calls from one read function
+* share the user's total timeout. Returns the number of bytes added, 0 on
+* timeout, EINTR or EXITING, -1 on error.
+*******************************************************************************/
+static int uart_fill_rx_buf(int bus, struct timeval* timeout){
+	fd_set set; // for select()
+	int ret;
+
+	if(get_state()==EXITING) return 0;
+	if(rx_buf[bus].start==0 && rx_buf[bus].end==UART_RX_BUF_SIZE) return 0;
+
+	FD_ZERO(&set); /* clear the set */
+	FD_SET(fd[bus], &set); /* add our file descriptor to the set */
+	ret = select(fd[bus] + 1, &set, NULL, NULL, timeout);
+	if(ret == -1){
+		// select returned and error. EINTR means interrupted by SIGINT
+		// aka ctrl-c. Don't print anything as this happens normally
+		// in case of EINTR/Ctrl-C just return how many bytes got read up 
+		// until then without raising alarms.
+		if(errno!=EINTR){
+			printf("uart select() error: %s\n", strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+	if(ret == 0) return 0; // timeout
+	return uart_read_ready(bus);
+}
+
+/*******************************************************************************
+* int uart_take_rx(int bus, int bytes, char* buf)
+*
+* copies up to bytes unread bytes out of the receive buffer
+*******************************************************************************/
+static int uart_take_rx(int bus, int bytes, char* buf){
+	uart_rx_buf_t* rx = &rx_buf[bus];
+	int n = rx->end - rx->start;
+	if(n>bytes) n = bytes;
+	memcpy(buf, rx->data+rx->start, n);
+	rx->start += n;
+	return n;
+}
+
 /*******************************************************************************
 * int uart_read_bytes(int bus, int bytes, char* buf)
 *
 * This is a blocking function call. It will only return once the desired number
-* of bytes has been read from the buffer or if the global flow state defined
-* in robotics_cape.h is set to EXITING.
-* Due to the Sitara's UART FIFO buffer, MAX_READ_LEN (128bytes) is the largest
-* packet that can be read with a single call to read(). For reads larger than 
-* 128bytes, we run a loop instead.
+* of bytes has been read, the timeout given to initialize_uart() has passed in
+* total, or if the global flow state defined in robotics_cape.h is set to
+* EXITING. Returns the number of bytes read, fewer than requested on timeout.
+* Bytes already in the receive buffer are returned without a system call.
 *******************************************************************************/
 int uart_read_bytes(int bus, int bytes, char* buf){
-	int bytes_to_read;
+	struct timeval timeout;
+	int ret, bytes_read;
+
 	// sanity checks
 	if(bus<MIN_BUS || bus>MAX_BUS){
 		printf("ERROR: uart bus must be between %d & %d\n", MIN_BUS, MAX_BUS);
@@ -320,23 +639,6 @@ int uart_read_bytes(int bus, int bytes, char* buf){
 		printf("ERROR: uart%d must be initialized first\n", bus);
 		return -1;
 	}
-	if(bytes<=MAX_READ_LEN){
-		// small read, return in one read() call
-		// this uses built-in timeout instead of select()
-		return read(fd[bus], buf, bytes);
-	}
-
-	// any read under 128 bytes should have returned by now.
-	// everything below this line is for longer extended reads >128 bytes
-	
-	int ret; // holder for return values
-	fd_set set; // for select()
-	struct timeval timeout;
-	int bytes_read; // number of bytes read so far
-	int bytes_left; // number of bytes still need to be read
-	
-	bytes_read = 0;
-	bytes_left = bytes;
 
 	// set up the timeout OUTSIDE of the read loop. We will likely be calling
 	// select() multiple times and that will decrease the timeout struct each
@@ -344,51 +646,69 @@ int uart_read_bytes(int bus, int bytes, char* buf){
 	// of the timeout value compounding each loop.
 	timeout.tv_sec = (int)bus_timeout_s[bus];
 	timeout.tv_usec = (int)(1000000*fmod(bus_timeout_s[bus],1));
-	
-	// exit the read loop once enough bytes have been read
-	// or the global flow state becomes EXITING. This prevents programs
-	// getting stuck here and not exiting properly
-	while((bytes_left>0)&&get_state()!=EXITING){
-		FD_ZERO(&set); /* clear the set */
-		FD_SET(fd[bus], &set); /* add our file descriptor to the set */
-		ret = select(fd[bus] + 1, &set, NULL, NULL, &timeout);
-		if(ret == -1){
-			// select returned and error. EINTR means interrupted by SIGINT
-			// aka ctrl-c. Don't print anything as this happens normally
-			// in case of EINTR/Ctrl-C just return how many bytes got read up 
-			// until then without raising alarms.
-			if(errno!=EINTR){
-				printf("uart select() error: %s\n", strerror(errno));
-				return -1;
-			}
-			return bytes_read;  
-		}
-		else if(ret == 0){
-			// timeout
+
+	bytes_read = uart_take_rx(bus, bytes, buf);
+	while(bytes_read<bytes){
+		ret = uart_fill_rx_buf(bus, &timeout);
+		if(ret<0) return -1;
+		if(ret==0) break;
+		bytes_read += uart_take_rx(bus, bytes-bytes_read, buf+bytes_read);
+	}
+	return bytes_read;
+}
+
+/*******************************************************************************
+* int uart_read_until(int bus, int max_bytes, char* buf, char delim)
+*
+* Reads characters up to a delimiter which is consumed but not copied to buf.
+* This is a blocking function call. It will only return on these conditions:
+* - the delimiter was read
+* - max_bytes were read, this prevents overflowing a user buffer.
+* - timeout declared in initialize_uart() is reached
+* - Global flow state in robotics_cape.h is set to EXITING.
+* Returns the number of bytes placed in buf.
+*******************************************************************************/
+int uart_read_until(int bus, int max_bytes, char* buf, char delim){
+	uart_rx_buf_t* rx;
+	struct timeval timeout;
+	int ret, n, bytes_read = 0;
+	char* found;
+
+	// sanity checks
+	if(bus<MIN_BUS || bus>MAX_BUS){
+		printf("ERROR: uart bus must be between %d & %d\n", MIN_BUS, MAX_BUS);
+		return -1;
+	}
+	if(initialized[bus]==0){
+		printf("ERROR: uart%d must be initialized first\n", bus);
+		return -1;
+	}
+	if(max_bytes<1 || buf==NULL){
+		printf("ERROR: uart_read_until needs a buffer of at least 1 byte\n");
+		return -1;
+	}
+	rx = &rx_buf[bus];
+
+	timeout.tv_sec = (int)bus_timeout_s[bus];
+	timeout.tv_usec = (int)(1000000*fmod(bus_timeout_s[bus],1));
+
+	while(1){
+		// search only as far as the user's buffer has room for
+		n = rx->end - rx->start;
+		if(n > max_bytes-bytes_read) n = max_bytes-bytes_read;
+		found = memchr(rx->data+rx->start, delim, n);
+		if(found!=NULL){
+			n = found - (rx->data+rx->start);
+			bytes_read += uart_take_rx(bus, n, buf+bytes_read);
+			rx->start++; // drop the delimiter
 			return bytes_read;
 		}
-		else{
-			// There was data to read. Read up to the number of bytes left
-			// and no more. This most likely will return fewer bytes than
-			// bytes_left, but we will loop back to get the rest.
-			
-			// read no more than MAX_READ_LEN at a time
-			if(bytes_left>MAX_READ_LEN)	bytes_to_read = MAX_READ_LEN;
-			else bytes_to_read = bytes_left;
-			ret=read(fd[bus], buf+bytes_read, bytes_to_read);
-			if(ret<0){
-				printf("ERROR: uart read() returned %d\n", ret);
-				return -1;
-			}
-			else if(ret>0){
-				// success, actually read something
-				bytes_read += ret;
-				bytes_left -= ret;
-			}
-		}
+		bytes_read += uart_take_rx(bus, n, buf+bytes_read);
+		if(bytes_read>=max_bytes) return bytes_read;
+		ret = uart_fill_rx_buf(bus, &timeout);
+		if(ret<0) return -1;
+		if(ret==0) return bytes_read;
 	}
-	
-	return bytes_read;
 }
 
 /*******************************************************************************
@@ -402,60 +722,466 @@ int uart_read_bytes(int bus, int bytes, char* buf){
 * - Global flow state in robotics_cape.h is set to EXITING.
 *******************************************************************************/
 int uart_read_line(int bus, int max_bytes, char* buf){
-	int ret; // holder for return values
-	char temp;
-	fd_set set; // for select()
-	struct timeval timeout;
-	int bytes_read=0; // number of bytes read so far
+	return uart_read_until(bus, max_bytes, buf, '\n');
+}
 
-	// set up the timeout OUTSIDE of the read loop. We will likely be calling
-	// select() multiple times and that will decrease the timeout struct each
-	// time ensuring the TOTAL timeout requested by the user is honoured instead
-	// of the timeout value compounding each loop.
-	timeout.tv_sec = (int)bus_timeout_s[bus];
-	timeout.tv_usec = (int)(1000000*fmod(bus_timeout_s[bus],1));
-	
-	// exit the read loop once enough bytes have been read
-	// or the global flow state becomes EXITING. This prevents programs
-	// getting stuck here and not exiting properly
-	while(bytes_read<max_bytes && get_state()!=EXITING){
-		FD_ZERO(&set); /* clear the set */
-		FD_SET(fd[bus], &set); /* add our file descriptor to the set */
-		ret = select(fd[bus] + 1, &set, NULL, NULL, &timeout);
-		if(ret == -1){
-			// select returned and error. EINTR means interrupted by SIGINT
-			// aka ctrl-c. Don't print anything as this happens normally
-			// in case of EINTR/Ctrl-C just return how many bytes got read up 
-			// until then without raising alarms.
-			if(errno!=EINTR){
-				printf("uart select() error: %s\n", strerror(errno));
-				return -1;
+/*******************************************************************************
+* int uart_bytes_available(int bus)
+*
+* Returns how many received bytes can be read right away, counting both the
+* receive buffer and the driver's queue.
+*******************************************************************************/
+int uart_bytes_available(int bus){
+	int queued = 0;
+	if(bus<MIN_BUS || bus>MAX_BUS){
+		printf("ERROR: uart bus must be between %d & %d\n", MIN_BUS, MAX_BUS);
+		return -1;
+	}
+	if(initialized[bus]==0){
+		printf("ERROR: uart%d must be initialized first\n", bus);
+		return -1;
+	}
+	if(ioctl(fd[bus], FIONREAD, &queued)<0) queued = 0;
+	return (rx_buf[bus].end - rx_buf[bus].start) + queued;
+}
+
+/*******************************************************************************
+* void* uart_reactor_loop(void* ptr)
+*
+* One epoll loop servicing every registered bus. When a bus is readable its
+* receive buffer is refilled and the unread span handed to the bus's parser.
+* Bytes the parser doesn't consume stay at the front for next time.
+*******************************************************************************/
+void* uart_reactor_loop(void* ptr){
+	struct epoll_event events[MAX_BUS-MIN_BUS+1];
+	uart_rx_buf_t* rx;
+	uart_parser_t parser;
+	int i, n, bus, used, ret, dead;
+
+	while(reactor_running){
+		n = epoll_wait(reactor_epfd, events, MAX_BUS-MIN_BUS+1, \
+													UART_REACTOR_POLL_MS);
+		if(n<0){
+			if(errno==EINTR) continue;
+			printf("uart reactor epoll_wait error: %s\n", strerror(errno));
+			break;
+		}
+		for(i=0;i<n;i++){
+			bus = events[i].data.u32;
+			// claim the bus before looking at its parser so
+			// uart_reactor_remove() knows to wait for us
+			__atomic_store_n(&reactor_active_bus, bus, __ATOMIC_SEQ_CST);
+			parser = __atomic_load_n(&reactor_parser[bus], __ATOMIC_SEQ_CST);
+			if(parser==NULL){
+				__atomic_store_n(&reactor_active_bus, -1, __ATOMIC_RELEASE);
+				continue;
+			}
+			rx = &rx_buf[bus];
+			ret = uart_read_ready(bus);
+			dead = ret<0 || (events[i].events & (EPOLLHUP|EPOLLERR));
+			if(rx->start!=rx->end){
+				used = parser(bus, rx->data+rx->start, rx->end-rx->start, \
+														reactor_ctx[bus]);
+				if(used<0) used = 0;
+				if(used > rx->end-rx->start) used = rx->end-rx->start;
+				rx->start += used;
+				// a full buffer the parser can't make sense of would
+				// never drain
+				if(rx->start==0 && rx->end==UART_RX_BUF_SIZE){
+					reactor_overflows[bus]++;
+					rx->end = 0;
+				}
+			}
+			// otherwise epoll reports the fd every pass and we spin
+			if(dead){
+				printf("ERROR: uart%d failed, dropping it from reactor\n", bus);
+				epoll_ctl(reactor_epfd, EPOLL_CTL_DEL, fd[bus], NULL);
+				__atomic_store_n(&reactor_parser[bus], NULL, __ATOMIC_RELEASE);
+				__atomic_store_n(&reactor_dead[bus], 1, __ATOMIC_RELEASE);
 			}
-			return bytes_read;  
+			__atomic_store_n(&reactor_active_bus, -1, __ATOMIC_RELEASE);
 		}
-		else if(ret == 0){
-			// timeout
-			return bytes_read;
+	}
+	return NULL;
+}
+
+/*******************************************************************************
+* int start_uart_reactor()
+*
+* Starts the single thread which services every bus added with
+* uart_reactor_add(). Buses still registered from before a
+* stop_uart_reactor() are picked up again. Returns 0 if running or already
+* running.
+*******************************************************************************/
+int start_uart_reactor(){
+	struct epoll_event ev;
+	uart_parser_t parser;
+	int bus;
+
+	if(reactor_running) return 0;
+	// a stop that timed out leaves its epoll fd to the thread still using it
+	if(reactor_epfd>=0){
+		printf("ERROR: previous uart reactor thread never exited\n");
+		return -1;
+	}
+	reactor_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(reactor_epfd<0){
+		printf("ERROR: uart reactor failed to create epoll fd\n");
+		return -1;
+	}
+	for(bus=MIN_BUS;bus<=MAX_BUS;bus++){
+		parser = __atomic_load_n(&reactor_parser[bus], __ATOMIC_ACQUIRE);
+		if(parser==NULL) continue;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = bus;
+		if(epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, fd[bus], &ev)<0){
+			printf("ERROR: failed to add uart%d back to reactor\n", bus);
+			__atomic_store_n(&reactor_parser[bus], NULL, __ATOMIC_RELEASE);
+			__atomic_store_n(&reactor_dead[bus], 1, __ATOMIC_RELEASE);
+		}
+	}
+	reactor_running = 1;
+	if(pthread_create(&reactor_thread, NULL, uart_reactor_loop, NULL)){
+		printf("ERROR: failed to start uart reactor thread\n");
+		reactor_running = 0;
+		close(reactor_epfd);
+		reactor_epfd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int stop_uart_reactor()
+*
+* stops the reactor thread, waiting up to 1 second. Buses stay open and
+* registered so start_uart_reactor() can pick them up again. If the thread
+* doesn't exit in time its epoll fd is left open for it and the reactor
+* can't be restarted.
+*******************************************************************************/
+int stop_uart_reactor(){
+	if(reactor_running==0) return 0;
+	reactor_running = 0;
+	timespec thread_timeout;
+	clock_gettime(CLOCK_REALTIME, &thread_timeout);
+	timespec_add(&thread_timeout, 1.0);
+	if(pthread_timedjoin_np(reactor_thread, NULL, &thread_timeout) \
+														== ETIMEDOUT){
+		printf("WARNING: uart reactor exit timeout\n");
+		return -1;
+	}
+	close(reactor_epfd);
+	reactor_epfd = -1;
+	return 0;
+}
+
+/*******************************************************************************
+* int uart_reactor_add(int bus, uart_parser_t parser, void* ctx)
+*
+* Hands an initialized bus to the reactor. The reactor must be started
+* first. Don't call the uart_read functions on the bus afterwards, the
+* parser gets all received data.
+*******************************************************************************/
+int uart_reactor_add(int bus, uart_parser_t parser, void* ctx){
+	struct epoll_event ev;
+
+	if(bus<MIN_BUS || bus>MAX_BUS){
+		printf("ERROR: uart bus must be between %d & %d\n", MIN_BUS, MAX_BUS);
+		return -1;
+	}
+	if(initialized[bus]==0){
+		printf("ERROR: uart%d must be initialized first\n", bus);
+		return -1;
+	}
+	if(reactor_running==0 || parser==NULL){
+		printf("ERROR: uart reactor needs to be started with a parser\n");
+		return -1;
+	}
+	reactor_ctx[bus] = ctx;
+	reactor_dead[bus] = 0;
+	__atomic_store_n(&reactor_parser[bus], parser, __ATOMIC_RELEASE);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = bus;
+	if(epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, fd[bus], &ev)<0 && \
+		epoll_ctl(reactor_epfd, EPOLL_CTL_MOD, fd[bus], &ev)<0){
+		printf("ERROR: failed to add uart%d to reactor\n", bus);
+		reactor_parser[bus] = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int uart_reactor_remove(int bus)
+*
+* Takes a bus back from the reactor. Unparsed bytes stay in the receive
+* buffer for the uart_read functions. If the reactor thread is busy with this
+* bus we wait for it to finish, so once this returns the parser won't be
+* called again and the caller may read or close the bus. A parser may remove
+* its own bus, in which case there's nothing to wait for.
+*******************************************************************************/
+int uart_reactor_remove(int bus){
+	if(bus<MIN_BUS || bus>MAX_BUS){
+		printf("ERROR: uart bus must be between %d & %d\n", MIN_BUS, MAX_BUS);
+		return -1;
+	}
+	if(reactor_epfd>=0) epoll_ctl(reactor_epfd, EPOLL_CTL_DEL, fd[bus], NULL);
+	__atomic_store_n(&reactor_parser[bus], NULL, __ATOMIC_SEQ_CST);
+	if(reactor_running && !pthread_equal(pthread_self(), reactor_thread)){
+		while(__atomic_load_n(&reactor_active_bus, __ATOMIC_SEQ_CST)==bus){
+			sched_yield();
 		}
-		else{
-			// There was data to read. Read one bytes;
-			ret=read(fd[bus], &temp, 1);
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int uart_reactor_dead(int bus)
+*
+* Returns 1 if the reactor dropped the bus because reading it failed or the
+* port hung up, 0 otherwise. Adding the bus again clears it.
+*******************************************************************************/
+int uart_reactor_dead(int bus){
+	if(bus<MIN_BUS || bus>MAX_BUS) return 0;
+	return __atomic_load_n(&reactor_dead[bus], __ATOMIC_ACQUIRE);
+}
+
+/*******************************************************************************
+* uint64_t uart_reactor_overflows(int bus)
+*
+* Number of times a bus's receive buffer filled without its parser consuming
+* anything and had to be discarded.
+*******************************************************************************/
+uint64_t uart_reactor_overflows(int bus){
+	if(bus<MIN_BUS || bus>MAX_BUS) return 0;
+	return reactor_overflows[bus];
+}
+
+/*******************************************************************************
+* int uart_tx_flush_ready(int bus)
+*
+* writer thread only. Sends every published slot, up to UART_TX_IOV_MAX per
+* writev, and hands the slots back to producers. Returns slots sent.
+*******************************************************************************/
+static int uart_tx_flush_ready(int bus){
+	uart_tx_queue_t* q = &tx_queue[bus];
+	struct iovec iov[UART_TX_IOV_MAX];
+	uart_tx_slot_t* slot;
+	unsigned int pos;
+	int i, n, ret, sent = 0;
+
+	while(1){
+		// gather a run of published slots
+		n = 0;
+		pos = q->head;
+		while(n<UART_TX_IOV_MAX){
+			slot = &q->slots[(pos+n) & (UART_TX_SLOTS-1)];
+			if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos+n+1) break;
+			iov[n].iov_base = slot->data;
+			iov[n].iov_len = slot->len;
+			n++;
+		}
+		if(n==0) return sent;
+
+		// writev may stop short, carry on from where it got to
+		i = 0;
+		while(i<n){
+			ret = writev(fd[bus], &iov[i], n-i);
 			if(ret<0){
-				printf("ERROR: uart read() returned %d\n", ret);
-				return -1;
+				if(errno==EINTR) continue;
+				// give up on this run and count it as dropped
+				for(;i<n;i++){
+					__atomic_add_fetch(&q->dropped_bytes, iov[i].iov_len, \
+														__ATOMIC_RELAXED);
+				}
+				break;
+			}
+			while(i<n && (size_t)ret>=iov[i].iov_len){
+				ret -= iov[i].iov_len;
+				i++;
 			}
-			else if(ret==1){
-				// success, actually read something
-				if(temp=='\n') return bytes_read;
-				else{
-					*(buf+bytes_read)=temp;
-					bytes_read++;
-				}	
+			if(i<n){
+				iov[i].iov_base = (char*)iov[i].iov_base + ret;
+				iov[i].iov_len -= ret;
 			}
 		}
+
+		// release the slots
+		for(i=0;i<n;i++){
+			slot = &q->slots[(pos+i) & (UART_TX_SLOTS-1)];
+			__atomic_store_n(&slot->seq, pos+i+UART_TX_SLOTS, __ATOMIC_RELEASE);
+		}
+		q->head = pos+n;
+		sent += n;
 	}
-	
-	return bytes_read;
 }
 
+/*******************************************************************************
+* void* uart_tx_writer(void* ptr)
+*
+* sleeps until something is queued then flushes. Once stopped it waits for
+* producers still inside uart_queue_bytes() and flushes whatever is left
+* before exiting.
+*******************************************************************************/
+void* uart_tx_writer(void* ptr){
+	int bus = (int)(long)ptr;
+	uart_tx_queue_t* q = &tx_queue[bus];
+	timespec timeout;
+
+	while(__atomic_load_n(&q->running, __ATOMIC_SEQ_CST)){
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timespec_add(&timeout, UART_TX_POLL_S);
+		sem_timedwait(&q->wake, &timeout);
+		uart_tx_flush_ready(bus);
+	}
+	// a producer that saw running set may still be filling its slot
+	while(__atomic_load_n(&q->posting, __ATOMIC_SEQ_CST)) sched_yield();
+	uart_tx_flush_ready(bus);
+	return NULL;
+}
+
+/*******************************************************************************
+* int start_uart_tx_queue(int bus)
+*
+* allocates the queue for an initialized bus and starts its writer thread.
+* Returns 0 if running or already running.
+*******************************************************************************/
+int start_uart_tx_queue(int bus){
+	uart_tx_queue_t* q;
+	int i;
 
+	if(bus<MIN_BUS || bus>MAX_BUS){
+		printf("ERROR: uart bus must be between %d & %d\n", MIN_BUS, MAX_BUS);
+		return -1;
+	}
+	if(initialized[bus]==0){
+		printf("ERROR: uart%d must be initialized first\n", bus);
+		return -1;
+	}
+	q = &tx_queue[bus];
+	if(q->running) return 0;
+	// callers that lost the race with the last stop are still backing out
+	while(__atomic_load_n(&q->posting, __ATOMIC_SEQ_CST)) sched_yield();
+	if(q->slots==NULL){
+		q->slots = (uart_tx_slot_t*)malloc(UART_TX_SLOTS*sizeof(uart_tx_slot_t));
+		if(q->slots==NULL){
+			printf("ERROR: failed to allocate uart%d tx queue\n", bus);
+			return -1;
+		}
+	}
+	for(i=0;i<UART_TX_SLOTS;i++) q->slots[i].seq = i;
+	q->head = 0;
+	q->tail = 0;
+	q->dropped_bytes = 0;
+	sem_init(&q->wake, 0, 0);
+	__atomic_store_n(&q->running, 1, __ATOMIC_SEQ_CST);
+	if(pthread_create(&q->thread, NULL, uart_tx_writer, (void*)(long)bus)){
+		printf("ERROR: failed to start uart%d tx writer\n", bus);
+		__atomic_store_n(&q->running, 0, __ATOMIC_SEQ_CST);
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int stop_uart_tx_queue(int bus)
+*
+* stops the writer after it sends what is already queued, waiting up to 1
+* second. Messages from uart_queue_bytes() calls that raced with the stop are
+* either sent or refused, never lost. The slots stay allocated for the next
+* start.
+*******************************************************************************/
+int stop_uart_tx_queue(int bus){
+	uart_tx_queue_t* q;
+	int ret = 0;
+
+	if(bus<MIN_BUS || bus>MAX_BUS){
+		printf("ERROR: uart bus must be between %d & %d\n", MIN_BUS, MAX_BUS);
+		return -1;
+	}
+	q = &tx_queue[bus];
+	if(q->running==0) return 0;
+	__atomic_store_n(&q->running, 0, __ATOMIC_SEQ_CST);
+	// anyone who saw running set gets to publish before the final flush
+	while(__atomic_load_n(&q->posting, __ATOMIC_SEQ_CST)) sched_yield();
+	sem_post(&q->wake);
+	timespec thread_timeout;
+	clock_gettime(CLOCK_REALTIME, &thread_timeout);
+	timespec_add(&thread_timeout, 1.0);
+	if(pthread_timedjoin_np(q->thread, NULL, &thread_timeout) == ETIMEDOUT){
+		printf("WARNING: uart%d tx writer exit timeout\n", bus);
+		ret = -1;
+	}
+	else sem_destroy(&q->wake);
+	return ret;
+}
+
+/*******************************************************************************
+* int uart_queue_bytes(int bus, int bytes, const char* data)
+*
+* Copies a message into the bus's transmit queue and returns immediately.
+* The message is sent whole, never interleaved with other callers' messages.
+* If the queue is full the message is dropped and counted, returns -1.
+*******************************************************************************/
+int uart_queue_bytes(int bus, int bytes, const char* data){
+	uart_tx_queue_t* q;
+	uart_tx_slot_t* slot;
+	unsigned int pos, seq;
+	int diff;
+
+	if(bus<MIN_BUS || bus>MAX_BUS){
+		printf("ERROR: uart bus must be between %d & %d\n", MIN_BUS, MAX_BUS);
+		return -1;
+	}
+	if(bytes<1 || bytes>UART_TX_SLOT_BYTES){
+		printf("ERROR: queued uart message must be 1 to %d bytes\n", \
+														UART_TX_SLOT_BYTES);
+		return -1;
+	}
+	q = &tx_queue[bus];
+	// announce the call before checking running, stop_uart_tx_queue() clears
+	// running then waits for posting to drop so it never misses this one
+	__atomic_add_fetch(&q->posting, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&q->running, __ATOMIC_SEQ_CST)==0){
+		__atomic_sub_fetch(&q->posting, 1, __ATOMIC_SEQ_CST);
+		printf("ERROR: uart%d tx queue not started\n", bus);
+		return -1;
+	}
+
+	pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	while(1){
+		slot = &q->slots[pos & (UART_TX_SLOTS-1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (int)(seq - pos);
+		if(diff==0){
+			if(__atomic_compare_exchange_n(&q->tail, &pos, pos+1, 1, \
+									__ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				break;
+			}
+		}
+		else if(diff<0){
+			__atomic_add_fetch(&q->dropped_bytes, bytes, __ATOMIC_RELAXED);
+			__atomic_sub_fetch(&q->posting, 1, __ATOMIC_SEQ_CST);
+			return -1;
+		}
+		else pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	}
+	memcpy(slot->data, data, bytes);
+	slot->len = bytes;
+	__atomic_store_n(&slot->seq, pos+1, __ATOMIC_RELEASE);
+	sem_post(&q->wake);
+	__atomic_sub_fetch(&q->posting, 1, __ATOMIC_SEQ_CST);
+	return bytes;
+}
+
+/*******************************************************************************
+* uint64_t uart_tx_dropped_bytes(int bus)
+*
+* bytes discarded because the transmit queue was full or the write failed
+*******************************************************************************/
+uint64_t uart_tx_dropped_bytes(int bus){
+	if(bus<MIN_BUS || bus>MAX_BUS) return 0;
+	return __atomic_load_n(&tx_queue[bus].dropped_bytes, __ATOMIC_RELAXED);
+}
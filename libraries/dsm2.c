@@ -15,7 +15,7 @@
 //#define DEBUG
 //#define DEBUG_RAW
 
-#define MAX_DSM2_CHANNELS 9
+#define MAX_DSM2_CHANNELS DSM2_MAX_CHANNELS
 #define GPIO_PIN_BIND 30 //P9.11 gpio_0[30]
 #define PINMUX_PATH "/sys/devices/ocp.3/P9_11_pinmux.13/state"
 #define PAUSE 115	//microseconds
@@ -26,81 +26,66 @@
 #define DSM2_BAUD_RATE 		115200
 #define DSM2_PACKET_SIZE 	16
 
+#define DSM2_FRAME_GAP_US	5000	// a quiet line this long means a new frame
+#define DSM2_TIMEOUT_MS		100		// link considered lost after this
+
 /*******************************************************************************
 * Local Global Variables
 *******************************************************************************/
 int running;
-int rc_channels[MAX_DSM2_CHANNELS];
 int rc_maxes[MAX_DSM2_CHANNELS];
 int rc_mins[MAX_DSM2_CHANNELS];
 int num_channels; // actual number of channels being sent
-int resolution; // 10 or 11
 int new_dsm2_flag;
 int dsm2_frame_rate;
-uint64_t last_time;
-pthread_t serial_parser_thread;
+
+// last complete set of channels, published by the parser through dsm2_pub
+frame_pub_t dsm2_pub;
+dsm2_data_t dsm2_snapshot;
 int listening; // for calibration routine only
 int (*dsm2_ready_func)();
 int is_dsm2_active_flag; 
 
+// frame assembly state, only touched by the uart reactor thread
+unsigned char dsm2_frame[DSM2_PACKET_SIZE];
+int dsm2_frame_pos;			// bytes of dsm2_frame received, -1 until synced
+uint64_t dsm2_last_byte_us;	// micros_since_boot() of the last arrival
+int dsm2_new_values[MAX_DSM2_CHANNELS]; // hold new values before committing
+uint64_t dsm2_sync_losses;
+uint64_t dsm2_decode_errors;
+dsm_res_lock_t dsm2_res;	// resolution detection and lock
+
 /*******************************************************************************
 * Local Function Declarations
 *******************************************************************************/
 int load_default_calibration();
-void* serial_parser(void *ptr); //background thread
+int dsm2_parse_stream(int bus, const char* data, int len, void* ctx);
 void* calibration_listen_func(void *params);
+static int start_dsm2_parser();
+static int dsm2_decode_packet(const unsigned char* buf);
 
 /*******************************************************************************
 * int initialize_dsm2()
 * 
 * returns -1 for failure or 0 for success
-* This starts the background thread serial_parser_thread which listens
-* for serials packets on that interface.
+* This hands the DSM2 UART to the uart reactor, starting the reactor if
+* needed, which then passes every byte to dsm2_parse_stream().
 *******************************************************************************/ 
 int initialize_dsm2(){
-	int i;
 	//if calibration file exists, load it and start spektrum thread
-	FILE *cal;
-	char file_path[100];
-
-	// construct a new file path string
-	strcpy (file_path, CONFIG_DIRECTORY);
-	strcat (file_path, DSM2_CAL_FILE);
-	
-	// open for reading
-	cal = fopen(file_path, "r");
-
-	if (cal == NULL) {
-		printf("\nDSM2 Calibration File Doesn't Exist Yet\n");
+	if(load_rc_calibration(DSM2_CAL_FILE, rc_mins, rc_maxes, \
+						MAX_DSM2_CHANNELS, DEFAULT_MIN, DEFAULT_MAX)>0){
 		printf("Run calibrate_dsm2 example to create one\n");
-		printf("Using default values for now\n");
-		load_default_calibration();
-	}
-	else{
-		for(i=0;i<MAX_DSM2_CHANNELS;i++){
-			fscanf(cal,"%d %d", &rc_mins[i],&rc_maxes[i]);
-		}
-		#ifdef DEBUG
-		printf("DSM2 Calibration Loaded\n");
-		#endif
-		fclose(cal);
 	}
+	#ifdef DEBUG
+	else printf("DSM2 Calibration Loaded\n");
+	#endif
 	
-	
-	dsm2_frame_rate = 0; // zero until mode is detected on first packet
-	running = 1; // lets uarts 4 thread know it can run
-	num_channels = 0;
-	last_time = 0;
-	is_dsm2_active_flag = 0;
-	set_new_dsm2_data_func(&null_func);
-	
-	if(initialize_uart(DSM2_UART_BUS, DSM2_BAUD_RATE, 0.1)){
-		printf("Error, failed to initialize UART%d for DSM2\n", DSM2_UART_BUS);
+	if(start_dsm2_parser()<0){
+		return -1;
 	}
-	
-	pthread_create(&serial_parser_thread, NULL, serial_parser, (void*) NULL);
 	#ifdef DEBUG
-	printf("DSM2 Thread Started\n");
+	printf("DSM2 parser Started\n");
 	#endif
 	return 0;
 }
@@ -116,14 +101,14 @@ int initialize_dsm2(){
 * radio with default settings.
 *******************************************************************************/
 int get_dsm2_ch_raw(int ch){
+	dsm2_data_t d;
 	if(ch<1 || ch > MAX_DSM2_CHANNELS){
 		printf("please enter a channel between 1 & %d",MAX_DSM2_CHANNELS);
 		return -1;
 	}
-	else{
-		new_dsm2_flag = 0;
-		return rc_channels[ch-1];
-	}
+	get_dsm2_data(&d);
+	new_dsm2_flag = 0;
+	return d.ch[ch-1];
 }
 
 /*******************************************************************************
@@ -139,11 +124,11 @@ float get_dsm2_ch_normalized(int ch){
 		printf("please enter a channel between 1 & %d",MAX_DSM2_CHANNELS);
 		return -1;
 	}
+	int raw = get_dsm2_ch_raw(ch);
 	float range = rc_maxes[ch-1]-rc_mins[ch-1];
-	if(range!=0 && rc_channels[ch-1]!=0) {
-		new_dsm2_flag = 0;
+	if(range!=0 && raw!=0) {
 		float center = (rc_maxes[ch-1]+rc_mins[ch-1])/2;
-		return 2*(rc_channels[ch-1]-center)/range;
+		return 2*(raw-center)/range;
 	}
 	else{
 		return 0;
@@ -177,7 +162,7 @@ int set_new_dsm2_data_func(int (*func)(void)){
 * returns a 0 if no packet has been received yet
 *******************************************************************************/
 int get_dsm2_frame_resolution(){
-	return resolution;
+	return __atomic_load_n(&dsm2_snapshot.resolution, __ATOMIC_RELAXED);
 }
 
 /*******************************************************************************
@@ -187,7 +172,7 @@ int get_dsm2_frame_resolution(){
 * returns 0 if no packets have been received yet.
 *******************************************************************************/
 int get_num_dsm2_channels(){
-	return num_channels;
+	return __atomic_load_n(&dsm2_snapshot.num_channels, __ATOMIC_RELAXED);
 }
 
 /*******************************************************************************
@@ -197,9 +182,14 @@ int get_num_dsm2_channels(){
 * returns 0 otherwise.
 *******************************************************************************/
 int is_dsm2_active(){
+	// the parser only runs when bytes arrive so notice silence here
+	if(is_dsm2_active_flag && ms_since_last_dsm2_packet()>DSM2_TIMEOUT_MS){
+		is_dsm2_active_flag = 0;
+	}
 	return is_dsm2_active_flag;
 }
 
+
 /*******************************************************************************
 * @ int ms_since_last_dsm2_packet()
 * 
@@ -207,221 +197,313 @@ int is_dsm2_active(){
 * if no packet has ever been received, return -1;
 *******************************************************************************/
 int ms_since_last_dsm2_packet(){
-	// if global variable last_time ==0 then no packet must have arrived yet
-	if (last_time==0){
+	dsm2_data_t d;
+	get_dsm2_data(&d);
+	// a zero timestamp means no packet has arrived yet
+	if (d.timestamp_us==0){
 		return -1;
 	}
-	// otherwise in normal operation just subtract last time from new time
-	uint64_t current_time = micros_since_epoch();
-	
-	return (int)((current_time-last_time)/1000);
+	return (int)((micros_since_boot()-d.timestamp_us)/1000);
 }
 
 /*******************************************************************************
-* @ void* serial_parser(void *ptr)
+* @ int get_dsm2_data(dsm2_data_t* data)
 * 
-* This is a local function that is started as a background thread by 
-* initialize_dsm2(). This monitors the serial port and interprets data
-* for each packet, it determines 10 or 11 bit resolution
-* Radios with more than 7 channels split data across multiple packets. Thus, 
-* new data is not committed until a full set of channel data is received.
+* copies the latest complete set of channels. All channels, the resolution and
+* the timestamp come from the same frame. Never blocks the parser.
+*******************************************************************************/
+int get_dsm2_data(dsm2_data_t* data){
+	frame_pub_read(&dsm2_pub, data, &dsm2_snapshot, sizeof(dsm2_data_t));
+	return 0;
+}
+
+/*******************************************************************************
+* @ int wait_dsm2_frame(float timeout_s)
+* 
+* sleeps on a futex until the parser publishes the next complete frame.
+* Returns 0 when one arrived or -1 on timeout. A negative timeout waits
+* until a frame arrives or EXITING.
 *******************************************************************************/
-void* serial_parser(void *ptr){
-	char buf[DSM2_PACKET_SIZE]; // large serial buffer to catch doubled up packets
-	int i, ret;
-	int new_values[MAX_DSM2_CHANNELS]; // hold new values before committing
+int wait_dsm2_frame(float timeout_s){
+	return frame_pub_wait(&dsm2_pub, timeout_s);
+}
+
+/*******************************************************************************
+* @ uint64_t get_dsm2_sync_losses()
+* 
+* returns how many times a frame was cut short by the inter-frame gap and had
+* to be thrown away since the service started.
+*******************************************************************************/
+uint64_t get_dsm2_sync_losses(){
+	return __atomic_load_n(&dsm2_sync_losses, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************************
+* @ uint64_t get_dsm2_decode_errors()
+* 
+* returns how many complete frames were rejected by dsm_decode()
+*******************************************************************************/
+uint64_t get_dsm2_decode_errors(){
+	return __atomic_load_n(&dsm2_decode_errors, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************************
+* static int start_dsm2_parser()
+* 
+* resets the parser state, opens the DSM2 UART in low latency mode and
+* registers dsm2_parse_stream() with the uart reactor.
+*******************************************************************************/
+static int start_dsm2_parser(){
+	dsm2_frame_rate = 0; // zero until mode is detected on first packet
+	num_channels = 0;
+	is_dsm2_active_flag = 0;
+	frame_pub_clear(&dsm2_pub, &dsm2_snapshot, sizeof(dsm2_snapshot));
+	dsm2_frame_pos = -1;
+	dsm2_last_byte_us = 0;
+	dsm2_sync_losses = 0;
+	dsm2_decode_errors = 0;
+	memset(&dsm2_res, 0, sizeof(dsm2_res));
+	memset(dsm2_new_values, 0, sizeof(dsm2_new_values));
+	set_new_dsm2_data_func(&null_func);
 	
-	flush_uart(DSM2_UART_BUS); // flush the buffer
+	if(initialize_uart_low_latency(DSM2_UART_BUS, DSM2_BAUD_RATE, 0.1, 0)){
+		printf("Error, failed to initialize UART%d for DSM2\n", DSM2_UART_BUS);
+		return -1;
+	}
+	flush_uart(DSM2_UART_BUS); // throw away anything from before we started
+	if(start_uart_reactor()<0){
+		return -1;
+	}
+	running = 1;
+	if(uart_reactor_add(DSM2_UART_BUS, dsm2_parse_stream, NULL)<0){
+		running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* @ int dsm2_parse_stream(int bus, const char* data, int len, void* ctx)
+* 
+* uart reactor callback, called with whatever bytes have arrived. The
+* receiver sends a 16 byte frame every 11 or 22ms, which takes about 1.4ms
+* at 115200 baud, so the line is quiet for most of each period. Any gap longer
+* than DSM2_FRAME_GAP_US means the next byte starts a frame. Frames are then
+* assembled byte by byte and decoded as soon as the 16th arrives. A gap in
+* the middle of a frame means bytes were lost; only that frame is dropped and
+* counted as a sync loss, the following one is already aligned.
+*******************************************************************************/
+int dsm2_parse_stream(int bus, const char* data, int len, void* ctx){
+	uint64_t now = micros_since_boot();
+	int i;
 	
-	// running will become 0 when stop_dsm2_service() is called
-	// mostly likely that will be called by cleanup_cape()
-	while(running && get_state()!=EXITING){
-		memset(&buf, 0, sizeof(buf)); // clear buffer
-		// read the buffer and decide what to do
-		ret = uart_read_bytes(DSM2_UART_BUS, DSM2_PACKET_SIZE, buf);
-		if(ret<0){ //error
-			printf("ERROR reading uart %d\n", DSM2_UART_BUS);
-			is_dsm2_active_flag=0;
-			goto end;
+	(void)bus;
+	(void)ctx;
+	if(dsm2_last_byte_us!=0 && now-dsm2_last_byte_us>DSM2_FRAME_GAP_US){
+		if(dsm2_frame_pos>0){
+			__atomic_add_fetch(&dsm2_sync_losses, 1, __ATOMIC_RELAXED);
 		}
-		else if(ret==0){//timeout
-			is_dsm2_active_flag=0; // indicate connection is no longer active
-			goto end;
+		dsm2_frame_pos = 0;
+	}
+	dsm2_last_byte_us = now;
+	
+	// until the first gap we can't tell where frames start
+	if(dsm2_frame_pos<0){
+		return len;
+	}
+	for(i=0;i<len;i++){
+		dsm2_frame[dsm2_frame_pos++] = data[i];
+		if(dsm2_frame_pos==DSM2_PACKET_SIZE){
+			dsm2_decode_packet(dsm2_frame);
+			dsm2_frame_pos = 0;
 		}
-		else if (ret>0 && ret<DSM2_PACKET_SIZE){ // partial packet
-			// try to get back in sync
-			flush_uart(DSM2_UART_BUS); // flush the buffer
-			goto end;
+	}
+	return len;
+}
+
+/*******************************************************************************
+* DSM frame layout tables, indexed by resolution-10
+*
+* each 16 bit word after the first holds a channel id and value. In 10-bit
+* 1024/22ms mode the id sits in bits 10-14, in 11-bit 2048/11ms mode in bits
+* 11-14, and the extra bit of precision means 11-bit values are halved.
+*******************************************************************************/
+static const uint16_t dsm_id_mask[2]	= {0x7C00, 0x7800};
+static const uint8_t  dsm_id_shift[2]	= {10, 11};
+static const uint16_t dsm_val_mask[2]	= {0x03FF, 0x07FF};
+static const uint8_t  dsm_val_shift[2]	= {0, 1};
+
+/*******************************************************************************
+* int dsm_decode(const uint8_t* buf, dsm_frame_t* frame)
+* 
+* decodes one 16 byte DSM2/DSMX frame into frame, touching nothing else.
+* If frame->resolution is 10 or 11 on entry that layout is used, otherwise it
+* is detected: an id above the channel limit when read as 10-bit means the
+* frame must be 11-bit. Words of 0xFFFF are unused and skipped. Returns the
+* number of channel words decoded or -1 if an id is out of range.
+*******************************************************************************/
+int dsm_decode(const uint8_t* buf, dsm_frame_t* frame){
+	uint16_t word[7];
+	int i, r, id;
+
+	for(i=0;i<7;i++){
+		word[i] = (buf[2+2*i]<<8) | buf[3+2*i];
+	}
+	if(frame->resolution==10 || frame->resolution==11){
+		r = frame->resolution-10;
+	}
+	else{
+		r = 0;
+		for(i=0;i<7;i++){
+			if(word[i]!=0xFFFF && \
+				((word[i]&dsm_id_mask[0])>>dsm_id_shift[0])>=MAX_DSM2_CHANNELS){
+				r = 1;
+				break;
+			}
 		}
-		
-		// okay, must have a full packet now
-		
-		#ifdef DEBUG
-			printf("read %d bytes, ", j+i);
-		#endif
-		
-		#ifdef DEBUG_RAW
-		printf("read %d bytes, ", j+i);
-		for(i=0; i<8; i++){
-			printf(byte_to_binary(buf[i*2]));
-			printf(" ");
-			printf(byte_to_binary(buf[(i*2)+1]));
-			printf("   ");
+		frame->resolution = 10+r;
+	}
+	frame->num_words = 0;
+	for(i=0;i<7;i++){
+		if(word[i]==0xFFFF) continue;
+		id = (word[i]&dsm_id_mask[r])>>dsm_id_shift[r];
+		if(id>=MAX_DSM2_CHANNELS) return -1;
+		frame->ch_id[frame->num_words] = id;
+		// shift range so 1500 is neutral
+		frame->value[frame->num_words] = \
+			((word[i]&dsm_val_mask[r])>>dsm_val_shift[r]) + 989;
+		frame->num_words++;
+	}
+	return frame->num_words;
+}
+
+/*******************************************************************************
+* int dsm_decode_locked(dsm_res_lock_t* lock, const uint8_t* buf,
+*													dsm_frame_t* frame)
+* 
+* dsm_decode() with the resolution detected per frame until
+* DSM2_RES_LOCK_FRAMES in a row agree, then it is locked and detection
+* skipped. As many decode errors in a row unlock it again. An error while
+* still detecting leaves the agreeing count alone.
+*******************************************************************************/
+int dsm_decode_locked(dsm_res_lock_t* lock, const uint8_t* buf, \
+													dsm_frame_t* frame){
+	int n;
+
+	frame->resolution = lock->locked;
+	n = dsm_decode(buf, frame);
+	if(n<0){
+		if(lock->locked && ++lock->count>=DSM2_RES_LOCK_FRAMES){
+			lock->locked = 0;
+			lock->count = 0;
 		}
-		printf("\n");
-		#endif
-		
-		
-		
-		// Next we must check if the packets are 10-bit 1024/22ms mode
-		// or 11bit 2048/11ms mode. read through and decide which one, then read
-		int mode = 22; // start assuming 10-bit 1024 mode, 22ms
-		unsigned char ch_id;
-		int16_t value;
-		
-		// first check each channel id assuming 1024/22ms mode
-		// where the channel id lives in 0b01111000 mask
-		// if one doesn't make sense, must be using 2048/11ms mode
-		for(i=1;i<=7;i++){
-			// last few words in buffer are often all 1's, ignore those
-			if(buf[2*i]!=0xFF && buf[(2*i)+1]!=0xFF){
-				// grab channel id from first byte
-				ch_id = (buf[i*2]&0b01111100)>>2;
-				// maximum 9 channels, if the channel id exceeds that,
-				// we must be reading it wrong, swap to 11ms mode
-				if((ch_id+1)>MAX_DSM2_CHANNELS){
-					#ifdef DEBUG
-					printf("2048/11ms ");
-					#endif
-					
-					mode = 11;
-					goto read_packet;
-				}
-			}
+		return -1;
+	}
+	if(lock->locked){
+		lock->count = 0;
+	}
+	else if(frame->resolution==lock->seen){
+		if(++lock->count>=DSM2_RES_LOCK_FRAMES){
+			lock->locked = frame->resolution;
+			lock->count = 0;
 		}
+	}
+	else{
+		lock->seen = frame->resolution;
+		lock->count = 1;
+	}
+	return n;
+}
+
+/*******************************************************************************
+* static int dsm2_decode_packet(const unsigned char* buf)
+* 
+* runs one complete frame through dsm_decode_locked().
+* Radios with more than 7 channels split data across multiple packets. Thus, 
+* new data is not committed until a full set of channel data is received.
+* Returns -1 if the frame doesn't make sense, otherwise 0.
+*******************************************************************************/
+static int dsm2_decode_packet(const unsigned char* buf){
+	dsm_frame_t frame;
+	dsm2_data_t data;
+	int i;
+	
+	#ifdef DEBUG_RAW
+	for(i=0; i<8; i++){
+		printf(byte_to_binary(buf[i*2]));
+		printf(" ");
+		printf(byte_to_binary(buf[(i*2)+1]));
+		printf("   ");
+	}
+	printf("\n");
+	#endif
+	
+	if(dsm_decode_locked(&dsm2_res, buf, &frame)<0){
+		__atomic_add_fetch(&dsm2_decode_errors, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	dsm2_frame_rate = (frame.resolution==11) ? 11 : 22;
+	
+	for(i=0;i<frame.num_words;i++){
 		#ifdef DEBUG
-			printf("1024/22ms ");
+		printf("%d %d  ",frame.ch_id[i],frame.value[i]);
 		#endif
-
-read_packet:			
-		// packet is 16 bytes, 8 words long
-		// first word doesn't have channel data, so iterate through last 7 words
-		for(i=1;i<=7;i++){
-			// in  8 and 9 ch radios, unused words are 0xFF
-			// skip if one of them
-			if(buf[2*i]!=0xFF || buf[(2*i)+1]!=0xFF){
-				// grab channel id from first byte
-				// and value from both bytes
-				if(mode == 22){
-					dsm2_frame_rate = 22;
-					ch_id = (buf[i*2]&0b01111100)>>2; 
-					// grab value from least 11 bytes
-					value = ((buf[i*2]&0b00000011)<<8) + buf[(2*i)+1];
-					value += 989; // shift range so 1500 is neutral
-				}
-				else if(mode == 11){
-					dsm2_frame_rate = 11;
-					ch_id = (buf[i*2]&0b01111000)>>3; 
-					// grab value from least 11 bytes
-					value = ((buf[i*2]&0b00000111)<<8) + buf[(2*i)+1];
-					
-					// extra bit of precision means scale is off by factor of 
-					// two, also add 989 to center channels around 1500
-					value = (value/2) + 989; 
-				}
-				else{
-					printf("ERROR: dsm2 mode incorrect\n");
-					goto end;
-				}
-				
-				#ifdef DEBUG
-				printf("%d %d  ",ch_id,value);
-				#endif
-				
-				if((ch_id+1)>9){
-					#ifdef DEBUG
-					printf("error: bad channel id\n");
-					#endif
-					
-					#ifndef DEBUG
-					goto end;
-					#endif
-				}
-				// throttle is first channel always
-				// ch_id is 0 indexed
-				// and rc_channels is 0 indexed
-				new_values[ch_id] = value;
-				if((ch_id+1)>num_channels){
-					num_channels = ch_id+1;
-				}
-			}
+		// throttle is first channel always
+		// ch_id is 0 indexed
+		// and dsm2_snapshot.ch is 0 indexed
+		dsm2_new_values[frame.ch_id[i]] = frame.value[i];
+		if((frame.ch_id[i]+1)>num_channels){
+			num_channels = frame.ch_id[i]+1;
 		}
+	}
 
-		// check if a complete set of channel data has been received
-		// otherwise wait for another packet with more data
-		int is_complete=1;
-		for(i=0;i<num_channels;i++){
-			if (new_values[i]==0){
-				is_complete=0;
-				#ifdef DEBUG
-				printf("waiting for rest of data in next packet\n");
-				#endif
-				break;
-			}
-		}
-		if(is_complete){
+	// check if a complete set of channel data has been received
+	// otherwise wait for another packet with more data
+	for(i=0;i<num_channels;i++){
+		if (dsm2_new_values[i]==0){
 			#ifdef DEBUG
-			printf("all data complete now\n");
+			printf("waiting for rest of data in next packet\n");
 			#endif
-			new_dsm2_flag=1;
-			is_dsm2_active_flag=1;
-			resolution = mode;
-			last_time = micros_since_epoch();
-			for(i=0;i<num_channels;i++){
-				rc_channels[i]=new_values[i];
-				new_values[i]=0;
-			}
-			// run the dsm2 ready function.
-			// this is null unless user changed it
-			dsm2_ready_func();
+			return 0;
 		}
-		
-		#ifdef DEBUG
-		printf("\n");
-		#endif
-		
-end: ;
-
 	}
-	return NULL;
+	#ifdef DEBUG
+	printf("all data complete now\n");
+	#endif
+	// channels only ever get added so the ones above num_channels are 0
+	memset(&data, 0, sizeof(data));
+	for(i=0;i<num_channels;i++){
+		data.ch[i]=dsm2_new_values[i];
+		dsm2_new_values[i]=0;
+	}
+	data.num_channels = num_channels;
+	data.resolution = frame.resolution;
+	data.timestamp_us = micros_since_boot();
+	frame_pub_write(&dsm2_pub, &dsm2_snapshot, &data, sizeof(data));
+	new_dsm2_flag=1;
+	is_dsm2_active_flag=1;
+	
+	// wake wait_dsm2_frame()
+	frame_pub_notify(&dsm2_pub);
+	// run the dsm2 ready function.
+	// this is null unless user changed it
+	dsm2_ready_func();
+	return 0;
 }
 
 /*******************************************************************************
 * @ int stop_dsm2_service()
 * 
-* signals the serial_parser_thread to stop and allows up to 1 second for the 
-* thread to  shut down before returning.
+* takes the DSM2 UART back from the uart reactor. The reactor itself keeps
+* running for other buses until cleanup_board().
 *******************************************************************************/
 int stop_dsm2_service(){
-	int ret = 0;
-	
 	if (running){
-		running = 0; // this tells serial_parser_thread loop to stop
-		// allow up to 0.3 seconds for thread cleanup
-		timespec thread_timeout;
-		clock_gettime(CLOCK_REALTIME, &thread_timeout);
-		timespec_add(&thread_timeout, 0.3);
-		int thread_err = 0;
-		thread_err = pthread_timedjoin_np(serial_parser_thread, NULL, 
-															   &thread_timeout);
-		if(thread_err == ETIMEDOUT){
-			printf("WARNING: dsm2 serial_parser_thread exit timeout\n");
-			ret = -1;
-		}
+		uart_reactor_remove(DSM2_UART_BUS);
 	}
-	
 	running = 0;
-	return ret;
+	is_dsm2_active_flag = 0;
+	return 0;
 }
 
 /*******************************************************************************
@@ -649,18 +731,9 @@ void *calibration_listen_func(void *params){
 int calibrate_dsm2_routine(){
 	int i,ret;
 	
-	dsm2_frame_rate = 0; // zero until mode is detected on first packet
-	running = 1; // lets uarts 4 thread know it can run
-	num_channels = 0;
-	last_time = 0;
-	is_dsm2_active_flag = 0;
-	set_new_dsm2_data_func(&null_func);
-	
-	if(initialize_uart(DSM2_UART_BUS, DSM2_BAUD_RATE, 0.1)){
-		printf("Error, failed to initialize UART%d for DSM2\n", DSM2_UART_BUS);
+	if(start_dsm2_parser()<0){
+		return -1;
 	}
-	
-	pthread_create(&serial_parser_thread, NULL, serial_parser, (void*) NULL);
 		
 	// display instructions
 	printf("\nRaw dsm2 data should display below if the transmitter and\n");
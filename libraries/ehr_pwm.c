@@ -254,6 +254,8 @@ int disable_motors(){
 * 
 * set a motor direction and power
 * motor is from 1 to 4, duty is from -1.0 to +1.0
+* if enable_motor_voltage_compensation() was called, duty is first scaled by
+* the nominal over the filtered battery voltage
 *******************************************************************************/
 int set_motor(int motor, float duty){
 	uint8_t a,b;
@@ -262,6 +264,10 @@ int set_motor(int motor, float duty){
 		initialize_board();
 	}
 
+	// scale for battery voltage, this is 1.0 unless the battery monitor has
+	// motor voltage compensation enabled
+	duty *= get_motor_voltage_compensation();
+
 	//check that the duty cycle is within +-1
 	if (duty>1.0){
 		duty = 1.0;
@@ -0,0 +1,416 @@
+/*******************************************************************************
+* i2c_async.c
+*
+* Asynchronous I2C requests. Each bus gets a worker thread which pulls
+* requests off a lock-free queue, groups requests carrying the same deadline
+* into one i2c_batch_t and submits each group as a single I2C_RDWR ioctl.
+* Callers never touch the bus themselves so a slow device on bus 1 can't stall
+* them, and the IMU thread can post a FIFO drain and get back to work.
+*
+* Request structs belong to the caller, nothing here allocates after
+* i2c_async_start().
+*******************************************************************************/
+
+#include "bb_blue_api.h"
+#include <semaphore.h>
+#include <sched.h>
+
+#define I2C_ASYNC_QUEUE_LEN		64	// must be a power of 2
+#define I2C_ASYNC_POLL_S		0.1	// worker checks the running flag this often
+
+/*******************************************************************************
+* bounded multi-producer queue
+*
+* each cell carries a sequence number telling producers and the consumer
+* whose turn it is, so posting only needs one compare-and-swap on the tail.
+* Only the worker thread dequeues so the head is plain.
+*******************************************************************************/
+typedef struct i2c_queue_cell_t{
+	unsigned int seq;
+	i2c_request_t* req;
+} i2c_queue_cell_t;
+
+typedef struct i2c_async_t{
+	int running;
+	int posting;				// i2c_async_post() calls in progress
+	pthread_t thread;
+	sem_t wake;
+	pthread_mutex_t done_lock;	// only for i2c_async_wait() sleepers
+	pthread_cond_t done_cond;
+	unsigned int tail;			// next slot producers claim
+	unsigned int head;			// next slot the worker reads
+	i2c_queue_cell_t cells[I2C_ASYNC_QUEUE_LEN];
+} i2c_async_t;
+
+i2c_async_t i2c_async[3];
+
+void* i2c_async_worker(void* ptr);
+
+/*******************************************************************************
+* int i2c_async_enqueue(i2c_async_t* q, i2c_request_t* req)
+*
+* returns -1 if the queue is full
+*******************************************************************************/
+static int i2c_async_enqueue(i2c_async_t* q, i2c_request_t* req){
+	i2c_queue_cell_t* cell;
+	unsigned int pos, seq;
+	int diff;
+
+	pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	while(1){
+		cell = &q->cells[pos & (I2C_ASYNC_QUEUE_LEN-1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (int)(seq - pos);
+		if(diff==0){
+			if(__atomic_compare_exchange_n(&q->tail, &pos, pos+1, 1, \
+									__ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				break;
+			}
+		}
+		else if(diff<0) return -1;
+		else pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	}
+	cell->req = req;
+	__atomic_store_n(&cell->seq, pos+1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*******************************************************************************
+* i2c_request_t* i2c_async_dequeue(i2c_async_t* q)
+*
+* worker thread only, returns NULL when empty
+*******************************************************************************/
+static i2c_request_t* i2c_async_dequeue(i2c_async_t* q){
+	i2c_queue_cell_t* cell;
+	i2c_request_t* req;
+	unsigned int pos = q->head;
+
+	cell = &q->cells[pos & (I2C_ASYNC_QUEUE_LEN-1)];
+	if(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos+1) return NULL;
+	req = cell->req;
+	__atomic_store_n(&cell->seq, pos+I2C_ASYNC_QUEUE_LEN, __ATOMIC_RELEASE);
+	q->head = pos+1;
+	return req;
+}
+
+/*******************************************************************************
+* void i2c_async_complete(i2c_request_t* req, int status)
+*
+* the callback runs before status is published so once a caller sees the
+* request finished it is free to reuse it.
+*******************************************************************************/
+static void i2c_async_complete(i2c_request_t* req, int status){
+	if(req->callback != NULL) req->callback(req, status);
+	__atomic_store_n(&req->status, status, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+* int i2c_async_msgs(int bus, i2c_request_t* req)
+*
+* number of i2c messages a request turns into. Reads are split at the bus's
+* block chunk, each piece re-addressing its register unless it's a FIFO.
+*******************************************************************************/
+static int i2c_async_msgs(int bus, i2c_request_t* req){
+	size_t chunk;
+	int pieces;
+	if(req->is_write) return 1;
+	chunk = i2c_get_block_chunk(bus);
+	pieces = (req->length + chunk - 1) / chunk;
+	return req->fifo ? pieces+1 : pieces*2;
+}
+
+/*******************************************************************************
+* int i2c_async_add(i2c_batch_t* batch, i2c_request_t* req)
+*******************************************************************************/
+static int i2c_async_add(i2c_batch_t* batch, i2c_request_t* req){
+	size_t chunk, done, len;
+	int n;
+
+	if(req->is_write){
+		return i2c_batch_add_write(batch, req->devAddr, req->regAddr, \
+											req->length, req->data);
+	}
+	chunk = i2c_get_block_chunk(batch->bus);
+	done = 0;
+	while(done<req->length){
+		len = req->length-done;
+		if(len>chunk) len = chunk;
+		// later pieces of a FIFO read follow without re-addressing
+		if(req->fifo && done>0){
+			n = batch->nmsgs;
+			if(n+1 > I2C_BATCH_MAX_MSGS){
+				printf("ERROR: i2c batch is full\n");
+				return -1;
+			}
+			batch->msgs[n].addr  = req->devAddr;
+			batch->msgs[n].flags = I2C_M_RD;
+			batch->msgs[n].len   = len;
+			batch->msgs[n].buf   = req->data+done;
+			batch->nmsgs++;
+		}
+		else{
+			if(i2c_batch_add_read(batch, req->devAddr, \
+				req->fifo ? req->regAddr : req->regAddr+done, \
+				len, req->data+done)<0){
+				return -1;
+			}
+		}
+		done += len;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* void i2c_async_run_group(int bus, i2c_request_t** reqs, int n)
+*
+* submits n requests as one batch. If the transaction fails we don't know
+* which messages already reached their device, so only requests marked
+* idempotent are retried alone and the rest fail with the batch.
+*******************************************************************************/
+static void i2c_async_run_group(int bus, i2c_request_t** reqs, int n){
+	i2c_batch_t batch;
+	int i, status;
+
+	i2c_batch_init(&batch, bus);
+	for(i=0;i<n;i++) i2c_async_add(&batch, reqs[i]);
+	if(i2c_batch_submit(&batch)==0){
+		for(i=0;i<n;i++) i2c_async_complete(reqs[i], I2C_REQ_DONE);
+		return;
+	}
+	for(i=0;i<n;i++){
+		status = I2C_REQ_FAILED;
+		if(n>1 && reqs[i]->idempotent){
+			i2c_batch_init(&batch, bus);
+			if(i2c_async_add(&batch, reqs[i])==0 && \
+								i2c_batch_submit(&batch)==0){
+				status = I2C_REQ_DONE;
+			}
+		}
+		i2c_async_complete(reqs[i], status);
+	}
+}
+
+/*******************************************************************************
+* void i2c_async_process(int bus, i2c_request_t** reqs, int n)
+*
+* sorts everything drained from the queue by deadline, earliest first, then
+* submits each run of equal deadlines as one batch, splitting runs which
+* don't fit in a single transaction.
+*******************************************************************************/
+static void i2c_async_process(int bus, i2c_request_t** reqs, int n){
+	int i, j, start, msgs, bytes;
+	i2c_request_t* tmp;
+
+	// insertion sort, stable so equal deadlines keep posting order
+	for(i=1;i<n;i++){
+		tmp = reqs[i];
+		for(j=i; j>0 && reqs[j-1]->deadline_us > tmp->deadline_us; j--){
+			reqs[j] = reqs[j-1];
+		}
+		reqs[j] = tmp;
+	}
+
+	start = 0;
+	msgs = 0;
+	bytes = 0;
+	for(i=0;i<n;i++){
+		if(i>start && (reqs[i]->deadline_us != reqs[start]->deadline_us \
+			|| msgs+i2c_async_msgs(bus, reqs[i]) > I2C_BATCH_MAX_MSGS \
+			|| (reqs[i]->is_write && \
+					bytes+reqs[i]->length+1 > I2C_BATCH_WRITE_BYTES))){
+			i2c_async_run_group(bus, &reqs[start], i-start);
+			start = i;
+			msgs = 0;
+			bytes = 0;
+		}
+		msgs += i2c_async_msgs(bus, reqs[i]);
+		if(reqs[i]->is_write) bytes += reqs[i]->length+1;
+	}
+	if(n>start) i2c_async_run_group(bus, &reqs[start], n-start);
+
+	// wake anyone sleeping in i2c_async_wait()
+	pthread_mutex_lock(&i2c_async[bus].done_lock);
+	pthread_cond_broadcast(&i2c_async[bus].done_cond);
+	pthread_mutex_unlock(&i2c_async[bus].done_lock);
+}
+
+/*******************************************************************************
+* int i2c_async_start(int bus)
+*
+* starts the worker thread for a bus which must already be initialized with
+* i2c_init(). Returns 0 if it's running or was already running.
+*******************************************************************************/
+int i2c_async_start(int bus){
+	int i;
+	i2c_async_t* q;
+
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	q = &i2c_async[bus];
+	if(q->running) return 0;
+
+	for(i=0;i<I2C_ASYNC_QUEUE_LEN;i++) q->cells[i].seq = i;
+	q->head = 0;
+	q->tail = 0;
+	q->posting = 0;
+	sem_init(&q->wake, 0, 0);
+	pthread_mutex_init(&q->done_lock, NULL);
+	pthread_cond_init(&q->done_cond, NULL);
+	q->running = 1;
+	if(pthread_create(&q->thread, NULL, i2c_async_worker, (void*)(long)bus)){
+		printf("ERROR: failed to start i2c async worker\n");
+		q->running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int i2c_async_stop(int bus)
+*
+* stops the worker, anything still queued completes with I2C_REQ_FAILED.
+* Posts already past their running check are waited for first so none of
+* them can land in the queue after it has been drained.
+*******************************************************************************/
+int i2c_async_stop(int bus){
+	i2c_async_t* q;
+	i2c_request_t* req;
+
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	q = &i2c_async[bus];
+	if(q->running==0) return 0;
+
+	__atomic_store_n(&q->running, 0, __ATOMIC_SEQ_CST);
+	sem_post(&q->wake);
+	timespec thread_timeout;
+	clock_gettime(CLOCK_REALTIME, &thread_timeout);
+	timespec_add(&thread_timeout, 1.0);
+	if(pthread_timedjoin_np(q->thread, NULL, &thread_timeout) == ETIMEDOUT){
+		printf("WARNING: i2c async worker exit timeout\n");
+		return -1;
+	}
+	while(__atomic_load_n(&q->posting, __ATOMIC_SEQ_CST)) sched_yield();
+	while((req = i2c_async_dequeue(q)) != NULL){
+		i2c_async_complete(req, I2C_REQ_FAILED);
+	}
+	pthread_mutex_lock(&q->done_lock);
+	pthread_cond_broadcast(&q->done_cond);
+	pthread_mutex_unlock(&q->done_lock);
+	sem_destroy(&q->wake);
+	return 0;
+}
+
+/*******************************************************************************
+* int i2c_async_post(int bus, i2c_request_t* req)
+*
+* queues a filled in request. req and its data buffer must stay valid until
+* it completes. Returns -1 if the worker isn't running or the queue is full.
+*******************************************************************************/
+int i2c_async_post(int bus, i2c_request_t* req){
+	i2c_async_t* q;
+	int ret = 0;
+
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	if(req->length==0 || (req->is_write && \
+								req->length+1 > I2C_BATCH_WRITE_BYTES)){
+		printf("ERROR: invalid i2c request length\n");
+		return -1;
+	}
+	if(!req->is_write && !req->fifo && req->regAddr+req->length > 256){
+		printf("ERROR: i2c request runs past register 0xff\n");
+		return -1;
+	}
+	if(i2c_async_msgs(bus, req) > I2C_BATCH_MAX_MSGS){
+		printf("ERROR: i2c request too long for one transaction\n");
+		return -1;
+	}
+	q = &i2c_async[bus];
+	// announce the post before checking running, i2c_async_stop() clears
+	// running then waits for posting to drop so it never misses this one
+	__atomic_add_fetch(&q->posting, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&q->running, __ATOMIC_SEQ_CST)==0){
+		printf("ERROR: i2c async worker not running on bus %d\n", bus);
+		ret = -1;
+	}
+	else{
+		req->status = I2C_REQ_PENDING;
+		if(i2c_async_enqueue(q, req)<0){
+			req->status = I2C_REQ_FAILED;
+			ret = -1;
+		}
+		else sem_post(&q->wake);
+	}
+	__atomic_sub_fetch(&q->posting, 1, __ATOMIC_SEQ_CST);
+	return ret;
+}
+
+/*******************************************************************************
+* int i2c_async_wait(int bus, i2c_request_t* req, float timeout_s)
+*
+* blocks until req completes or the timeout passes. Returns 0 if the request
+* succeeded, -1 if it failed or is still pending.
+*******************************************************************************/
+int i2c_async_wait(int bus, i2c_request_t* req, float timeout_s){
+	timespec deadline;
+	int status;
+
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	timespec_add(&deadline, timeout_s);
+	pthread_mutex_lock(&i2c_async[bus].done_lock);
+	while((status = i2c_async_status(req)) == I2C_REQ_PENDING){
+		if(pthread_cond_timedwait(&i2c_async[bus].done_cond, \
+					&i2c_async[bus].done_lock, &deadline) == ETIMEDOUT){
+			status = i2c_async_status(req);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&i2c_async[bus].done_lock);
+	return (status==I2C_REQ_DONE) ? 0 : -1;
+}
+
+/*******************************************************************************
+* int i2c_async_status(i2c_request_t* req)
+*
+* non-blocking check, returns I2C_REQ_PENDING, I2C_REQ_DONE or I2C_REQ_FAILED
+*******************************************************************************/
+int i2c_async_status(i2c_request_t* req){
+	return __atomic_load_n(&req->status, __ATOMIC_ACQUIRE);
+}
+
+/*******************************************************************************
+* void* i2c_async_worker(void* ptr)
+*
+* sleeps on the semaphore, then drains whatever has been posted and hands it
+* to i2c_async_process(). Wakes periodically to check the running flag.
+*******************************************************************************/
+void* i2c_async_worker(void* ptr){
+	int bus = (int)(long)ptr;
+	i2c_async_t* q = &i2c_async[bus];
+	i2c_request_t* reqs[I2C_ASYNC_QUEUE_LEN];
+	timespec timeout;
+	int n;
+
+	while(q->running){
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timespec_add(&timeout, I2C_ASYNC_POLL_S);
+		sem_timedwait(&q->wake, &timeout);
+		n = 0;
+		while(n<I2C_ASYNC_QUEUE_LEN && (reqs[n]=i2c_async_dequeue(q))!=NULL){
+			n++;
+		}
+		if(n>0) i2c_async_process(bus, reqs, n);
+	}
+	return NULL;
+}
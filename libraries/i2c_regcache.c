@@ -0,0 +1,220 @@
+/*******************************************************************************
+* i2c_regcache.c
+*
+* Optional shadow copy of one I2C device's registers. Reads of cacheable
+* registers are served from memory once known, writes which wouldn't change
+* the value are skipped, and staged writes go out together in one batch.
+* Registers holding measurements or status flags must be marked volatile so
+* they always go to the device.
+*******************************************************************************/
+
+#include "bb_blue_api.h"
+
+#define REG_VALID		0x01	// value[] matches the device
+#define REG_DIRTY		0x02	// value[] staged but not yet written
+#define REG_VOLATILE	0x04	// never served from or skipped by the cache
+
+/*******************************************************************************
+* i2c_regcache_t create_i2c_regcache(int bus, uint8_t devAddr)
+*
+* starts with every register cacheable and unknown
+*******************************************************************************/
+i2c_regcache_t create_i2c_regcache(int bus, uint8_t devAddr){
+	i2c_regcache_t cache;
+	memset(&cache, 0, sizeof(cache));
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return cache;
+	}
+	cache.bus = bus;
+	cache.devAddr = devAddr;
+	cache.initialized = 1;
+	return cache;
+}
+
+/*******************************************************************************
+* int i2c_regcache_set_volatile(i2c_regcache_t* cache, uint8_t first,
+*															uint8_t last)
+*
+* marks registers first through last inclusive as volatile
+*******************************************************************************/
+int i2c_regcache_set_volatile(i2c_regcache_t* cache, uint8_t first, \
+															uint8_t last){
+	int i;
+	if(cache->initialized!=1){
+		printf("ERROR: i2c register cache not initialized\n");
+		return -1;
+	}
+	for(i=first;i<=last;i++){
+		cache->flags[i] = REG_VOLATILE;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int i2c_regcache_invalidate(i2c_regcache_t* cache)
+*
+* forget every cached value, for example after resetting the device. Staged
+* writes which haven't been flushed are dropped too.
+*******************************************************************************/
+int i2c_regcache_invalidate(i2c_regcache_t* cache){
+	int i;
+	if(cache->initialized!=1){
+		printf("ERROR: i2c register cache not initialized\n");
+		return -1;
+	}
+	for(i=0;i<I2C_REGCACHE_SIZE;i++){
+		cache->flags[i] &= REG_VOLATILE;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int i2c_regcache_read(i2c_regcache_t* cache, uint8_t regAddr, uint8_t* data)
+*
+* returns a staged or known value without touching the bus when it can
+*******************************************************************************/
+int i2c_regcache_read(i2c_regcache_t* cache, uint8_t regAddr, uint8_t* data){
+	uint8_t f;
+	if(cache->initialized!=1){
+		printf("ERROR: i2c register cache not initialized\n");
+		return -1;
+	}
+	f = cache->flags[regAddr];
+	if(!(f & REG_VOLATILE) && (f & (REG_VALID|REG_DIRTY))){
+		*data = cache->value[regAddr];
+		cache->hits++;
+		return 0;
+	}
+	if(i2c_read_bytes_from(cache->bus, cache->devAddr, regAddr, 1, data)<0){
+		return -1;
+	}
+	if(!(f & REG_VOLATILE)){
+		cache->value[regAddr] = *data;
+		cache->flags[regAddr] |= REG_VALID;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int i2c_regcache_write(i2c_regcache_t* cache, uint8_t regAddr, uint8_t data)
+*
+* writes through to the device unless the register is already known to hold
+* data. Any staged value for the same register is superseded.
+*******************************************************************************/
+int i2c_regcache_write(i2c_regcache_t* cache, uint8_t regAddr, uint8_t data){
+	uint8_t f;
+	if(cache->initialized!=1){
+		printf("ERROR: i2c register cache not initialized\n");
+		return -1;
+	}
+	f = cache->flags[regAddr];
+	if(f==REG_VALID && cache->value[regAddr]==data){
+		cache->skipped++;
+		return 0;
+	}
+	if(i2c_write_bytes_to(cache->bus, cache->devAddr, regAddr, 1, &data)<0){
+		// device state unknown now
+		cache->flags[regAddr] &= REG_VOLATILE;
+		return -1;
+	}
+	if(!(f & REG_VOLATILE)){
+		cache->value[regAddr] = data;
+		cache->flags[regAddr] = REG_VALID;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int i2c_regcache_stage(i2c_regcache_t* cache, uint8_t regAddr, uint8_t data)
+*
+* records a write to be sent by the next i2c_regcache_flush(). Staging the
+* value the device already holds is a no-op.
+*******************************************************************************/
+int i2c_regcache_stage(i2c_regcache_t* cache, uint8_t regAddr, uint8_t data){
+	uint8_t f;
+	if(cache->initialized!=1){
+		printf("ERROR: i2c register cache not initialized\n");
+		return -1;
+	}
+	f = cache->flags[regAddr];
+	if(f & REG_VOLATILE){
+		printf("ERROR: can't stage a write to volatile register 0x%x\n",regAddr);
+		return -1;
+	}
+	if(f==REG_VALID && cache->value[regAddr]==data){
+		cache->skipped++;
+		return 0;
+	}
+	cache->value[regAddr] = data;
+	cache->flags[regAddr] = REG_DIRTY;
+	return 0;
+}
+
+/*******************************************************************************
+* int i2c_regcache_write_bit(i2c_regcache_t* cache, uint8_t regAddr,
+*											uint8_t bitNum, uint8_t data)
+*
+* read-modify-write where the read usually comes from the cache, and the
+* write is skipped if the bit already had the requested state.
+*******************************************************************************/
+int i2c_regcache_write_bit(i2c_regcache_t* cache, uint8_t regAddr, \
+											uint8_t bitNum, uint8_t data){
+	uint8_t b;
+	int ret;
+	if(cache->initialized!=1){
+		printf("ERROR: i2c register cache not initialized\n");
+		return -1;
+	}
+	// hold the bus so a volatile register can't change in between
+	i2c_claim_bus(cache->bus);
+	if(i2c_regcache_read(cache, regAddr, &b)<0){
+		i2c_release_bus(cache->bus);
+		return -1;
+	}
+	b = (data != 0) ? (b | (1 << bitNum)) : (b & ~(1 << bitNum));
+	ret = i2c_regcache_write(cache, regAddr, b);
+	i2c_release_bus(cache->bus);
+	return ret;
+}
+
+/*******************************************************************************
+* int i2c_regcache_flush(i2c_regcache_t* cache)
+*
+* sends every staged write in as few I2C_RDWR transactions as fit, lowest
+* register first. On failure the unsent registers stay staged and the ones
+* in the failed batch are marked unknown.
+*******************************************************************************/
+int i2c_regcache_flush(i2c_regcache_t* cache){
+	i2c_batch_t batch;
+	int i, first;
+
+	if(cache->initialized!=1){
+		printf("ERROR: i2c register cache not initialized\n");
+		return -1;
+	}
+	i2c_batch_init(&batch, cache->bus);
+	first = -1;
+	for(i=0;i<=I2C_REGCACHE_SIZE;i++){
+		// submit when full or out of registers
+		if(batch.nmsgs==I2C_BATCH_MAX_MSGS || \
+						(i==I2C_REGCACHE_SIZE && batch.nmsgs>0)){
+			if(i2c_batch_submit(&batch)<0){
+				for(;first<i;first++){
+					if(cache->flags[first]&REG_DIRTY) cache->flags[first]=0;
+				}
+				return -1;
+			}
+			for(;first<i;first++){
+				if(cache->flags[first]&REG_DIRTY) cache->flags[first]=REG_VALID;
+			}
+			i2c_batch_init(&batch, cache->bus);
+			first = -1;
+		}
+		if(i==I2C_REGCACHE_SIZE) break;
+		if(!(cache->flags[i] & REG_DIRTY)) continue;
+		if(first<0) first = i;
+		i2c_batch_add_write(&batch, cache->devAddr, i, 1, &cache->value[i]);
+	}
+	return 0;
+}
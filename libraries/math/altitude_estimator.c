@@ -0,0 +1,105 @@
+/*******************************************************************************
+* altitude_estimator.c
+*
+* Complementary altitude and climb rate estimator fusing barometer altitude
+* with gravity-compensated vertical acceleration from the IMU. The barometer
+* is trusted at low frequency and the double-integrated accelerometer at high
+* frequency, the same split data_fusion() uses for compass and DMP yaw. It is
+* written as a third order complementary filter which also tracks the
+* accelerometer's vertical bias so the integrated velocity doesn't drift.
+*
+* All state lives in the user's altitude_estimator_t so any number of
+* estimators can run in different threads, and marching one never allocates.
+*******************************************************************************/
+
+#include "../bb_blue_api.h"
+
+#define GRAVITY 9.80665
+
+/*******************************************************************************
+* altitude_estimator_t create_altitude_estimator(float dt, float time_constant)
+*
+* dt is the IMU sample period in seconds. time_constant is the crossover
+* between barometer and accelerometer in seconds, larger values trust the
+* accelerometer for longer. Gains place all three poles at -1/time_constant.
+*******************************************************************************/
+altitude_estimator_t create_altitude_estimator(float dt, float time_constant){
+	altitude_estimator_t est;
+	memset(&est, 0, sizeof(est));
+
+	if(dt<=0 || time_constant<=dt){
+		printf("ERROR: altitude estimator needs 0 < dt < time_constant\n");
+		return est;
+	}
+	est.dt = dt;
+	est.k1 = 3.0/time_constant;
+	est.k2 = 3.0/(time_constant*time_constant);
+	est.k3 = 1.0/(time_constant*time_constant*time_constant);
+	est.initialized = 1;
+	return est;
+}
+
+/*******************************************************************************
+* int reset_altitude_estimator(altitude_estimator_t* est, float alt)
+*
+* starts the estimate at alt with zero climb rate and zero bias. Use the
+* first barometer altitude to avoid a long initial transient.
+*******************************************************************************/
+int reset_altitude_estimator(altitude_estimator_t* est, float alt){
+	if(est->initialized != 1){
+		printf("ERROR: altitude estimator not initialized yet\n");
+		return -1;
+	}
+	est->alt = alt;
+	est->climb_rate = 0;
+	est->accel_bias = 0;
+	est->step = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* float march_altitude_estimator(altitude_estimator_t* est, float accel_z,
+*														float baro_alt)
+*
+* Call at the IMU rate. accel_z is the gravity-compensated vertical
+* acceleration in m/s^2, positive up. baro_alt is the latest barometer
+* altitude, it is fine to keep passing the same value between barometer
+* samples. Returns the new altitude estimate, the climb rate is then in
+* est->climb_rate.
+*******************************************************************************/
+float march_altitude_estimator(altitude_estimator_t* est, float accel_z, \
+															float baro_alt){
+	float err, dt;
+
+	if(est->initialized != 1){
+		printf("ERROR: altitude estimator not initialized yet\n");
+		return -1;
+	}
+	dt = est->dt;
+	err = baro_alt - est->alt;
+
+	// a positive bias makes the estimate climb above the barometer
+	est->accel_bias -= est->k3 * err * dt;
+	est->climb_rate += (accel_z - est->accel_bias + est->k2*err) * dt;
+	est->alt += (est->climb_rate + est->k1*err) * dt;
+	est->step++;
+	return est->alt;
+}
+
+/*******************************************************************************
+* float gravity_compensated_accel_z(float accel[3], float q[4])
+*
+* Rotates body frame acceleration in m/s^2 into the world frame with the
+* orientation quaternion q (for example imu_data_t's dmp_quat) and removes
+* gravity, leaving vertical acceleration positive up.
+*******************************************************************************/
+float gravity_compensated_accel_z(float accel[3], float q[4]){
+	float w = q[QUAT_W];
+	float x = q[QUAT_X];
+	float y = q[QUAT_Y];
+	float z = q[QUAT_Z];
+	return 2.0*(x*z - w*y)*accel[0]
+		 + 2.0*(y*z + w*x)*accel[1]
+		 + (1.0 - 2.0*(x*x + y*y))*accel[2]
+		 - GRAVITY;
+}
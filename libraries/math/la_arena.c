@@ -0,0 +1,186 @@
+/*******************************************************************************
+* la_arena.c
+*
+* Scratch arena for linear algebra temporaries. One block of memory is handed
+* out front to back with a bump pointer, every piece aligned to MATRIX_ALIGN so
+* matrices drawn from it keep their NEON friendly layout. Nothing is freed
+* piece by piece. Instead la_arena_release() rewinds to an earlier mark and
+* la_arena_reset() rewinds to the start, both O(1). Once the arena is big
+* enough no further heap allocation takes place, which is what real time
+* threads need.
+*******************************************************************************/
+
+#include "../bb_blue_api.h"
+
+// round a byte count up to the arena alignment
+#define ARENA_ROUND(n)	(((n)+MATRIX_ALIGN-1) & ~((size_t)MATRIX_ALIGN-1))
+
+/*******************************************************************************
+* la_arena_t create_la_arena(size_t bytes)
+*
+* Allocates an arena with room for bytes of temporaries. This is the only
+* allocation the arena ever makes.
+*******************************************************************************/
+la_arena_t create_la_arena(size_t bytes){
+	la_arena_t a;
+	void* ptr;
+	memset(&a, 0, sizeof(la_arena_t));
+	bytes = ARENA_ROUND(bytes);
+	if(bytes==0){
+		printf("ERROR: arena size must be > 0\n");
+		return a;
+	}
+	if(posix_memalign(&ptr, MATRIX_ALIGN, bytes)){
+		printf("ERROR: failed to allocate %zu byte arena\n", bytes);
+		return a;
+	}
+	a.mem = (char*)ptr;
+	a.size = bytes;
+	a.owner = 1;
+	a.initialized = 1;
+	return a;
+}
+
+/*******************************************************************************
+* la_arena_t wrap_la_arena(void* mem, size_t bytes)
+*
+* Uses caller-owned memory, a static or stack buffer for example, as an arena.
+* mem must be MATRIX_ALIGN aligned. The arena never frees it.
+*******************************************************************************/
+la_arena_t wrap_la_arena(void* mem, size_t bytes){
+	la_arena_t a;
+	memset(&a, 0, sizeof(la_arena_t));
+	if(mem==NULL || ((uintptr_t)mem % MATRIX_ALIGN)){
+		printf("ERROR: arena memory must be %d byte aligned\n", MATRIX_ALIGN);
+		return a;
+	}
+	a.mem = (char*)mem;
+	a.size = bytes & ~((size_t)MATRIX_ALIGN-1);
+	a.initialized = 1;
+	return a;
+}
+
+/*******************************************************************************
+* void destroy_la_arena(la_arena_t* a)
+*
+* Frees the arena memory if it was allocated by create_la_arena. Anything
+* drawn from the arena is invalid afterwards.
+*******************************************************************************/
+void destroy_la_arena(la_arena_t* a){
+	if(a->initialized==1 && a->owner){
+		free(a->mem);
+	}
+	memset(a, 0, sizeof(la_arena_t));
+	return;
+}
+
+/*******************************************************************************
+* void* la_arena_alloc(la_arena_t* a, size_t bytes)
+*
+* Returns MATRIX_ALIGN aligned space for bytes from the arena, or NULL if the
+* arena is not initialized or too small. Contents are not cleared.
+*******************************************************************************/
+void* la_arena_alloc(la_arena_t* a, size_t bytes){
+	void* ptr;
+	if(!a->initialized){
+		printf("ERROR: arena not initialized yet\n");
+		return NULL;
+	}
+	bytes = ARENA_ROUND(bytes);
+	if(bytes > a->size - a->used){
+		printf("ERROR: arena out of space, %zu of %zu bytes used, %zu needed\n",\
+												a->used, a->size, bytes);
+		return NULL;
+	}
+	ptr = a->mem + a->used;
+	a->used += bytes;
+	if(a->used > a->peak) a->peak = a->used;
+	return ptr;
+}
+
+/*******************************************************************************
+* size_t la_arena_mark(la_arena_t* a)
+*
+* Returns the current fill level to hand to la_arena_release() later.
+*******************************************************************************/
+size_t la_arena_mark(la_arena_t* a){
+	return a->used;
+}
+
+/*******************************************************************************
+* void la_arena_release(la_arena_t* a, size_t mark)
+*
+* Gives back everything drawn from the arena since mark was taken.
+*******************************************************************************/
+void la_arena_release(la_arena_t* a, size_t mark){
+	if(mark < a->used) a->used = mark;
+	return;
+}
+
+/*******************************************************************************
+* void la_arena_reset(la_arena_t* a)
+*
+* Gives back everything drawn from the arena. The peak usage is kept so the
+* arena can be sized from a trial run.
+*******************************************************************************/
+void la_arena_reset(la_arena_t* a){
+	a->used = 0;
+	return;
+}
+
+/*******************************************************************************
+* size_t la_matrix_bytes(int rows, int cols)
+*
+* Arena space taken by one rows x cols matrix.
+*******************************************************************************/
+size_t la_matrix_bytes(int rows, int cols){
+	return ARENA_ROUND((size_t)rows*MATRIX_STRIDE(cols)*sizeof(float));
+}
+
+/*******************************************************************************
+* size_t la_vector_bytes(int len)
+*
+* Arena space taken by one vector of length len.
+*******************************************************************************/
+size_t la_vector_bytes(int len){
+	return ARENA_ROUND((size_t)len*sizeof(float));
+}
+
+/*******************************************************************************
+* matrix_t la_arena_matrix(la_arena_t* a, int rows, int cols)
+*
+* Draws a zeroed matrix from the arena. Like wrap_matrix() it has no row
+* pointers and destroy_matrix() leaves its memory alone. Returns an
+* uninitialized matrix if the arena is full.
+*******************************************************************************/
+matrix_t la_arena_matrix(la_arena_t* a, int rows, int cols){
+	float* mem;
+	matrix_t A = create_empty_matrix();
+	if(rows<1 || cols<1){
+		printf("ERROR: row or col must be >=1\n");
+		return A;
+	}
+	mem = (float*)la_arena_alloc(a, la_matrix_bytes(rows, cols));
+	if(mem==NULL) return A;
+	memset(mem, 0, la_matrix_bytes(rows, cols));
+	return wrap_matrix(rows, cols, 0, mem);
+}
+
+/*******************************************************************************
+* vector_t la_arena_vector(la_arena_t* a, int len)
+*
+* Draws a zeroed vector from the arena. Returns an uninitialized vector if the
+* arena is full.
+*******************************************************************************/
+vector_t la_arena_vector(la_arena_t* a, int len){
+	float* mem;
+	vector_t v = create_empty_vector();
+	if(len<1){
+		printf("ERROR: len must be >=1\n");
+		return v;
+	}
+	mem = (float*)la_arena_alloc(a, la_vector_bytes(len));
+	if(mem==NULL) return v;
+	memset(mem, 0, la_vector_bytes(len));
+	return wrap_vector(len, mem);
+}
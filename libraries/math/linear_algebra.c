@@ -5,32 +5,74 @@
 *******************************************************************************/
 
 #include "../bb_blue_api.h"
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 #define PI (float)M_PI
 
 /*******************************************************************************
 * matrix_t create_matrix(int rows, int cols)
 *
-* 
+* Allocates a zeroed matrix in one aligned block. The elements come first with
+* each row padded out to stride floats, followed by the table of row pointers
+* that backs the MATRIX_ELEM(A,i,j) form.
 *******************************************************************************/
 matrix_t create_matrix(int rows, int cols){
 	int i;
-	matrix_t A;
+	size_t bytes;
+	void* ptr;
+	matrix_t A = create_empty_matrix();
 	if(rows<1 || cols<1){
 		printf("error creating matrix, row or col must be >=1");
 		return A;
 	}
+	A.stride = MATRIX_STRIDE(cols);
+	bytes = rows*A.stride*sizeof(float);
+	if(posix_memalign(&ptr, MATRIX_ALIGN, bytes + rows*sizeof(float*))){
+		printf("ERROR: failed to allocate matrix\n");
+		return A;
+	}
+	memset(ptr, 0, bytes);
 	A.rows = rows;
 	A.cols = cols;
-	// allocate contiguous memory
-	A.data = (float**)malloc(rows*sizeof(float*));
-	void* ptr = calloc(rows*cols, sizeof(float));
-	A.data[0] = (float*)ptr;
+	A.mem = (float*)ptr;
 	// manually fill in the pointer to each row
-	for (i=1; i<rows; i++){
-		A.data[i] = (float*)(ptr + i*cols*sizeof(float));
-	}	
-	
+	A.data = (float**)(ptr + bytes);
+	for(i=0; i<rows; i++){
+		A.data[i] = MATRIX_ROW(A,i);
+	}
+	A.owner = 1;
+	A.initialized = 1;
+	return A;
+}
+
+/*******************************************************************************
+* matrix_t wrap_matrix(int rows, int cols, int stride, float* mem)
+*
+* Places a matrix over memory owned by the caller, nothing is allocated. mem
+* must be MATRIX_ALIGN aligned and hold rows*stride floats. A stride of 0 picks
+* MATRIX_STRIDE(cols). Contents of mem are left untouched.
+*******************************************************************************/
+matrix_t wrap_matrix(int rows, int cols, int stride, float* mem){
+	matrix_t A = create_empty_matrix();
+	if(rows<1 || cols<1){
+		printf("ERROR: row or col must be >=1\n");
+		return A;
+	}
+	if(stride==0) stride = MATRIX_STRIDE(cols);
+	if(stride<cols || stride%4){
+		printf("ERROR: stride must be a multiple of 4 and >= cols\n");
+		return A;
+	}
+	if(mem==NULL || ((uintptr_t)mem % MATRIX_ALIGN)){
+		printf("ERROR: matrix memory must be %d byte aligned\n", MATRIX_ALIGN);
+		return A;
+	}
+	A.rows = rows;
+	A.cols = cols;
+	A.stride = stride;
+	A.mem = mem;
 	A.initialized = 1;
 	return A;
 }
@@ -41,14 +83,10 @@ matrix_t create_matrix(int rows, int cols){
 * 
 *******************************************************************************/
 void destroy_matrix(matrix_t* A){
-	if(A->initialized==1 && A->rows>0 && A->cols>0){
-		free(A->data[0]);
-		free(A->data);
-	}
-	A->data = 0;
-	A->rows = 0;
-	A->cols = 0;
-	A->initialized = 0;
+	if(A->initialized==1 && A->owner){
+		free(A->mem);
+	}
+	memset(A, 0, sizeof(matrix_t));
 	return;
 }
 
@@ -69,17 +107,15 @@ matrix_t create_empty_matrix(){
 * copy information of one matrix to a new memory location 
 *******************************************************************************/
 matrix_t duplicate_matrix(matrix_t A){
-	int i,j;
-	matrix_t out;
+	int i;
+	matrix_t out = create_empty_matrix();
 	if(!A.initialized){
 		printf("ERROR: matrix not initialized yet\n");
 		return out;
 	}
 	out = create_matrix(A.rows,A.cols);
 	for(i=0;i<A.rows;i++){
-        for(j=0;j<A.cols;j++){
-			out.data[i][j] = A.data[i][j];
-		}
+		memcpy(MATRIX_ROW(out,i), MATRIX_ROW(A,i), A.cols*sizeof(float));
 	}
 	return out;
 }
@@ -102,7 +138,7 @@ matrix_t create_square_matrix(int n){
 *******************************************************************************/
 matrix_t create_random_matrix(int rows, int cols){
 	int i,j;
-	matrix_t A;
+	matrix_t A = create_empty_matrix();
 	if(rows<1 || cols<1){
 		printf("error creating matrix, row or col must be >=1");
 		return A;
@@ -110,7 +146,7 @@ matrix_t create_random_matrix(int rows, int cols){
 	A = create_matrix(rows, cols);
 	for(i=0;i<rows;i++){
 		for(j=0;j<cols;j++){
-			A.data[i][j]=get_random_float();
+			MATRIX_ELEM(A,i,j)=get_random_float();
 		}
 	}
 	return A;
@@ -123,14 +159,14 @@ matrix_t create_random_matrix(int rows, int cols){
 *******************************************************************************/
 matrix_t create_identity_matrix(int dim){
 	int i;
-	matrix_t A;
+	matrix_t A = create_empty_matrix();
 	if(dim<1){
 		printf("error creating matrix, dim must be >=1");
 		return A;
 	}
 	A = create_square_matrix(dim);
 	for(i=0;i<dim;i++){
-		A.data[i][i]=1;
+		MATRIX_ELEM(A,i,i)=1;
 	}
 	return A;
 }
@@ -142,14 +178,14 @@ matrix_t create_identity_matrix(int dim){
 *******************************************************************************/
 matrix_t create_diagonal_matrix(vector_t v){
 	int i;
-	matrix_t A;
+	matrix_t A = create_empty_matrix();
 	if(!v.initialized){
 		printf("error creating matrix, vector_t v not initialized");
 		return A;
 	}
 	A = create_square_matrix(v.len);
 	for(i=0;i<v.len;i++){
-		A.data[i][i]=v.data[i];
+		MATRIX_ELEM(A,i,i)=v.data[i];
 	}
 	return A;
 }
@@ -161,7 +197,7 @@ matrix_t create_diagonal_matrix(vector_t v){
 *******************************************************************************/
 matrix_t create_matrix_of_ones(int dim){
 	int i,j;
-	matrix_t A;
+	matrix_t A = create_empty_matrix();
 	if(dim<1){
 		printf("error creating matrix, dim must be >=1");
 		return A;
@@ -169,7 +205,7 @@ matrix_t create_matrix_of_ones(int dim){
 	A = create_square_matrix(dim);
 	for(i=0;i<dim;i++){
 		for(j=0;j<dim;j++){
-			A.data[i][j]=1;
+			MATRIX_ELEM(A,i,j)=1;
 		}
 	}
 	return A;
@@ -197,7 +233,7 @@ int set_matrix_entry(matrix_t* A, int row, int col, float val){
 		printf("ERROR: col out of bounds\n");
 		return -1;
 	}
-	A->data[row][col] = val;
+	MATRIX_ELEM(*A,row,col) = val;
 	return 0;
 }
 
@@ -219,7 +255,7 @@ float get_matrix_entry(matrix_t A, int row, int col){
 		printf("ERROR: col out of bounds\n");
 		return -1;
 	}
-	return  A.data[row][col];
+	return  MATRIX_ELEM(A,row,col);
 }
 
 /*******************************************************************************
@@ -239,7 +275,7 @@ void print_matrix(matrix_t A){
 	}
 	for(i=0;i<A.rows;i++){
 		for(j=0;j<A.cols;j++){
-			printf("%7.3f  ",A.data[i][j]);
+			printf("%7.3f  ",MATRIX_ELEM(A,i,j));
 		}	
 		printf("\n");
 		fflush(stdout);
@@ -260,7 +296,7 @@ void print_matrix_sci_notation(matrix_t A){
 	}
 	for(i=0;i<A.rows;i++){
 		for(j=0;j<A.cols;j++){
-			printf("%11.4e  ",A.data[i][j]);
+			printf("%11.4e  ",MATRIX_ELEM(A,i,j));
 		}	
 		printf("\n");
 	}
@@ -274,13 +310,32 @@ void print_matrix_sci_notation(matrix_t A){
 * 
 *******************************************************************************/
 vector_t create_vector(int n){
-	vector_t v;
+	vector_t v = create_empty_vector();
 	if(n<1){
 		printf("error creating vector, n must be >=1");
 		return v;
 	}
 	v.len = n;
 	v.data = (float*)calloc(n, sizeof(float));
+	v.owner = 1;
+	v.initialized = 1;
+	return v;
+}
+
+/*******************************************************************************
+* vector_t wrap_vector(int len, float* mem)
+*
+* Places a vector over len floats of caller-owned memory without allocating.
+* destroy_vector() will not free it.
+*******************************************************************************/
+vector_t wrap_vector(int len, float* mem){
+	vector_t v = create_empty_vector();
+	if(len<1 || mem==NULL){
+		printf("ERROR: len must be >=1 and mem not NULL\n");
+		return v;
+	}
+	v.len = len;
+	v.data = mem;
 	v.initialized = 1;
 	return v;
 }
@@ -291,11 +346,10 @@ vector_t create_vector(int n){
 * 
 *******************************************************************************/
 void destroy_vector(vector_t* v){
-	if(v->initialized==1){
+	if(v->initialized==1 && v->owner){
 		free(v->data);
 	}
-	v->len = 0;
-	v->initialized = 0;
+	memset(v, 0, sizeof(vector_t));
 	return;
 }
 
@@ -463,13 +517,393 @@ void print_vector_sci_notation(vector_t v){
 }	
 
 /*******************************************************************************
-* int multiply_matrices(matrix_t A, matrix_t B, matrix_t* out)
+* Allocation-free operations
+*
+* Every operation below that returns a new matrix_t or vector_t has a *_into
+* version taking the destination first. The destination must already be
+* initialized with the dimensions of the result, from create_matrix(),
+* wrap_matrix() or an arena for example, and nothing is allocated. They
+* return 0 on success or -1 on bad input. Where the math allows it the
+* destination may be one of the inputs, this is noted for each function.
+* The allocating versions are thin wrappers around these.
+*******************************************************************************/
+
+/*******************************************************************************
+* Matrix multiply kernel
+*
+* multiply_to() computes C=A*B in the usual blocked fashion. B is copied a
+* GEMM_KC x GEMM_NC block at a time into a packed buffer of GEMM_NR wide
+* column strips, and A a GEMM_MC x GEMM_KC block at a time into GEMM_MR tall
+* row strips, so the micro-kernel streams both from contiguous memory that
+* stays in L1. The micro-kernel keeps a GEMM_MR x GEMM_NR tile of C in
+* registers across the whole depth of the block. With the defaults below the
+* two packed buffers take 24KB of stack, inside the Cortex-A8's 32KB L1.
+*
+* The micro-kernel uses NEON when built with -mfpu=neon (__ARM_NEON defined)
+* and plain C otherwise. Products too small to repay the packing go through
+* a plain dot product loop instead, the blocked path lives in its own function
+* so that loop doesn't pay for setting up the packing buffers.
+*******************************************************************************/
+#define GEMM_MR		4
+#define GEMM_NR		8
+#define GEMM_MC		32
+#define GEMM_KC		64
+#define GEMM_NC		64
+#define GEMM_SMALL	(8*8*8)	// m*n*k below which packing isn't worth it
+
+/*******************************************************************************
+* static void pack_a(int mc, int kc, const float* a, int lda, float* pa)
+*
+* copies an mc x kc block of A into GEMM_MR row strips, column by column,
+* padding the last strip with zeros
+*******************************************************************************/
+static void pack_a(int mc, int kc, const float* a, int lda, float* pa){
+	int i, p, r;
+	for(i=0;i<mc;i+=GEMM_MR){
+		for(p=0;p<kc;p++){
+			for(r=0;r<GEMM_MR;r++){
+				*pa++ = (i+r<mc) ? a[(i+r)*lda+p] : 0;
+			}
+		}
+	}
+	return;
+}
+
+/*******************************************************************************
+* static void pack_b(int kc, int nc, const float* b, int ldb, float* pb)
+*
+* copies a kc x nc block of B into GEMM_NR column strips, row by row, padding
+* the last strip with zeros
+*******************************************************************************/
+static void pack_b(int kc, int nc, const float* b, int ldb, float* pb){
+	int j, p, c;
+	const float* row;
+	for(j=0;j<nc;j+=GEMM_NR){
+		for(p=0;p<kc;p++){
+			row = b + p*ldb + j;
+			if(j+GEMM_NR <= nc){
+				memcpy(pb, row, GEMM_NR*sizeof(float));
+			}
+			else{
+				for(c=0;c<GEMM_NR;c++) pb[c] = (j+c<nc) ? row[c] : 0;
+			}
+			pb += GEMM_NR;
+		}
+	}
+	return;
+}
+
+/*******************************************************************************
+* static void store_tile(const float* t, float* c, int ldc, int mr, int nr,
+*															int first)
+*
+* writes the top left mr x nr of a GEMM_MR x GEMM_NR tile into C, replacing
+* what is there for the first depth block and adding to it after that
+*******************************************************************************/
+static void store_tile(const float* t, float* c, int ldc, int mr, int nr, \
+																int first){
+	int i, j;
+	for(i=0;i<mr;i++){
+		for(j=0;j<nr;j++){
+			if(first) c[i*ldc+j] = t[i*GEMM_NR+j];
+			else c[i*ldc+j] += t[i*GEMM_NR+j];
+		}
+	}
+	return;
+}
+
+#ifdef __ARM_NEON
+/*******************************************************************************
+* static void gemm_kernel(int kc, const float* pa, const float* pb, float* c,
+*										int ldc, int mr, int nr, int first)
+*
+* C tile += packed A strip times packed B strip, NEON version. The 4x8 tile
+* lives in 8 quad registers, each step of the depth loads 4 values of A and 8
+* of B and does 8 vector multiply-accumulates.
+*******************************************************************************/
+static void gemm_kernel(int kc, const float* pa, const float* pb, float* c, \
+									int ldc, int mr, int nr, int first){
+	int p, i;
+	float t[GEMM_MR*GEMM_NR] __attribute__((aligned(16)));
+	float32x4_t a, b0, b1;
+	float32x4_t c00 = vdupq_n_f32(0), c01 = vdupq_n_f32(0);
+	float32x4_t c10 = vdupq_n_f32(0), c11 = vdupq_n_f32(0);
+	float32x4_t c20 = vdupq_n_f32(0), c21 = vdupq_n_f32(0);
+	float32x4_t c30 = vdupq_n_f32(0), c31 = vdupq_n_f32(0);
+
+	for(p=0;p<kc;p++){
+		a  = vld1q_f32(pa);
+		b0 = vld1q_f32(pb);
+		b1 = vld1q_f32(pb+4);
+		c00 = vmlaq_lane_f32(c00, b0, vget_low_f32(a), 0);
+		c01 = vmlaq_lane_f32(c01, b1, vget_low_f32(a), 0);
+		c10 = vmlaq_lane_f32(c10, b0, vget_low_f32(a), 1);
+		c11 = vmlaq_lane_f32(c11, b1, vget_low_f32(a), 1);
+		c20 = vmlaq_lane_f32(c20, b0, vget_high_f32(a), 0);
+		c21 = vmlaq_lane_f32(c21, b1, vget_high_f32(a), 0);
+		c30 = vmlaq_lane_f32(c30, b0, vget_high_f32(a), 1);
+		c31 = vmlaq_lane_f32(c31, b1, vget_high_f32(a), 1);
+		pa += GEMM_MR;
+		pb += GEMM_NR;
+	}
+	// full tiles go straight to C, rows are 16 byte aligned and so is c
+	if(mr==GEMM_MR && nr==GEMM_NR){
+		float32x4_t acc[8] = {c00, c01, c10, c11, c20, c21, c30, c31};
+		for(i=0;i<GEMM_MR;i++){
+			if(!first){
+				acc[2*i]   = vaddq_f32(acc[2*i],   vld1q_f32(c+i*ldc));
+				acc[2*i+1] = vaddq_f32(acc[2*i+1], vld1q_f32(c+i*ldc+4));
+			}
+			vst1q_f32(c+i*ldc,   acc[2*i]);
+			vst1q_f32(c+i*ldc+4, acc[2*i+1]);
+		}
+		return;
+	}
+	vst1q_f32(t,    c00);
+	vst1q_f32(t+4,  c01);
+	vst1q_f32(t+8,  c10);
+	vst1q_f32(t+12, c11);
+	vst1q_f32(t+16, c20);
+	vst1q_f32(t+20, c21);
+	vst1q_f32(t+24, c30);
+	vst1q_f32(t+28, c31);
+	store_tile(t, c, ldc, mr, nr, first);
+	return;
+}
+
+/*******************************************************************************
+* static float dot_row(const float* a, const float* x, int n)
+*
+* dot product of n floats, 4 at a time
+*******************************************************************************/
+static float dot_row(const float* a, const float* x, int n){
+	int j;
+	float sum;
+	float32x4_t acc = vdupq_n_f32(0);
+	float32x2_t s;
+	for(j=0;j+4<=n;j+=4){
+		acc = vmlaq_f32(acc, vld1q_f32(a+j), vld1q_f32(x+j));
+	}
+	s = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+	sum = vget_lane_f32(vpadd_f32(s,s), 0);
+	for(;j<n;j++) sum += a[j]*x[j];
+	return sum;
+}
+
+/*******************************************************************************
+* static void axpy_row(float s, const float* x, float* y, int n)
+*
+* y += s*x over n floats, 4 at a time
+*******************************************************************************/
+static void axpy_row(float s, const float* x, float* y, int n){
+	int j;
+	for(j=0;j+4<=n;j+=4){
+		vst1q_f32(y+j, vmlaq_n_f32(vld1q_f32(y+j), vld1q_f32(x+j), s));
+	}
+	for(;j<n;j++) y[j] += s*x[j];
+	return;
+}
+
+#else
+/*******************************************************************************
+* static void gemm_kernel(int kc, const float* pa, const float* pb, float* c,
+*										int ldc, int mr, int nr, int first)
+*
+* C tile += packed A strip times packed B strip, portable version.
+*******************************************************************************/
+static void gemm_kernel(int kc, const float* pa, const float* pb, float* c, \
+									int ldc, int mr, int nr, int first){
+	int p, i, j;
+	float t[GEMM_MR*GEMM_NR];
+	memset(t, 0, sizeof(t));
+	for(p=0;p<kc;p++){
+		for(i=0;i<GEMM_MR;i++){
+			for(j=0;j<GEMM_NR;j++){
+				t[i*GEMM_NR+j] += pa[i]*pb[j];
+			}
+		}
+		pa += GEMM_MR;
+		pb += GEMM_NR;
+	}
+	store_tile(t, c, ldc, mr, nr, first);
+	return;
+}
+
+/*******************************************************************************
+* static float dot_row(const float* a, const float* x, int n)
+*
+* dot product of n floats
+*******************************************************************************/
+static float dot_row(const float* a, const float* x, int n){
+	int j;
+	float sum = 0;
+	for(j=0;j<n;j++) sum += a[j]*x[j];
+	return sum;
+}
+
+/*******************************************************************************
+* static void axpy_row(float s, const float* x, float* y, int n)
+*
+* y += s*x over n floats
+*******************************************************************************/
+static void axpy_row(float s, const float* x, float* y, int n){
+	int j;
+	for(j=0;j<n;j++) y[j] += s*x[j];
+	return;
+}
+#endif // __ARM_NEON
+
+/*******************************************************************************
+* static void multiply_blocked(matrix_t A, matrix_t B, matrix_t out)
+*
+* the packed, blocked product behind multiply_to. Kept out of line so the
+* packing buffers only take up stack when they are used.
+*******************************************************************************/
+static void __attribute__((noinline)) multiply_blocked(matrix_t A, \
+												matrix_t B, matrix_t out){
+	int m = A.rows;
+	int n = B.cols;
+	int k = A.cols;
+	int jc, pc, ic, jr, ir, mc, nc, kc;
+	float pa[GEMM_MC*GEMM_KC] __attribute__((aligned(16)));
+	float pb[GEMM_KC*GEMM_NC] __attribute__((aligned(16)));
+
+	for(jc=0;jc<n;jc+=GEMM_NC){
+		nc = (n-jc<GEMM_NC) ? n-jc : GEMM_NC;
+		for(pc=0;pc<k;pc+=GEMM_KC){
+			kc = (k-pc<GEMM_KC) ? k-pc : GEMM_KC;
+			pack_b(kc, nc, MATRIX_ROW(B,pc)+jc, B.stride, pb);
+			for(ic=0;ic<m;ic+=GEMM_MC){
+				mc = (m-ic<GEMM_MC) ? m-ic : GEMM_MC;
+				pack_a(mc, kc, MATRIX_ROW(A,ic)+pc, A.stride, pa);
+				for(jr=0;jr<nc;jr+=GEMM_NR){
+					for(ir=0;ir<mc;ir+=GEMM_MR){
+						gemm_kernel(kc, pa+ir*kc, pb+jr*kc, \
+							MATRIX_ROW(out,ic+ir)+jc+jr, out.stride, \
+							(mc-ir<GEMM_MR) ? mc-ir : GEMM_MR, \
+							(nc-jr<GEMM_NR) ? nc-jr : GEMM_NR, pc==0);
+					}
+				}
+			}
+		}
+	}
+	return;
+}
+
+/*******************************************************************************
+* static void multiply_to(matrix_t A, matrix_t B, matrix_t out)
+*
+* out = A*B for an out of the right size that does not overlap A or B.
+*******************************************************************************/
+static void multiply_to(matrix_t A, matrix_t B, matrix_t out){
+	int m = A.rows;
+	int n = B.cols;
+	int k = A.cols;
+	int i, j, p;
+	float sum;
+	const float* a;
+	const float* b;
+
+	if((int64_t)m*n*k >= GEMM_SMALL){
+		multiply_blocked(A, B, out);
+		return;
+	}
+	// small products, a plain dot product per entry summed in a register
+	for(i=0;i<m;i++){
+		a = MATRIX_ROW(A,i);
+		for(j=0;j<n;j++){
+			b = MATRIX_ROW(B,0)+j;
+			sum = 0;
+			for(p=0;p<k;p++) sum += a[p]*b[p*B.stride];
+			MATRIX_ELEM(out,i,j) = sum;
+		}
+	}
+	return;
+}
+
+/*******************************************************************************
+* static void copy_to(matrix_t A, matrix_t out)
+*
+* copies the contents of A into out of the same size
+*******************************************************************************/
+static void copy_to(matrix_t A, matrix_t out){
+	int i;
+	for(i=0;i<A.rows;i++){
+		memcpy(MATRIX_ROW(out,i), MATRIX_ROW(A,i), A.cols*sizeof(float));
+	}
+	return;
+}
+
+/*******************************************************************************
+* static int check_matrix_out(matrix_t* out, int rows, int cols)
+*
+* makes sure a destination matrix exists and has the expected size
+*******************************************************************************/
+static int check_matrix_out(matrix_t* out, int rows, int cols){
+	if(out==NULL || !out->initialized){
+		printf("ERROR: output matrix not initialized yet\n");
+		return -1;
+	}
+	if(out->rows!=rows || out->cols!=cols){
+		printf("ERROR: output matrix must be %dx%d\n", rows, cols);
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* static int check_vector_out(vector_t* out, int len)
+*
+* makes sure a destination vector exists and has the expected length
+*******************************************************************************/
+static int check_vector_out(vector_t* out, int len){
+	if(out==NULL || !out->initialized){
+		printf("ERROR: output vector not initialized yet\n");
+		return -1;
+	}
+	if(out->len!=len){
+		printf("ERROR: output vector must have length %d\n", len);
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int duplicate_matrix_into(matrix_t* out, matrix_t A)
+*
+* copies A into out of the same size
+*******************************************************************************/
+int duplicate_matrix_into(matrix_t* out, matrix_t A){
+	if(!A.initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	if(check_matrix_out(out, A.rows, A.cols)) return -1;
+	if(out->mem != A.mem) copy_to(A, *out);
+	return 0;
+}
+
+/*******************************************************************************
+* int duplicate_vector_into(vector_t* out, vector_t v)
+*
+* copies v into out of the same length
+*******************************************************************************/
+int duplicate_vector_into(vector_t* out, vector_t v){
+	if(!v.initialized){
+		printf("ERROR: vector not initialized yet\n");
+		return -1;
+	}
+	if(check_vector_out(out, v.len)) return -1;
+	if(out->data != v.data) memcpy(out->data, v.data, v.len*sizeof(float));
+	return 0;
+}
+
+/*******************************************************************************
+* matrix_t multiply_matrices(matrix_t A, matrix_t B)
 *
 * 
 *******************************************************************************/
 matrix_t multiply_matrices(matrix_t A, matrix_t B){
-	int i,j,k;
-	float sum = 0;
 	matrix_t out = create_empty_matrix();
 	if(!A.initialized||!B.initialized){
 		printf("ERROR: matrix not initialized yet\n");
@@ -479,21 +913,35 @@ matrix_t multiply_matrices(matrix_t A, matrix_t B){
 		printf("ERROR: Invalid matrix sizes");
 		return out;
 	}
-	out = create_matrix(A.rows, B.cols);	
-	for(i=0;i<(A.rows);i++){
-		for(j=0;j<(B.cols);j++){	
-			for(k=0;k<(A.cols);k++){
-				// do the matrix multiplication
-				sum = sum + A.data[i][k]*B.data[k][j];
-			}
-			// save mult sum to new location
-			out.data[i][j] = sum;
-			sum = 0; 	// re-initialize sum for next loop
-		}
-	}
+	out = create_matrix(A.rows, B.cols);
+	multiply_to(A, B, out);
 	return out;
 }
 
+/*******************************************************************************
+* int multiply_matrices_into(matrix_t* out, matrix_t A, matrix_t B)
+*
+* out = A*B. out must not be A or B since every entry of the product reads a
+* whole row and column of the inputs.
+*******************************************************************************/
+int multiply_matrices_into(matrix_t* out, matrix_t A, matrix_t B){
+	if(!A.initialized||!B.initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	if (A.cols != B.rows){
+		printf("ERROR: Invalid matrix sizes\n");
+		return -1;
+	}
+	if(check_matrix_out(out, A.rows, B.cols)) return -1;
+	if(out->mem==A.mem || out->mem==B.mem){
+		printf("ERROR: output can't be an input to multiply_matrices_into\n");
+		return -1;
+	}
+	multiply_to(A, B, *out);
+	return 0;
+}
+
 /*******************************************************************************
 * int matrix_times_scalar(matrix_t* A, float s)
 *
@@ -507,7 +955,7 @@ int matrix_times_scalar(matrix_t* A, float s){
 	}
 	for(i=0;i<(A->rows);i++){
 		for(j=0;j<(A->cols);j++){	
-			A->data[i][j] = s*A->data[i][j];
+			MATRIX_ELEM(*A,i,j) = s*MATRIX_ELEM(*A,i,j);
 		}
 	}
 	return 0;
@@ -536,7 +984,6 @@ int vector_times_scalar(vector_t* v, float s){
 * 
 *******************************************************************************/
 vector_t matrix_times_col_vec(matrix_t A, vector_t v){
-	int i,j;
 	vector_t out = create_empty_vector();
 	if(!A.initialized || !v.initialized){
 		printf("ERROR: matrix or vector not initialized yet\n");
@@ -547,13 +994,34 @@ vector_t matrix_times_col_vec(matrix_t A, vector_t v){
 		return out;
 	}
 	out = create_vector(A.rows);
-	
+	matrix_times_col_vec_into(&out, A, v);
+	return out;
+}
+
+/*******************************************************************************
+* int matrix_times_col_vec_into(vector_t* out, matrix_t A, vector_t v)
+*
+* out = A*v. out must not be v.
+*******************************************************************************/
+int matrix_times_col_vec_into(vector_t* out, matrix_t A, vector_t v){
+	int i;
+	if(!A.initialized || !v.initialized){
+		printf("ERROR: matrix or vector not initialized yet\n");
+		return -1;
+	}
+	if(A.cols != v.len){
+		printf("ERROR: dimensions do not match\n");
+		return -1;
+	}
+	if(check_vector_out(out, A.rows)) return -1;
+	if(out->data == v.data){
+		printf("ERROR: output can't be the input vector\n");
+		return -1;
+	}
 	for(i=0;i<A.rows;i++){
-		for(j=0;j<A.cols;j++){	
-			out.data[i] += v.data[j]*A.data[i][j];
-		}
+		out->data[i] = dot_row(MATRIX_ROW(A,i), v.data, A.cols);
 	}
-	return out;
+	return 0;
 }
 
 /*******************************************************************************
@@ -562,7 +1030,6 @@ vector_t matrix_times_col_vec(matrix_t A, vector_t v){
 * 
 *******************************************************************************/
 vector_t row_vec_times_matrix(vector_t v, matrix_t A){
-	int i,j;
 	vector_t out = create_empty_vector();
 	if(!A.initialized || !v.initialized){
 		printf("ERROR: matrix or vector not initialized yet\n");
@@ -572,41 +1039,85 @@ vector_t row_vec_times_matrix(vector_t v, matrix_t A){
 		printf("ERROR: dimensions do not match\n");
 		return out;
 	}
-	
 	out = create_vector(A.cols);
-	for(i=0;i<A.cols;i++){
-		for(j=0;j<A.rows;j++){	
-			out.data[i] += v.data[j]*A.data[j][i];
-		}
-	}
+	row_vec_times_matrix_into(&out, v, A);
 	return out;
 }
 
-
-
 /*******************************************************************************
-* matrix_t add_matrices(matrix_t A, matrix_t B)
+* int row_vec_times_matrix_into(vector_t* out, vector_t v, matrix_t A)
 *
-* 
+* out = v'*A. out must not be v.
 *******************************************************************************/
-matrix_t add_matrices(matrix_t A, matrix_t B){
-	int i,j;
-	matrix_t out = create_empty_matrix();
-	if(!A.initialized||!B.initialized){
-		printf("ERROR: matrix not initialized yet\n");
-		return out;
+int row_vec_times_matrix_into(vector_t* out, vector_t v, matrix_t A){
+	int j;
+	if(!A.initialized || !v.initialized){
+		printf("ERROR: matrix or vector not initialized yet\n");
+		return -1;
+	}
+	if(A.rows != v.len){
+		printf("ERROR: dimensions do not match\n");
+		return -1;
+	}
+	if(check_vector_out(out, A.cols)) return -1;
+	if(out->data == v.data){
+		printf("ERROR: output can't be the input vector\n");
+		return -1;
+	}
+	memset(out->data, 0, A.cols*sizeof(float));
+	// walk A a row at a time rather than down its columns
+	for(j=0;j<A.rows;j++){
+		axpy_row(v.data[j], MATRIX_ROW(A,j), out->data, A.cols);
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* matrix_t add_matrices(matrix_t A, matrix_t B)
+*
+* 
+*******************************************************************************/
+matrix_t add_matrices(matrix_t A, matrix_t B){
+	matrix_t out = create_empty_matrix();
+	if(!A.initialized||!B.initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return out;
 	}
 	if ((A.rows != B.rows)||(A.cols != B.cols)){
 		printf("Invalid matrix sizes");
 		return out;
 	}
 	out = create_matrix(A.rows, A.cols);
+	add_matrices_into(&out, A, B);
+	return out;
+}
+
+/*******************************************************************************
+* int add_matrices_into(matrix_t* out, matrix_t A, matrix_t B)
+*
+* out = A+B. out may be A or B for an in place sum.
+*******************************************************************************/
+int add_matrices_into(matrix_t* out, matrix_t A, matrix_t B){
+	int i,j;
+	float *a, *b, *o;
+	if(!A.initialized||!B.initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	if ((A.rows != B.rows)||(A.cols != B.cols)){
+		printf("ERROR: Invalid matrix sizes\n");
+		return -1;
+	}
+	if(check_matrix_out(out, A.rows, A.cols)) return -1;
 	for(i=0;i<(A.rows);i++){
+		a = MATRIX_ROW(A,i);
+		b = MATRIX_ROW(B,i);
+		o = MATRIX_ROW(*out,i);
 		for(j=0;j<(A.cols);j++){	
-			out.data[i][j] = A.data[i][j] + B.data[i][j];
+			o[j] = a[j] + b[j];
 		}
 	}
-	return out;
+	return 0;
 }
 
 /*******************************************************************************
@@ -616,24 +1127,59 @@ matrix_t add_matrices(matrix_t A, matrix_t B){
 *******************************************************************************/
 int transpose_matrix(matrix_t* A){
 	int i,j;
+	float temp;
 	if(!A->initialized){
 		printf("ERROR: matrix not initialized yet\n");
 		return -1;
 	}
-	// swap rows and cols
-	matrix_t temp = create_matrix(A->cols, A->rows);
-	for(i=0;i<(A->rows);i++){
-		for(j=0;j<(A->cols);j++){	
-			temp.data[i][j] = A->data[j][i];
+	// square matrices are transposed in place
+	if(A->rows == A->cols){
+		for(i=0;i<A->rows;i++){
+			for(j=i+1;j<A->cols;j++){
+				temp = MATRIX_ELEM(*A,i,j);
+				MATRIX_ELEM(*A,i,j) = MATRIX_ELEM(*A,j,i);
+				MATRIX_ELEM(*A,j,i) = temp;
+			}
 		}
+		return 0;
 	}
+	// swap rows and cols
+	matrix_t T = create_matrix(A->cols, A->rows);
+	transpose_matrix_into(&T, *A);
 	// unallocate the original matrix A and set its data pointer to point
 	// to the newly allocated memory
 	destroy_matrix(A);
-	*A=temp;
+	*A=T;
 	return  0;
 }
 
+/*******************************************************************************
+* int transpose_matrix_into(matrix_t* out, matrix_t A)
+*
+* out = A'. out may only be A when A is square.
+*******************************************************************************/
+int transpose_matrix_into(matrix_t* out, matrix_t A){
+	int i,j;
+	if(!A.initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	if(check_matrix_out(out, A.cols, A.rows)) return -1;
+	if(out->mem == A.mem){
+		if(A.rows != A.cols){
+			printf("ERROR: only square matrices transpose in place\n");
+			return -1;
+		}
+		return transpose_matrix(out);
+	}
+	for(i=0;i<A.rows;i++){
+		for(j=0;j<A.cols;j++){	
+			MATRIX_ELEM(*out,j,i) = MATRIX_ELEM(A,i,j);
+		}
+	}
+	return 0;
+}
+
 
 /*******************************************************************************
 * float vector_norm(vector_t v)
@@ -660,8 +1206,6 @@ float vector_norm(vector_t v){
 * Projects vector v onto e
 *******************************************************************************/
 vector_t vector_projection(vector_t v, vector_t e){
-	int i;
-	float factor;
 	vector_t out = create_empty_vector();
 	
 	if(!v.initialized || !e.initialized){
@@ -673,11 +1217,32 @@ vector_t vector_projection(vector_t v, vector_t e){
 		return out;
 	}
 	out = create_vector(v.len);
+	vector_projection_into(&out, v, e);
+	return out;
+}
+
+/*******************************************************************************
+* int vector_projection_into(vector_t* out, vector_t v, vector_t e)
+*
+* Projects vector v onto e. out may be v or e.
+*******************************************************************************/
+int vector_projection_into(vector_t* out, vector_t v, vector_t e){
+	int i;
+	float factor;
+	if(!v.initialized || !e.initialized){
+		printf("ERROR: vectors not initialized yet\n");
+		return -1;
+	}
+	if(v.len != e.len){
+		printf("ERROR: vectors not of same dimension\n");
+		return -1;
+	}
+	if(check_vector_out(out, v.len)) return -1;
 	factor = vector_dot_product(v,e)/vector_dot_product(e,e);
 	for(i=0;i<v.len;i++){
-		out.data[i] = factor * e.data[i];
+		out->data[i] = factor * e.data[i];
 	}
-	return out;
+	return 0;
 }
 
 
@@ -688,21 +1253,34 @@ vector_t vector_projection(vector_t v, vector_t e){
 * Output is a matrix with same rows as v1 and same columns as v2.
 *******************************************************************************/
 matrix_t vector_outer_product(vector_t v1, vector_t v2){
-	int i, j;
-	int m = v1.len;
-	int n = v2.len;
 	matrix_t out = create_empty_matrix();
 	if(!v1.initialized || !v2.initialized){
 		printf("ERROR: vectors not initialized yet\n");
 		return out;
 	}
-	out = create_matrix(m,n);
-	for(i=0;i<m;i++){
-		for(j=0;j<n;j++){
-			out.data[j][i] = v1.data[i]*v2.data[j];
+	out = create_matrix(v1.len,v2.len);
+	vector_outer_product_into(&out, v1, v2);
+	return out;
+}
+
+/*******************************************************************************
+* int vector_outer_product_into(matrix_t* out, vector_t v1, vector_t v2)
+* 
+* out = v1*v2' for a preallocated len(v1) x len(v2) matrix out.
+*******************************************************************************/
+int vector_outer_product_into(matrix_t* out, vector_t v1, vector_t v2){
+	int i, j;
+	if(!v1.initialized || !v2.initialized){
+		printf("ERROR: vectors not initialized yet\n");
+		return -1;
+	}
+	if(check_matrix_out(out, v1.len, v2.len)) return -1;
+	for(i=0;i<v1.len;i++){
+		for(j=0;j<v2.len;j++){
+			MATRIX_ELEM(*out,i,j) = v1.data[i]*v2.data[j];
 		}
 	}
-	return out;
+	return 0;
 }
 
 /*******************************************************************************
@@ -711,7 +1289,7 @@ matrix_t vector_outer_product(vector_t v1, vector_t v2){
 * 
 *******************************************************************************/
 float vector_dot_product(vector_t v1, vector_t v2){
-	float out;
+	float out = 0;
 	int i;
 	if(!v1.initialized || !v2.initialized){
 		printf("ERROR: vector not initialized yet\n");
@@ -744,12 +1322,35 @@ vector_t cross_product_3d(vector_t v1, vector_t v2){
 	}
 	
 	out = create_vector(v1.len);
-	out.data[0] = (v1.data[1]*v2.data[2]) - (v1.data[2]*v2.data[1]);
-	out.data[1] = (v1.data[2]*v2.data[0]) - (v1.data[0]*v2.data[2]);
-	out.data[2] = (v1.data[0]*v2.data[1]) - (v1.data[1]*v2.data[0]);
+	cross_product_3d_into(&out, v1, v2);
 	return out;	
 }
 
+/*******************************************************************************
+* int cross_product_3d_into(vector_t* out, vector_t v1, vector_t v2)
+*
+* out = v1 x v2. out may be v1 or v2.
+*******************************************************************************/
+int cross_product_3d_into(vector_t* out, vector_t v1, vector_t v2){
+	float x, y, z;
+	if(!v1.initialized || !v2.initialized){
+		printf("ERROR: vector not initialized yet\n");
+		return -1;
+	}
+	if((v1.len != 3) || (v2.len != 3)){
+		printf("ERROR: vectors not of dimension 3\n");
+		return -1;
+	}
+	if(check_vector_out(out, 3)) return -1;
+	x = (v1.data[1]*v2.data[2]) - (v1.data[2]*v2.data[1]);
+	y = (v1.data[2]*v2.data[0]) - (v1.data[0]*v2.data[2]);
+	z = (v1.data[0]*v2.data[1]) - (v1.data[1]*v2.data[0]);
+	out->data[0] = x;
+	out->data[1] = y;
+	out->data[2] = z;
+	return 0;
+}
+
 /*******************************************************************************
 * vector_t poly_conv(vector_t v1, vector_t v2)
 *
@@ -757,22 +1358,44 @@ vector_t cross_product_3d(vector_t v1, vector_t v2){
 *******************************************************************************/
 vector_t poly_conv(vector_t v1, vector_t v2){
 	vector_t out = create_empty_vector();
-	int m,n,i,j,k;
 	if(!v1.initialized || !v2.initialized){
 		printf("ERROR: vector not initialized yet\n");
 		return out;
 	}
+	out = create_vector(v1.len+v2.len-1);
+	poly_conv_into(&out, v1, v2);
+	return out;	
+}
+
+/*******************************************************************************
+* int poly_conv_into(vector_t* out, vector_t v1, vector_t v2)
+*
+* out = v1 convolved with v2, length len(v1)+len(v2)-1. out may share its
+* start with v1 and/or v2 so a polynomial can be multiplied up in place inside
+* a buffer long enough for the result. Coefficients are produced from the
+* highest down and coefficient k only reads inputs at indices <= k, all of
+* which are still untouched at that point.
+*******************************************************************************/
+int poly_conv_into(vector_t* out, vector_t v1, vector_t v2){
+	int m,n,i,k,lo,hi;
+	float sum;
+	if(!v1.initialized || !v2.initialized){
+		printf("ERROR: vector not initialized yet\n");
+		return -1;
+	}
 	m = v1.len;
 	n = v2.len;
-	k = m+n-1;
-	out = create_vector(k);
-	
-	for(i=0;i<m;i++){
-		for(j=0;j<n;j++){
-			out.data[i+j] += v1.data[i] * v2.data[j];
+	if(check_vector_out(out, m+n-1)) return -1;
+	for(k=m+n-2;k>=0;k--){
+		lo = (k-n+1>0) ? k-n+1 : 0;
+		hi = (k<m-1) ? k : m-1;
+		sum = 0;
+		for(i=lo;i<=hi;i++){
+			sum += v1.data[i] * v2.data[k-i];
 		}
+		out->data[k] = sum;
 	}
-	return out;	
+	return 0;
 }
 
 /*******************************************************************************
@@ -782,7 +1405,6 @@ vector_t poly_conv(vector_t v1, vector_t v2){
 *******************************************************************************/
 vector_t poly_power(vector_t v, int N){
 	vector_t out = create_empty_vector();
-	int i;
 	if(!v.initialized){
 		printf("ERROR: vector not initialized yet\n");
 		return out;
@@ -791,22 +1413,41 @@ vector_t poly_power(vector_t v, int N){
 		printf("ERROR: no negative exponents\n");
 		return out;
 	}
-	if(N == 0){
-		out = create_vector(1);
-		out.data[0] = 1;
-		return out;
-	}	
-	out = duplicate_vector(v);
-	if(N == 1){
-		return out;
+	out = create_vector(N*(v.len-1)+1);
+	poly_power_into(&out, v, N);
+	return out;
+}
+
+/*******************************************************************************
+* int poly_power_into(vector_t* out, vector_t v, int N)
+*
+* out = v^N, length N*(len(v)-1)+1. Built up in place in out with repeated
+* poly_conv_into so out must not be v.
+*******************************************************************************/
+int poly_power_into(vector_t* out, vector_t v, int N){
+	int i;
+	vector_t partial;
+	if(!v.initialized){
+		printf("ERROR: vector not initialized yet\n");
+		return -1;
 	}
-	vector_t temp;
-	for(i=2;i<=N;i++){
-		temp = poly_conv(out, v);
-		out  = duplicate_vector(temp);
-		destroy_vector(&temp);
+	if(N < 0){
+		printf("ERROR: no negative exponents\n");
+		return -1;
 	}
-	return out;
+	if(check_vector_out(out, N*(v.len-1)+1)) return -1;
+	if(out->data == v.data){
+		printf("ERROR: output can't be the input vector\n");
+		return -1;
+	}
+	out->data[0] = 1;
+	partial = wrap_vector(1, out->data);
+	for(i=0;i<N;i++){
+		partial.len += v.len-1;
+		poly_conv_into(&partial, wrap_vector(partial.len-v.len+1, \
+											out->data), v);
+	}
+	return 0;
 }
 
 /*******************************************************************************
@@ -816,9 +1457,7 @@ vector_t poly_power(vector_t v, int N){
 *  or order N and cutoff wc (rad/s)
 *******************************************************************************/
 vector_t poly_butter(int N, float wc){
-	int i;
 	vector_t filter = create_empty_vector();
-	vector_t P2, P3, temp;
 	if(N < 1){
 		printf("ERROR: order must be > 1\n");
 		return filter;
@@ -827,38 +1466,47 @@ vector_t poly_butter(int N, float wc){
 		printf("ERROR: order must be <= 10 to prevent overflow\n");
 		return filter;
 	}
-	filter = create_vector(1);
-	filter.data[0] = 1;
-	P2 = create_vector(2);
-	P3 = create_vector(3);
-	if(N%2 == 0){
-		for(i=1;i<=N/2;i++){
-			P3.data[0] = 1/(wc*wc);
-			P3.data[1] = -2*cos((2*i + N - 1)*PI/(2*N))/wc;
-			P3.data[2] = 1;
-			temp = duplicate_vector(filter);
-			filter = poly_conv(temp,P3);
-			destroy_vector(&temp);
-		}
+	filter = create_vector(N+1);
+	poly_butter_into(&filter, N, wc);
+	return filter;
+}
+
+/*******************************************************************************
+* int poly_butter_into(vector_t* out, int N, float wc)
+*
+* Same as poly_butter but fills in the N+1 coefficients of preallocated out.
+*******************************************************************************/
+int poly_butter_into(vector_t* out, int N, float wc){
+	int i;
+	float p[3];
+	vector_t filter;
+	if(N < 1){
+		printf("ERROR: order must be > 1\n");
+		return -1;
 	}
+	if(N > 10){
+		printf("ERROR: order must be <= 10 to prevent overflow\n");
+		return -1;
+	}
+	if(check_vector_out(out, N+1)) return -1;
+	// multiply up first and second order factors in place in out
+	out->data[0] = 1;
+	filter = wrap_vector(1, out->data);
 	if(N%2 == 1){	
-		P2.data[0] = 1/wc;
-		P2.data[1] = 1;
-		temp = duplicate_vector(filter);
-		filter = poly_conv(temp,P2);
-		destroy_vector(&temp);
-		for(i=1;i<=(N-1)/2;i++){
-			P3.data[0] = 1/(wc*wc);
-			P3.data[1] = -2*cos((2*i + N - 1)*PI/(2*N))/wc;
-			P3.data[2] = 1;
-			temp = duplicate_vector(filter);
-			filter = poly_conv(temp,P3);
-			destroy_vector(&temp);
-		}
+		p[0] = 1/wc;
+		p[1] = 1;
+		filter.len = 2;
+		poly_conv_into(&filter, wrap_vector(1,out->data), wrap_vector(2,p));
+	}
+	for(i=1;i<=N/2;i++){
+		p[0] = 1/(wc*wc);
+		p[1] = -2*cos((2*i + N - 1)*PI/(2*N))/wc;
+		p[2] = 1;
+		filter.len += 2;
+		poly_conv_into(&filter, wrap_vector(filter.len-2,out->data), \
+														wrap_vector(3,p));
 	}
-	destroy_vector(&P2);
-	destroy_vector(&P3);
-	return filter;
+	return 0;
 }
 
 /*******************************************************************************
@@ -929,15 +1577,15 @@ float matrix_determinant(matrix_t A){
 	for(i=0;i<A.rows;i++){
         for(j=0;j<A.rows;j++){
             if(j>i){
-				ratio = temp.data[j][i]/temp.data[i][i];
+				ratio = MATRIX_ELEM(temp,j,i)/MATRIX_ELEM(temp,i,i);
                 for(k=0;k<A.rows;k++){
-                    temp.data[j][k] = temp.data[j][k] - ratio * temp.data[i][k];
+                    MATRIX_ELEM(temp,j,k) = MATRIX_ELEM(temp,j,k) - ratio * MATRIX_ELEM(temp,i,k);
                 }
             }
         }
     }
 	det = 1; //storage for determinant
-    for(i=0;i<A.rows;i++) det = det*temp.data[i][i];
+    for(i=0;i<A.rows;i++) det = det*MATRIX_ELEM(temp,i,i);
 
 	destroy_matrix(&temp);
     return det;  
@@ -970,19 +1618,19 @@ int LUP_decomposition(matrix_t A, matrix_t* L, matrix_t* U, matrix_t* P){
 	for(i=0;i<m-1;i++){
 		index = i;
 		for(j=i;j<m;j++){
-			if(fabs(A.data[j][i]) >= fabs(A.data[index][i])){
+			if(fabs(MATRIX_ELEM(A,j,i)) >= fabs(MATRIX_ELEM(A,index,i))){
 				index = j;
 			}
 				
 		}
 		if(index != i){
 			for(j=0;j<m;j++){
-				temp 				= A.data[index][j];
-				A.data[index][j] 	= A.data[i][j];
-				A.data[i][j]		= temp;
-				temp				= Pt.data[index][j];
-				Pt.data[index][j]	= Pt.data[i][j];
-				Pt.data[i][j]		= temp;	
+				temp 				= MATRIX_ELEM(A,index,j);
+				MATRIX_ELEM(A,index,j) 	= MATRIX_ELEM(A,i,j);
+				MATRIX_ELEM(A,i,j)		= temp;
+				temp				= MATRIX_ELEM(Pt,index,j);
+				MATRIX_ELEM(Pt,index,j)	= MATRIX_ELEM(Pt,i,j);
+				MATRIX_ELEM(Pt,i,j)		= temp;	
 			}
 		}	
 	}
@@ -991,15 +1639,15 @@ int LUP_decomposition(matrix_t A, matrix_t* L, matrix_t* U, matrix_t* P){
 			s1 = 0;
 			s2 = 0;
 			for(k=0;k<i;k++){
-				s1 += Ut.data[k][j] * Lt.data[i][k];
+				s1 += MATRIX_ELEM(Ut,k,j) * MATRIX_ELEM(Lt,i,k);
 			}
 			for(k=0;k<j;k++){
-				s2 += Ut.data[k][j] * Lt.data[i][k];
+				s2 += MATRIX_ELEM(Ut,k,j) * MATRIX_ELEM(Lt,i,k);
 			}
 			
-			if(j>=i)	Ut.data[i][j] = A.data[i][j] - s1;
+			if(j>=i)	MATRIX_ELEM(Ut,i,j) = MATRIX_ELEM(A,i,j) - s1;
 			
-			if(i>=j)	Lt.data[i][j] = (A.data[i][j] - s2)/Ut.data[j][j];	
+			if(i>=j)	MATRIX_ELEM(Lt,i,j) = (MATRIX_ELEM(A,i,j) - s2)/MATRIX_ELEM(Ut,j,j);	
 		}
 	}
 	*L = Lt;
@@ -1008,74 +1656,218 @@ int LUP_decomposition(matrix_t A, matrix_t* L, matrix_t* U, matrix_t* P){
 	return 0;
 }
 
+
+/*******************************************************************************
+* Scratch sizes for the solver wrappers below
+*
+* Each wrapper builds an arena just large enough for the *_arena version to
+* run, so a call costs one allocation for all temporaries plus its result.
+* These must cover the most the *_arena functions ever draw at once.
+*******************************************************************************/
+static size_t qr_bytes(int m, int n){
+	return la_matrix_bytes(m,m) + la_matrix_bytes(m,n) \
+			+ la_vector_bytes((m<n)?m:n) + la_vector_bytes((m>n)?m:n);
+}
+
+static size_t solve_bytes(int n){
+	return la_matrix_bytes(n,n) + 2*la_vector_bytes(n);
+}
+
+static size_t solve_qr_bytes(int m, int n){
+	return la_matrix_bytes(m,n) + la_vector_bytes(m) + 3*la_vector_bytes(n);
+}
+
+static size_t ellipsoid_bytes(int p){
+	return 2*la_vector_bytes(3) + la_matrix_bytes(p,6) + la_vector_bytes(p) \
+			+ solve_qr_bytes(p,6) + la_matrix_bytes(3,3) + la_vector_bytes(3) \
+			+ solve_bytes(3);
+}
+
+/*******************************************************************************
+* Householder QR
+*
+* The factorization is done in place, LAPACK style. Column i of A is reduced
+* by the reflector H_i = I - tau_i*v*v' with v[i]=1, which is applied to the
+* columns to its right as a rank-1 update. No reflector matrix is ever
+* formed. When finished, R sits on and above the diagonal and the rest of
+* each v sits below it, so Q = H_0*H_1*...*H_k-1 can either be applied to a
+* vector directly or built on request.
+*
+* All three helpers work a row at a time with axpy_row() since matrices are
+* row major. w is scratch of at least max(rows,cols) floats.
+*******************************************************************************/
+
+/*******************************************************************************
+* static void reflect_rows(matrix_t W, matrix_t V, int i, int c0, float tau,
+*																float* w)
+*
+* applies H = I - tau*v*v' to rows i..m-1 of W over columns c0..cols-1, where
+* v is 1 at row i and V(r,i) below it. V may be W itself.
+*******************************************************************************/
+static void reflect_rows(matrix_t W, matrix_t V, int i, int c0, float tau, \
+																float* w){
+	int r, len = W.cols-c0;
+	if(len<=0 || tau==0) return;
+	// w = v'*W over the columns, then W -= tau*v*w
+	memcpy(w, MATRIX_ROW(W,i)+c0, len*sizeof(float));
+	for(r=i+1;r<W.rows;r++){
+		axpy_row(MATRIX_ELEM(V,r,i), MATRIX_ROW(W,r)+c0, w, len);
+	}
+	axpy_row(-tau, w, MATRIX_ROW(W,i)+c0, len);
+	for(r=i+1;r<W.rows;r++){
+		axpy_row(-tau*MATRIX_ELEM(V,r,i), w, MATRIX_ROW(W,r)+c0, len);
+	}
+	return;
+}
+
+/*******************************************************************************
+* static void householder_factor(matrix_t W, float* tau, float* w)
+*
+* overwrites W with its compact QR factorization, tau gets min(rows,cols)
+* reflector scales
+*******************************************************************************/
+static void householder_factor(matrix_t W, float* tau, float* w){
+	int i, r;
+	int k = (W.rows<W.cols) ? W.rows : W.cols;
+	float alpha, beta, xnorm, scale;
+	for(i=0;i<k;i++){
+		xnorm = 0;
+		for(r=i+1;r<W.rows;r++){
+			xnorm += MATRIX_ELEM(W,r,i)*MATRIX_ELEM(W,r,i);
+		}
+		if(xnorm==0){					// already zero below the diagonal
+			tau[i] = 0;
+			continue;
+		}
+		alpha = MATRIX_ELEM(W,i,i);
+		beta = sqrt(alpha*alpha + xnorm);
+		if(alpha>0) beta = -beta;		// avoid cancellation in alpha-beta
+		tau[i] = (beta-alpha)/beta;
+		scale = 1.0/(alpha-beta);
+		for(r=i+1;r<W.rows;r++){
+			MATRIX_ELEM(W,r,i) *= scale;
+		}
+		MATRIX_ELEM(W,i,i) = beta;
+		reflect_rows(W, W, i, i+1, tau[i], w);
+	}
+	return;
+}
+
+/*******************************************************************************
+* static void householder_apply_qt(matrix_t W, const float* tau, float* b)
+*
+* b = Q'*b for the Q stored in W and tau, b has W.rows entries
+*******************************************************************************/
+static void householder_apply_qt(matrix_t W, const float* tau, float* b){
+	int i, r;
+	int k = (W.rows<W.cols) ? W.rows : W.cols;
+	float s;
+	for(i=0;i<k;i++){
+		if(tau[i]==0) continue;
+		s = b[i];
+		for(r=i+1;r<W.rows;r++) s += MATRIX_ELEM(W,r,i)*b[r];
+		s *= tau[i];
+		b[i] -= s;
+		for(r=i+1;r<W.rows;r++) b[r] -= s*MATRIX_ELEM(W,r,i);
+	}
+	return;
+}
+
+/*******************************************************************************
+* static void householder_form_q(matrix_t W, const float* tau, matrix_t Q,
+*																float* w)
+*
+* builds the full square Q from W and tau by applying the reflectors to I
+* last to first, each only touches the lower right block it acts on
+*******************************************************************************/
+static void householder_form_q(matrix_t W, const float* tau, matrix_t Q, \
+																float* w){
+	int i;
+	int k = (W.rows<W.cols) ? W.rows : W.cols;
+	for(i=0;i<Q.rows;i++){
+		memset(MATRIX_ROW(Q,i), 0, Q.cols*sizeof(float));
+		MATRIX_ELEM(Q,i,i) = 1;
+	}
+	for(i=k-1;i>=0;i--){
+		reflect_rows(Q, W, i, i, tau[i], w);
+	}
+	return;
+}
+
 /*******************************************************************************
 * int QR_decomposition(matrix_t A, matrix_t* Q, matrix_t* R)
 *
 * 
 *******************************************************************************/
 int QR_decomposition(matrix_t A, matrix_t* Q, matrix_t* R){
-	int i, j, k, s;
-	int m = A.rows;
-	int n = A.cols;
-	vector_t xtemp;
-	matrix_t Qt, Rt, Qi, F, temp;
-	
+	matrix_t Qa, Ra;
+	la_arena_t ws;
 	if(!A.initialized){
 		printf("ERROR: matrix not initialized yet\n");
 		return -1;
 	}
-	
 	destroy_matrix(Q);
 	destroy_matrix(R);
-	
-	Qt = create_matrix(m,m);
-	for(i=0;i<m;i++){					// initialize Qt as I
-		Qt.data[i][i] = 1;
+	ws = create_la_arena(qr_bytes(A.rows,A.cols));
+	if(QR_decomposition_arena(A,&Qa,&Ra,&ws)<0){
+		destroy_la_arena(&ws);
+		return -1;
 	}
+	*Q = duplicate_matrix(Qa);
+	*R = duplicate_matrix(Ra);
+	destroy_la_arena(&ws);
+	return 0;
+}
+
+/*******************************************************************************
+* int QR_decomposition_arena(matrix_t A, matrix_t* Q, matrix_t* R, 
+*														la_arena_t* a)
+*
+* Same as QR_decomposition but Q and R are drawn from arena a along with the
+* temporaries, which are handed back before returning. Q may be NULL when
+* only R is wanted, which skips forming Q altogether. On failure the arena is
+* left as it was.
+*******************************************************************************/
+int QR_decomposition_arena(matrix_t A, matrix_t* Q, matrix_t* R, \
+														la_arena_t* a){
+	int i, k;
+	int m = A.rows;
+	int n = A.cols;
+	size_t start, mark;
+	matrix_t Qt, Rt;
+	vector_t tau, w;
 	
-	Rt = duplicate_matrix(A);			// duplicate A to Rt
+	if(!A.initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	k = (m<n) ? m : n;
+	start = la_arena_mark(a);
+	Qt = create_empty_matrix();
+	if(Q!=NULL) Qt = la_arena_matrix(a,m,m);
+	Rt = la_arena_matrix(a,m,n);
+	if((Q!=NULL && !Qt.initialized) || !Rt.initialized){
+		la_arena_release(a,start);
+		return -1;
+	}
+	mark = la_arena_mark(a);
+	tau = la_arena_vector(a,k);
+	w = la_arena_vector(a,(m>n)?m:n);
+	if(!tau.initialized || !w.initialized){
+		la_arena_release(a,start);
+		return -1;
+	}
 
-	for(i=0;i<n;i++){					// iterate through columns of A
-		xtemp = create_vector(m-i);		// allocate length, decreases with i
-		
-		for(j=i;j<m;j++){						// take col of -R from diag down
-			xtemp.data[j-i] = -Rt.data[j][i]; 	
-		}
-		if(Rt.data[i][i] > 0)	s = -1;			// check the sign
-		else					s = 1;
-		xtemp.data[0] += s*vector_norm(xtemp);	// add norm to 1st element
-		
-		Qi = create_square_matrix(m);			// initialize Qi
-		F  = create_square_matrix(m-i);			// initialize shrinking householder_matrix
-		F  = householder_matrix(xtemp);			// fill in Househodor
-		
-		for(j=0;j<i;j++){
-			Qi.data[j][j] = 1;				// fill in partial I matrix
-		}
-		for(j=i;j<m;j++){					// fill in remainder (householder_matrix)
-			for(k=i;k<m;k++){
-				Qi.data[j][k] = F.data[j-i][k-i];
-			}
-		}
-		// multiply new Qi to old Qtemp
-		temp = duplicate_matrix(Qt);
-		destroy_matrix(&Qt);
-		Qt = multiply_matrices(Qi,temp);
-		destroy_matrix(&temp);
-		
-		// same with Rtemp
-		temp = duplicate_matrix(Rt);
-		destroy_matrix(&Rt);
-		Rt = multiply_matrices(Qi,temp);
-		destroy_matrix(&temp);
-		
-		// free other allocation used in this step
-		destroy_matrix(&Qi);					
-		destroy_matrix(&F);
-		destroy_vector(&xtemp);
-	}
-	transpose_matrix(&Qt);
-	*Q = Qt;
+	// factor a copy of A in place in Rt, form Q from the reflectors left
+	// below the diagonal, then clear them out to leave R
+	copy_to(A,Rt);
+	householder_factor(Rt, tau.data, w.data);
+	if(Q!=NULL) householder_form_q(Rt, tau.data, Qt, w.data);
+	for(i=1;i<m;i++){
+		memset(MATRIX_ROW(Rt,i), 0, ((i<n)?i:n)*sizeof(float));
+	}
+	la_arena_release(a,mark);
+	if(Q!=NULL) *Q = Qt;
 	*R = Rt;
 	return 0;
 }
@@ -1083,52 +1875,98 @@ int QR_decomposition(matrix_t A, matrix_t* Q, matrix_t* R){
 /*******************************************************************************
 * matrix_t invert_matrix(matrix_t A)
 *
-* Invert Matrix function based on LUP decomposition and then forward and
-* backward substitution.
+* Invert Matrix function based on Gauss-Jordan elimination with partial
+* pivoting.
 *******************************************************************************/
 matrix_t invert_matrix(matrix_t A){
-	int i,j,k,m;
-	matrix_t L,U,P,D,temp;
+	matrix_t inv;
 	matrix_t out = create_empty_matrix();
+	la_arena_t ws;
 	if(!A.initialized){
 		printf("ERROR: matrix not initialized yet\n");
 		return out;
 	}
-	if(A.cols != A.rows){
-		printf("ERROR: matrix is not square\n");
+	ws = create_la_arena(2*la_matrix_bytes(A.rows,A.cols));
+	inv = invert_matrix_arena(A,&ws);
+	if(inv.initialized) out = duplicate_matrix(inv);
+	destroy_la_arena(&ws);
+	return out;
+}
+
+/*******************************************************************************
+* matrix_t invert_matrix_arena(matrix_t A, la_arena_t* a)
+*
+* Same as invert_matrix but the inverse and its one temporary, a working copy
+* of A, are drawn from arena a. A itself is not modified. On failure the
+* arena is left as it was.
+*******************************************************************************/
+matrix_t invert_matrix_arena(matrix_t A, la_arena_t* a){
+	int i,j,k,m,p;
+	float ratio, temp;
+	size_t start, mark;
+	matrix_t W;
+	matrix_t out = create_empty_matrix();
+	if(!A.initialized){
+		printf("ERROR: matrix not initialized yet\n");
 		return out;
 	}
-	if(matrix_determinant(A) == 0){
-		printf("ERROR: matrix is singular, not invertible\n");
+	if(A.cols != A.rows){
+		printf("ERROR: matrix is not square\n");
 		return out;
 	}
 	m = A.cols;
-	LUP_decomposition(A,&L,&U,&P);
-	D    = create_identity_matrix(m);
-	temp = create_square_matrix(m);
+	start = la_arena_mark(a);
+	out = la_arena_matrix(a,m,m);
+	if(!out.initialized) return out;
+	mark = la_arena_mark(a);
+	W = la_arena_matrix(a,m,m);
+	if(!W.initialized){
+		la_arena_release(a,start);
+		return create_empty_matrix();
+	}
+	copy_to(A,W);
+	for(i=0;i<m;i++){
+		MATRIX_ELEM(out,i,i) = 1;
+	}
 
-	for(j=0;j<m;j++){
-		for(i=0;i<m;i++){
-			for(k=0;k<i;k++){
-				D.data[i][j] -= L.data[i][k] * D.data[k][j];
+	for(k=0;k<m;k++){
+		// pick the largest pivot in column k
+		p = k;
+		for(i=k+1;i<m;i++){
+			if(fabs(MATRIX_ELEM(W,i,k)) > fabs(MATRIX_ELEM(W,p,k))) p = i;
+		}
+		if(MATRIX_ELEM(W,p,k) == 0){
+			printf("ERROR: matrix is singular, not invertible\n");
+			la_arena_release(a,start);
+			return create_empty_matrix();
+		}
+		if(p != k){
+			for(j=0;j<m;j++){
+				temp = MATRIX_ELEM(W,k,j);
+				MATRIX_ELEM(W,k,j) = MATRIX_ELEM(W,p,j);
+				MATRIX_ELEM(W,p,j) = temp;
+				temp = MATRIX_ELEM(out,k,j);
+				MATRIX_ELEM(out,k,j) = MATRIX_ELEM(out,p,j);
+				MATRIX_ELEM(out,p,j) = temp;
 			}
 		}
-		for(i=m-1;i>=0;i--){				// backwards.. last to first
-			temp.data[i][j] = D.data[i][j];
-			for(k=i+1;k<m;k++){	
-				temp.data[i][j] -= U.data[i][k] * temp.data[k][j];
+		// normalize the pivot row then clear column k from every other row
+		ratio = 1.0/MATRIX_ELEM(W,k,k);
+		for(j=0;j<m;j++){
+			MATRIX_ELEM(W,k,j) *= ratio;
+			MATRIX_ELEM(out,k,j) *= ratio;
+		}
+		for(i=0;i<m;i++){
+			if(i==k) continue;
+			ratio = MATRIX_ELEM(W,i,k);
+			if(ratio==0) continue;
+			for(j=0;j<m;j++){
+				MATRIX_ELEM(W,i,j) -= ratio*MATRIX_ELEM(W,k,j);
+				MATRIX_ELEM(out,i,j) -= ratio*MATRIX_ELEM(out,k,j);
 			}
-			temp.data[i][j] = temp.data[i][j] / U.data[i][i];
 		}
 	}
-	// multiply by permutation matrix
-	out = multiply_matrices(temp, P);		
-	// free allocation	
-	destroy_matrix(&temp);	
-	destroy_matrix(&L);		
-	destroy_matrix(&U);
-	destroy_matrix(&P);
-	destroy_matrix(&D);
+	la_arena_release(a,mark);
 	return out;
 }
 
@@ -1138,93 +1976,147 @@ matrix_t invert_matrix(matrix_t A){
 * returns the householder reflection matrix for a given vector
 *******************************************************************************/
 matrix_t householder_matrix(vector_t v){
-	int i, j;
-	float tau;
 	matrix_t out = create_empty_matrix();
 	if(!v.initialized){
 		printf("ERROR: vector not initialized yet\n");
 		return out;
 	}
 	out = create_square_matrix(v.len);
-	for(i=0;i<v.len;i++){
-		out.data[i][i] = 1;
+	householder_matrix_into(&out, v);
+	return out;
+}
+
+/*******************************************************************************
+* int householder_matrix_into(matrix_t* out, vector_t v)
+*
+* fills in the householder reflection matrix for v in preallocated out
+*******************************************************************************/
+int householder_matrix_into(matrix_t* out, vector_t v){
+	int i, j;
+	float tau;
+	if(!v.initialized){
+		printf("ERROR: vector not initialized yet\n");
+		return -1;
 	}
+	if(check_matrix_out(out, v.len, v.len)) return -1;
 	tau = 2.0/vector_dot_product(v,v);
 	for(i=0;i<v.len;i++){
 		for(j=0;j<v.len;j++){
-			out.data[i][j] -= tau * v.data[i]*v.data[j];
+			MATRIX_ELEM(*out,i,j) = ((i==j) ? 1 : 0) - tau*v.data[i]*v.data[j];
 		}
 	}
-	return out;
+	return 0;
 }
 
 /*******************************************************************************
 * vector_t lin_system_solve(matrix_t A, vector_t b)
 *
 * Returns the vector x that solves Ax=b
-* Thank you to  Henry Guennadi Levkin for open sourcing this routine.
 *******************************************************************************/
 vector_t lin_system_solve(matrix_t A, vector_t b){
+	vector_t x;
+	vector_t xout = create_empty_vector();
+	la_arena_t ws;
+	if(!A.initialized || !b.initialized){
+		printf("ERROR: matrix or vector not initialized yet\n");
+		return xout;
+	}
+	ws = create_la_arena(solve_bytes(A.cols));
+	x = lin_system_solve_arena(A,b,&ws);
+	if(x.initialized) xout = duplicate_vector(x);
+	destroy_la_arena(&ws);
+	return xout;
+}
+
+/*******************************************************************************
+* vector_t lin_system_solve_arena(matrix_t A, vector_t b, la_arena_t* a)
+*
+* Same as lin_system_solve but x and the working copies of A and b are drawn
+* from arena a. On failure the arena is left as it was.
+* Thank you to  Henry Guennadi Levkin for open sourcing this routine.
+*******************************************************************************/
+vector_t lin_system_solve_arena(matrix_t A, vector_t b, la_arena_t* a){
 	float fMaxElem, fAcc;
 	int nDim,i,j,k,m;
+	size_t start, mark;
+	matrix_t Atemp;
+	vector_t btemp;
 	vector_t xout = create_empty_vector();
 	if(!A.initialized || !b.initialized){
 		printf("ERROR: matrix or vector not initialized yet\n");
 		return xout;
 	}
-	if(A.cols != b.len){
+	if(A.cols != b.len || A.rows != A.cols){
 		printf("ERROR: matrix dimensions do not match\n");
 		return xout;
 	}
 	
 	nDim = A.cols;
-	xout = create_vector(nDim);
-	matrix_t Atemp = duplicate_matrix(A); // duplicate the given matrix 
-	vector_t btemp = duplicate_vector(b); // duplicate the given vector
+	start = la_arena_mark(a);
+	xout = la_arena_vector(a,nDim);
+	if(!xout.initialized) return xout;
+	mark = la_arena_mark(a);
+	Atemp = la_arena_matrix(a,nDim,nDim);
+	btemp = la_arena_vector(a,nDim);
+	if(!Atemp.initialized || !btemp.initialized){
+		la_arena_release(a,start);
+		return create_empty_vector();
+	}
+	copy_to(A,Atemp);					// duplicate the given matrix 
+	memcpy(btemp.data, b.data, nDim*sizeof(float));	// and vector
 	
 	for(k=0; k<(nDim-1); k++){ // base row of matrix
 		// search of line with max element
-		fMaxElem = fabs( Atemp.data[k][k]);
+		fMaxElem = fabs(MATRIX_ELEM(Atemp,k,k));
 		m = k;
 		for(i=k+1; i<nDim; i++){
-			if(fMaxElem < fabs(Atemp.data[i][k])){
-				fMaxElem = Atemp.data[i][k];
+			if(fMaxElem < fabs(MATRIX_ELEM(Atemp,i,k))){
+				fMaxElem = fabs(MATRIX_ELEM(Atemp,i,k));
 				m = i;
 			}
 		}
 		// permutation of base line (index k) and max element line(index m)
 		if(m != k){
 			for(i=k; i<nDim; i++){
-				fAcc = Atemp.data[k][i];
-				Atemp.data[k][i] = Atemp.data[m][i];
-				Atemp.data[m][i]  = fAcc;
+				fAcc = MATRIX_ELEM(Atemp,k,i);
+				MATRIX_ELEM(Atemp,k,i) = MATRIX_ELEM(Atemp,m,i);
+				MATRIX_ELEM(Atemp,m,i)  = fAcc;
 			}
 			fAcc = btemp.data[k];
 			btemp.data[k] = btemp.data[m];
 			btemp.data[m] = fAcc;
 		}
-		if(Atemp.data[k][k]  == 0.0) return xout; // needs improvement !!!
+		if(MATRIX_ELEM(Atemp,k,k) == 0.0){
+			printf("ERROR: matrix is singular\n");
+			la_arena_release(a,start);
+			return create_empty_vector();
+		}
 		// triangulation of matrix with coefficients
 		for(j=(k+1); j<nDim; j++){ // current row of matrix
-			fAcc = - Atemp.data[j][k]  / Atemp.data[k][k];
+			fAcc = - MATRIX_ELEM(Atemp,j,k)  / MATRIX_ELEM(Atemp,k,k);
 			for(i=k; i<nDim; i++){
-				Atemp.data[j][i] = Atemp.data[j][i] + fAcc*Atemp.data[k][i] ;
+				MATRIX_ELEM(Atemp,j,i) = MATRIX_ELEM(Atemp,j,i) + fAcc*MATRIX_ELEM(Atemp,k,i) ;
 			}
 			// free member recalculation
 			btemp.data[j] = btemp.data[j] + fAcc*btemp.data[k]; 
 		}
 	}
+	// the loop above never pivots on the last row
+	if(MATRIX_ELEM(Atemp,nDim-1,nDim-1) == 0.0){
+		printf("ERROR: matrix is singular\n");
+		la_arena_release(a,start);
+		return create_empty_vector();
+	}
 
 	for(k=(nDim-1); k>=0; k--){
 		xout.data[k] = btemp.data[k];
 		for(i=(k+1); i<nDim; i++){
-			xout.data[k] -= (Atemp.data[k][i]*xout.data[i]);
+			xout.data[k] -= (MATRIX_ELEM(Atemp,k,i)*xout.data[i]);
 		}
-		xout.data[k] = xout.data[k] / Atemp.data[k][k];
+		xout.data[k] = xout.data[k] / MATRIX_ELEM(Atemp,k,k);
 	}
 
-	destroy_matrix(&Atemp);
-	destroy_vector(&btemp);
+	la_arena_release(a,mark);
 	return xout;
 }
 
@@ -1239,41 +2131,70 @@ vector_t lin_system_solve(matrix_t A, vector_t b){
 *  then solve for x with gaussian elimination
 *******************************************************************************/
 vector_t lin_system_solve_qr(matrix_t A, vector_t b){
+	vector_t x;
 	vector_t xout = create_empty_vector();
-	vector_t temp;
-	matrix_t Q,R;
-	int i,k;
+	la_arena_t ws;
 	if(!A.initialized || !b.initialized){
 		printf("ERROR: matrix or vector not initialized yet\n");
 		return xout;
 	}
-	// do QR decomposition
-	if(QR_decomposition(A,&Q,&R)<0){
-		printf("failed to perform QR decomposition on A\n");
+	ws = create_la_arena(solve_qr_bytes(A.rows,A.cols));
+	x = lin_system_solve_qr_arena(A,b,&ws);
+	if(x.initialized) xout = duplicate_vector(x);
+	destroy_la_arena(&ws);
+	return xout;
+}
+
+/*******************************************************************************
+* vector_t lin_system_solve_qr_arena(matrix_t A, vector_t b, la_arena_t* a)
+*
+* Same as lin_system_solve_qr but x and all temporaries are drawn from a.
+* Q is never formed, its reflectors are applied straight to a copy of b.
+* On failure the arena is left as it was.
+*******************************************************************************/
+vector_t lin_system_solve_qr_arena(matrix_t A, vector_t b, la_arena_t* a){
+	vector_t xout = create_empty_vector();
+	vector_t qtb, tau, w;
+	matrix_t W;
+	size_t start, mark;
+	int i,k,nDim;
+	if(!A.initialized || !b.initialized){
+		printf("ERROR: matrix or vector not initialized yet\n");
 		return xout;
 	}
-	// transpose Q matrix
-	if(transpose_matrix(&Q)<0){
-		printf("ERROR: failed to transpose Q\n");
+	if(A.rows != b.len || A.rows < A.cols){
+		printf("ERROR: matrix dimensions do not match\n");
 		return xout;
 	}
-	// multiply through
-	temp = matrix_times_col_vec(Q,b);
-	destroy_matrix(&Q);
+	nDim = A.cols;
+	start = la_arena_mark(a);
+	xout = la_arena_vector(a,nDim);
+	if(!xout.initialized) return xout;
+	mark = la_arena_mark(a);
+	W   = la_arena_matrix(a,A.rows,nDim);
+	qtb = la_arena_vector(a,A.rows);
+	tau = la_arena_vector(a,nDim);
+	w   = la_arena_vector(a,nDim);
+	if(!W.initialized || !qtb.initialized || !tau.initialized || \
+														!w.initialized){
+		printf("failed to perform QR decomposition on A\n");
+		la_arena_release(a,start);
+		return create_empty_vector();
+	}
+	copy_to(A,W);
+	memcpy(qtb.data, b.data, b.len*sizeof(float));
+	householder_factor(W, tau.data, w.data);
+	householder_apply_qt(W, tau.data, qtb.data);
 	
 	// solve for x knowing R is upper triangular
-	int nDim = R.cols;
-	xout = create_vector(nDim);
 	for(k=(nDim-1); k>=0; k--){
-		xout.data[k] = temp.data[k];
+		xout.data[k] = qtb.data[k];
 		for(i=(k+1); i<nDim; i++){
-			xout.data[k] -= (R.data[k][i]*xout.data[i]);
+			xout.data[k] -= (MATRIX_ELEM(W,k,i)*xout.data[i]);
 		}
-		xout.data[k] = xout.data[k] / R.data[k][k];
+		xout.data[k] = xout.data[k] / MATRIX_ELEM(W,k,k);
 	}
-	destroy_matrix(&R);
-	destroy_vector(&temp);
-	
+	la_arena_release(a,mark);
 	return xout;
 }
 
@@ -1299,9 +2220,37 @@ vector_t lin_system_solve_qr(matrix_t A, vector_t b){
 * 3 directions.
 *******************************************************************************/
 int fit_ellipsoid(matrix_t points, vector_t* center, vector_t* lengths){
+	vector_t c, l;
+	la_arena_t ws;
+	if(!points.initialized){
+		printf("ERROR: matrix_t points not initialized\n");
+		return -1;
+	}
+	ws = create_la_arena(ellipsoid_bytes(points.rows));
+	if(fit_ellipsoid_arena(points,&c,&l,&ws)<0){
+		destroy_la_arena(&ws);
+		return -1;
+	}
+	*center = duplicate_vector(c);
+	*lengths = duplicate_vector(l);
+	destroy_la_arena(&ws);
+	return 0;
+}
+
+/*******************************************************************************
+* int fit_ellipsoid_arena(matrix_t points, vector_t* center, vector_t* lengths,
+*														la_arena_t* a)
+*
+* Same as fit_ellipsoid but center and lengths are drawn from arena a along
+* with the least squares problem and its temporaries. On failure the arena is
+* left as it was and center and lengths are uninitialized.
+*******************************************************************************/
+int fit_ellipsoid_arena(matrix_t points, vector_t* center, vector_t* lengths,\
+														la_arena_t* a){
 	int i,p;
+	size_t start, mark;
 	matrix_t A;
-	vector_t b;
+	vector_t b, f, scales;
 	if(!points.initialized){
 		printf("ERROR: matrix_t points not initialized\n");
 		return -1;
@@ -1316,43 +2265,51 @@ int fit_ellipsoid(matrix_t points, vector_t* center, vector_t* lengths){
 		return -1;
 	}
 	
-	b = create_vector_of_ones(p);
-	A = create_matrix(p,6);
+	start = la_arena_mark(a);
+	*center = la_arena_vector(a,3);
+	*lengths = la_arena_vector(a,3);
+	mark = la_arena_mark(a);
+	b = la_arena_vector(a,p);
+	A = la_arena_matrix(a,p,6);
+	if(!center->initialized || !lengths->initialized || !b.initialized || \
+														!A.initialized){
+		goto fail;
+	}
 	for(i=0;i<p;i++){
-		A.data[i][0] = points.data[i][0] * points.data[i][0];
-		A.data[i][1] = points.data[i][0];
-		A.data[i][2] = points.data[i][1] * points.data[i][1];
-		A.data[i][3] = points.data[i][1];
-		A.data[i][4] = points.data[i][2] * points.data[i][2];
-		A.data[i][5] = points.data[i][2];
+		b.data[i] = 1;
+		MATRIX_ELEM(A,i,0) = MATRIX_ELEM(points,i,0) * MATRIX_ELEM(points,i,0);
+		MATRIX_ELEM(A,i,1) = MATRIX_ELEM(points,i,0);
+		MATRIX_ELEM(A,i,2) = MATRIX_ELEM(points,i,1) * MATRIX_ELEM(points,i,1);
+		MATRIX_ELEM(A,i,3) = MATRIX_ELEM(points,i,1);
+		MATRIX_ELEM(A,i,4) = MATRIX_ELEM(points,i,2) * MATRIX_ELEM(points,i,2);
+		MATRIX_ELEM(A,i,5) = MATRIX_ELEM(points,i,2);
 	}
 	
-	vector_t f = lin_system_solve_qr(A,b);
-	destroy_matrix(&A);
-	destroy_vector(&b);
+	f = lin_system_solve_qr_arena(A,b,a);
+	if(!f.initialized) goto fail;
 	
 	// compute center 
-	*center = create_vector(3);
 	center->data[0] = -f.data[1]/(2*f.data[0]);
 	center->data[1] = -f.data[3]/(2*f.data[2]);
 	center->data[2] = -f.data[5]/(2*f.data[4]);
 	
 	// Solve for lengths
-	A = create_square_matrix(3);
-	b = create_vector(3);
+	A = la_arena_matrix(a,3,3);
+	b = la_arena_vector(a,3);
+	if(!A.initialized || !b.initialized) goto fail;
 	
 	// fill in A
-	A.data[0][0] = (f.data[0] * center->data[0] * center->data[0]) + 1.0;
-	A.data[0][1] = (f.data[0] * center->data[1] * center->data[1]);
-	A.data[0][2] = (f.data[0] * center->data[2] * center->data[2]);
+	MATRIX_ELEM(A,0,0) = (f.data[0] * center->data[0] * center->data[0]) + 1.0;
+	MATRIX_ELEM(A,0,1) = (f.data[0] * center->data[1] * center->data[1]);
+	MATRIX_ELEM(A,0,2) = (f.data[0] * center->data[2] * center->data[2]);
 	
-	A.data[1][0] = (f.data[2] * center->data[0] * center->data[0]);
-	A.data[1][1] = (f.data[2] * center->data[1] * center->data[1]) + 1.0;
-	A.data[1][2] = (f.data[2] * center->data[2] * center->data[2]);
+	MATRIX_ELEM(A,1,0) = (f.data[2] * center->data[0] * center->data[0]);
+	MATRIX_ELEM(A,1,1) = (f.data[2] * center->data[1] * center->data[1]) + 1.0;
+	MATRIX_ELEM(A,1,2) = (f.data[2] * center->data[2] * center->data[2]);
 	
-	A.data[2][0] = (f.data[4] * center->data[0] * center->data[0]);
-	A.data[2][1] = (f.data[4] * center->data[1] * center->data[1]);
-	A.data[2][2] = (f.data[4] * center->data[2] * center->data[2]) + 1.0;
+	MATRIX_ELEM(A,2,0) = (f.data[4] * center->data[0] * center->data[0]);
+	MATRIX_ELEM(A,2,1) = (f.data[4] * center->data[1] * center->data[1]);
+	MATRIX_ELEM(A,2,2) = (f.data[4] * center->data[2] * center->data[2]) + 1.0;
 	
 	// fill in b
 	b.data[0] = f.data[0];
@@ -1360,15 +2317,460 @@ int fit_ellipsoid(matrix_t points, vector_t* center, vector_t* lengths){
 	b.data[2] = f.data[4];
 
 	// solve for lengths
-	vector_t scales = lin_system_solve(A, b);
+	scales = lin_system_solve_arena(A, b, a);
+	if(!scales.initialized) goto fail;
 	
-	*lengths = create_vector(3);
 	lengths->data[0] = 1.0/sqrt(scales.data[0]);
 	lengths->data[1] = 1.0/sqrt(scales.data[1]);
 	lengths->data[2] = 1.0/sqrt(scales.data[2]);
-	// cleanup
-	destroy_vector(&scales);
-	destroy_matrix(&A);
-	destroy_vector(&b);
+	la_arena_release(a,mark);
+	return 0;
+
+fail:
+	la_arena_release(a,start);
+	*center = create_empty_vector();
+	*lengths = create_empty_vector();
+	return -1;
+}
+
+/*******************************************************************************
+* Symmetric factorizations
+*
+* Cholesky A = L*L' for symmetric positive definite A, and LDL' A = L*D*L'
+* with unit lower triangular L and diagonal D for symmetric A whose leading
+* minors are nonzero, no pivoting is done. Only the lower triangle of A is
+* read, and L may be written over A itself. Factors and solves never
+* allocate. Updates, downdates and inverses need scratch which is drawn from
+* the arena ws and handed back, or if ws is NULL from a temporary arena made
+* for the call. All return 0 on success and -1 on bad input or if the matrix
+* is not positive definite (not factorable for LDL').
+*******************************************************************************/
+
+/*******************************************************************************
+* static int check_square_out(matrix_t* out, matrix_t A)
+*
+* A must be square and out an initialized matrix of the same size
+*******************************************************************************/
+static int check_square_out(matrix_t* out, matrix_t A){
+	if(!A.initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	if(A.rows != A.cols){
+		printf("ERROR: matrix is not square\n");
+		return -1;
+	}
+	return check_matrix_out(out, A.rows, A.cols);
+}
+
+/*******************************************************************************
+* static la_arena_t* scratch(la_arena_t* ws, la_arena_t* own, size_t bytes)
+*
+* returns ws, or when it is NULL a new arena of the given size placed in own
+* which the caller destroys when done
+*******************************************************************************/
+static la_arena_t* scratch(la_arena_t* ws, la_arena_t* own, size_t bytes){
+	memset(own, 0, sizeof(la_arena_t));
+	if(ws!=NULL) return ws;
+	*own = create_la_arena(bytes);
+	return own->initialized ? own : NULL;
+}
+
+/*******************************************************************************
+* int cholesky_factor(matrix_t* L, matrix_t A)
+*
+* Fills L with the lower triangular Cholesky factor of A, zeros above the
+* diagonal. L may be A. Fails if A is not positive definite, leaving L
+* partly written.
+*******************************************************************************/
+int cholesky_factor(matrix_t* L, matrix_t A){
+	int i, j, n;
+	float s;
+	if(check_square_out(L, A)) return -1;
+	n = A.rows;
+	for(i=0;i<n;i++){
+		for(j=0;j<=i;j++){
+			// rows i and j of L are contiguous, the sum is a dot product
+			s = MATRIX_ELEM(A,i,j) - dot_row(MATRIX_ROW(*L,i), \
+												MATRIX_ROW(*L,j), j);
+			if(i==j){
+				if(s<=0){
+					printf("ERROR: matrix is not positive definite\n");
+					return -1;
+				}
+				MATRIX_ELEM(*L,i,i) = sqrt(s);
+			}
+			else MATRIX_ELEM(*L,i,j) = s/MATRIX_ELEM(*L,j,j);
+		}
+		memset(MATRIX_ROW(*L,i)+i+1, 0, (n-i-1)*sizeof(float));
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int cholesky_solve(vector_t* x, matrix_t L, vector_t b)
+*
+* Solves L*L'*x = b by forward then back substitution. x may be b.
+*******************************************************************************/
+int cholesky_solve(vector_t* x, matrix_t L, vector_t b){
+	int i, k, n;
+	if(!L.initialized || !b.initialized){
+		printf("ERROR: matrix or vector not initialized yet\n");
+		return -1;
+	}
+	n = L.rows;
+	if(L.cols != n || b.len != n){
+		printf("ERROR: matrix dimensions do not match\n");
+		return -1;
+	}
+	if(check_vector_out(x, n)) return -1;
+	if(x->data != b.data) memcpy(x->data, b.data, n*sizeof(float));
+	for(i=0;i<n;i++){
+		x->data[i] = (x->data[i] - dot_row(MATRIX_ROW(L,i), x->data, i)) \
+													/ MATRIX_ELEM(L,i,i);
+	}
+	for(i=n-1;i>=0;i--){
+		for(k=i+1;k<n;k++) x->data[i] -= MATRIX_ELEM(L,k,i)*x->data[k];
+		x->data[i] /= MATRIX_ELEM(L,i,i);
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int cholesky_update(matrix_t* L, vector_t x, la_arena_t* ws)
+*
+* Turns the factor L of A into the factor of A + x*x' in O(n^2) with a
+* sequence of Givens rotations. Needs one vector of scratch.
+*******************************************************************************/
+int cholesky_update(matrix_t* L, vector_t x, la_arena_t* ws){
+	int i, k, n;
+	float r, c, s, lkk;
+	size_t mark;
+	vector_t w;
+	la_arena_t own, *a;
+	if(!x.initialized || check_square_out(L, *L)) return -1;
+	n = L->rows;
+	if(x.len != n){
+		printf("ERROR: vector dimension does not match matrix\n");
+		return -1;
+	}
+	if((a = scratch(ws, &own, la_vector_bytes(n))) == NULL) return -1;
+	mark = la_arena_mark(a);
+	w = la_arena_vector(a, n);
+	if(!w.initialized){
+		destroy_la_arena(&own);
+		return -1;
+	}
+	memcpy(w.data, x.data, n*sizeof(float));
+	for(k=0;k<n;k++){
+		lkk = MATRIX_ELEM(*L,k,k);
+		r = sqrt(lkk*lkk + w.data[k]*w.data[k]);
+		c = r/lkk;
+		s = w.data[k]/lkk;
+		MATRIX_ELEM(*L,k,k) = r;
+		for(i=k+1;i<n;i++){
+			MATRIX_ELEM(*L,i,k) = (MATRIX_ELEM(*L,i,k) + s*w.data[i]) / c;
+			w.data[i] = c*w.data[i] - s*MATRIX_ELEM(*L,i,k);
+		}
+	}
+	la_arena_release(a, mark);
+	destroy_la_arena(&own);
+	return 0;
+}
+
+/*******************************************************************************
+* int cholesky_downdate(matrix_t* L, vector_t x, la_arena_t* ws)
+*
+* Turns the factor L of A into the factor of A - x*x'. This is the LINPACK
+* method: p = inv(L)*x is found first and if |p| >= 1 the result would not
+* be positive definite so it fails with L untouched. Otherwise the rotations
+* that zero p are generated and applied to L a row at a time. Needs three
+* vectors of scratch.
+*******************************************************************************/
+int cholesky_downdate(matrix_t* L, vector_t x, la_arena_t* ws){
+	int i, j, n;
+	float alpha, scale, a, b, norm, t, xx, lji;
+	size_t mark;
+	vector_t p, c, s;
+	la_arena_t own, *ar;
+	if(!x.initialized || check_square_out(L, *L)) return -1;
+	n = L->rows;
+	if(x.len != n){
+		printf("ERROR: vector dimension does not match matrix\n");
+		return -1;
+	}
+	if((ar = scratch(ws, &own, 3*la_vector_bytes(n))) == NULL) return -1;
+	mark = la_arena_mark(ar);
+	p = la_arena_vector(ar, n);
+	c = la_arena_vector(ar, n);
+	s = la_arena_vector(ar, n);
+	if(!p.initialized || !c.initialized || !s.initialized){
+		la_arena_release(ar, mark);
+		destroy_la_arena(&own);
+		return -1;
+	}
+	// p = inv(L)*x
+	norm = 0;
+	for(i=0;i<n;i++){
+		p.data[i] = (x.data[i] - dot_row(MATRIX_ROW(*L,i), p.data, i)) \
+												/ MATRIX_ELEM(*L,i,i);
+		norm += p.data[i]*p.data[i];
+	}
+	if(norm >= 1){
+		printf("ERROR: downdate would leave matrix not positive definite\n");
+		la_arena_release(ar, mark);
+		destroy_la_arena(&own);
+		return -1;
+	}
+	// rotations folding p into alpha, last to first
+	alpha = sqrt(1-norm);
+	for(i=n-1;i>=0;i--){
+		scale = alpha + fabs(p.data[i]);
+		a = alpha/scale;
+		b = p.data[i]/scale;
+		norm = sqrt(a*a + b*b);
+		c.data[i] = a/norm;
+		s.data[i] = b/norm;
+		alpha = scale*norm;
+	}
+	// apply them to each row of L
+	for(j=0;j<n;j++){
+		xx = 0;
+		for(i=j;i>=0;i--){
+			lji = MATRIX_ELEM(*L,j,i);
+			t = c.data[i]*xx + s.data[i]*lji;
+			MATRIX_ELEM(*L,j,i) = c.data[i]*lji - s.data[i]*xx;
+			xx = t;
+		}
+	}
+	la_arena_release(ar, mark);
+	destroy_la_arena(&own);
+	return 0;
+}
+
+/*******************************************************************************
+* static void triangular_inverse_product(matrix_t Linv, const float* d,
+*															matrix_t* out)
+*
+* out = Linv'*inv(D)*Linv for lower triangular Linv, d may be NULL for D=I.
+* Only the triangle from row max(i,j) down contributes to entry (i,j), and
+* the result is symmetric so the upper half is mirrored.
+*******************************************************************************/
+static void triangular_inverse_product(matrix_t Linv, const float* d, \
+															matrix_t* out){
+	int i, j, k, n = Linv.rows;
+	float sum;
+	for(i=0;i<n;i++){
+		for(j=i;j<n;j++){
+			sum = 0;
+			for(k=j;k<n;k++){
+				if(d==NULL) sum += MATRIX_ELEM(Linv,k,i)*MATRIX_ELEM(Linv,k,j);
+				else sum += MATRIX_ELEM(Linv,k,i)*MATRIX_ELEM(Linv,k,j)/d[k];
+			}
+			MATRIX_ELEM(*out,i,j) = sum;
+			MATRIX_ELEM(*out,j,i) = sum;
+		}
+	}
+	return;
+}
+
+/*******************************************************************************
+* int cholesky_inverse(matrix_t* Ainv, matrix_t L, la_arena_t* ws)
+*
+* Ainv = inv(L*L') = inv(L)'*inv(L). Ainv may be L. Needs one n x n matrix of
+* scratch.
+*******************************************************************************/
+int cholesky_inverse(matrix_t* Ainv, matrix_t L, la_arena_t* ws){
+	int i, j, k, n;
+	float sum;
+	size_t mark;
+	matrix_t Linv;
+	la_arena_t own, *a;
+	if(check_square_out(Ainv, L)) return -1;
+	n = L.rows;
+	if((a = scratch(ws, &own, la_matrix_bytes(n,n))) == NULL) return -1;
+	mark = la_arena_mark(a);
+	Linv = la_arena_matrix(a, n, n);
+	if(!Linv.initialized){
+		destroy_la_arena(&own);
+		return -1;
+	}
+	for(j=0;j<n;j++){
+		MATRIX_ELEM(Linv,j,j) = 1.0/MATRIX_ELEM(L,j,j);
+		for(i=j+1;i<n;i++){
+			sum = 0;
+			for(k=j;k<i;k++) sum += MATRIX_ELEM(L,i,k)*MATRIX_ELEM(Linv,k,j);
+			MATRIX_ELEM(Linv,i,j) = -sum/MATRIX_ELEM(L,i,i);
+		}
+	}
+	triangular_inverse_product(Linv, NULL, Ainv);
+	la_arena_release(a, mark);
+	destroy_la_arena(&own);
+	return 0;
+}
+
+/*******************************************************************************
+* int ldl_factor(matrix_t* L, vector_t* d, matrix_t A)
+*
+* Fills L with the unit lower triangular factor and d with the diagonal of D
+* such that A = L*D*L'. L may be A. Fails on a zero pivot.
+*******************************************************************************/
+int ldl_factor(matrix_t* L, vector_t* d, matrix_t A){
+	int i, j, k, n;
+	float s;
+	if(check_square_out(L, A)) return -1;
+	n = A.rows;
+	if(check_vector_out(d, n)) return -1;
+	for(i=0;i<n;i++){
+		for(j=0;j<i;j++){
+			s = MATRIX_ELEM(A,i,j);
+			for(k=0;k<j;k++){
+				s -= MATRIX_ELEM(*L,i,k)*d->data[k]*MATRIX_ELEM(*L,j,k);
+			}
+			MATRIX_ELEM(*L,i,j) = s/d->data[j];
+		}
+		s = MATRIX_ELEM(A,i,i);
+		for(k=0;k<i;k++){
+			s -= MATRIX_ELEM(*L,i,k)*MATRIX_ELEM(*L,i,k)*d->data[k];
+		}
+		if(s==0){
+			printf("ERROR: zero pivot in LDL' factorization\n");
+			return -1;
+		}
+		d->data[i] = s;
+		MATRIX_ELEM(*L,i,i) = 1;
+		memset(MATRIX_ROW(*L,i)+i+1, 0, (n-i-1)*sizeof(float));
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int ldl_solve(vector_t* x, matrix_t L, vector_t d, vector_t b)
+*
+* Solves L*D*L'*x = b. x may be b.
+*******************************************************************************/
+int ldl_solve(vector_t* x, matrix_t L, vector_t d, vector_t b){
+	int i, k, n;
+	if(!L.initialized || !d.initialized || !b.initialized){
+		printf("ERROR: matrix or vector not initialized yet\n");
+		return -1;
+	}
+	n = L.rows;
+	if(L.cols != n || d.len != n || b.len != n){
+		printf("ERROR: matrix dimensions do not match\n");
+		return -1;
+	}
+	if(check_vector_out(x, n)) return -1;
+	if(x->data != b.data) memcpy(x->data, b.data, n*sizeof(float));
+	for(i=0;i<n;i++){
+		x->data[i] -= dot_row(MATRIX_ROW(L,i), x->data, i);
+	}
+	for(i=0;i<n;i++) x->data[i] /= d.data[i];
+	for(i=n-1;i>=0;i--){
+		for(k=i+1;k<n;k++) x->data[i] -= MATRIX_ELEM(L,k,i)*x->data[k];
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int ldl_update(matrix_t* L, vector_t* d, vector_t x, float alpha,
+*														la_arena_t* ws)
+*
+* Turns the factors of A into those of A + alpha*x*x' in O(n^2), method C1 of
+* Gill, Golub, Murray and Saunders. A negative alpha is a downdate. Its
+* effect on a positive definite A is checked first with the determinant
+* lemma, 1 + alpha*x'*inv(A)*x must stay positive, and if not it fails with
+* L and d untouched. Needs one vector of scratch.
+*******************************************************************************/
+int ldl_update(matrix_t* L, vector_t* d, vector_t x, float alpha, \
+														la_arena_t* ws){
+	int i, j, n;
+	float a, p, dj, beta, q;
+	size_t mark;
+	vector_t w;
+	la_arena_t own, *ar;
+	if(!x.initialized || check_square_out(L, *L)) return -1;
+	n = L->rows;
+	if(check_vector_out(d, n)) return -1;
+	if(x.len != n){
+		printf("ERROR: vector dimension does not match matrix\n");
+		return -1;
+	}
+	if((ar = scratch(ws, &own, la_vector_bytes(n))) == NULL) return -1;
+	mark = la_arena_mark(ar);
+	w = la_arena_vector(ar, n);
+	if(!w.initialized){
+		destroy_la_arena(&own);
+		return -1;
+	}
+	if(alpha < 0){
+		// w = inv(L)*x, then x'*inv(A)*x = sum w^2/d
+		q = 0;
+		for(i=0;i<n;i++){
+			w.data[i] = x.data[i] - dot_row(MATRIX_ROW(*L,i), w.data, i);
+			q += w.data[i]*w.data[i]/d->data[i];
+		}
+		if(1 + alpha*q <= 0){
+			printf("ERROR: downdate would leave matrix not positive definite\n");
+			la_arena_release(ar, mark);
+			destroy_la_arena(&own);
+			return -1;
+		}
+	}
+	memcpy(w.data, x.data, n*sizeof(float));
+	a = alpha;
+	for(j=0;j<n;j++){
+		p = w.data[j];
+		dj = d->data[j] + a*p*p;
+		beta = p*a/dj;
+		a = d->data[j]*a/dj;
+		d->data[j] = dj;
+		for(i=j+1;i<n;i++){
+			w.data[i] -= p*MATRIX_ELEM(*L,i,j);
+			MATRIX_ELEM(*L,i,j) += beta*w.data[i];
+		}
+	}
+	la_arena_release(ar, mark);
+	destroy_la_arena(&own);
+	return 0;
+}
+
+/*******************************************************************************
+* int ldl_inverse(matrix_t* Ainv, matrix_t L, vector_t d, la_arena_t* ws)
+*
+* Ainv = inv(L*D*L') = inv(L)'*inv(D)*inv(L). Ainv may be L. Needs one n x n
+* matrix of scratch.
+*******************************************************************************/
+int ldl_inverse(matrix_t* Ainv, matrix_t L, vector_t d, la_arena_t* ws){
+	int i, j, k, n;
+	float sum;
+	size_t mark;
+	matrix_t Linv;
+	la_arena_t own, *a;
+	if(check_square_out(Ainv, L)) return -1;
+	n = L.rows;
+	if(!d.initialized || d.len != n){
+		printf("ERROR: d must have one entry per row of L\n");
+		return -1;
+	}
+	if((a = scratch(ws, &own, la_matrix_bytes(n,n))) == NULL) return -1;
+	mark = la_arena_mark(a);
+	Linv = la_arena_matrix(a, n, n);
+	if(!Linv.initialized){
+		destroy_la_arena(&own);
+		return -1;
+	}
+	// L has a unit diagonal so its inverse does too
+	for(j=0;j<n;j++){
+		MATRIX_ELEM(Linv,j,j) = 1;
+		for(i=j+1;i<n;i++){
+			sum = 0;
+			for(k=j;k<i;k++) sum += MATRIX_ELEM(L,i,k)*MATRIX_ELEM(Linv,k,j);
+			MATRIX_ELEM(Linv,i,j) = -sum;
+		}
+	}
+	triangular_inverse_product(Linv, d.data, Ainv);
+	la_arena_release(a, mark);
+	destroy_la_arena(&own);
 	return 0;
 }
@@ -0,0 +1,504 @@
+/*******************************************************************************
+* rc_input.c
+*
+* Protocol-neutral RC receiver input. DSM2 is handled by dsm2.c, SBUS and
+* CRSF receivers plug into the same DSM2 socket and are parsed here from the
+* UART reactor. Whichever protocol is running, the rc_input_* functions give
+* channels in microseconds and normalized with the same calibration file
+* format as DSM2, one "min max" line per channel.
+*
+* The parsers work a byte at a time on a fixed buffer so they never block or
+* allocate and can be fed from a pty or a file just as well as from a UART.
+*******************************************************************************/
+
+#include "bb_blue_api.h"
+#include "sensor_config.h"
+
+#define RC_UART_BUS		4		// the DSM2 socket
+#define SBUS_BAUD_RATE	100000
+#define CRSF_BAUD_RATE	420000
+#define RC_TIMEOUT_MS	100		// link considered lost after this
+#define RC_DEFAULT_MIN	988
+#define RC_DEFAULT_MAX	2012
+
+#define SBUS_FRAME_BYTES	25
+#define SBUS_FRAME_GAP_US	2000	// frames take 3ms every 7 or 14ms
+#define SBUS_HEADER			0x0F
+#define SBUS_FLAG_LOST		0x04
+#define SBUS_FLAG_FAILSAFE	0x08
+
+#define CRSF_ADDR_FC		0xC8
+#define CRSF_ADDR_RADIO		0xEA
+#define CRSF_ADDR_RX		0xEE
+#define CRSF_TYPE_RC		0x16
+#define CRSF_RC_PAYLOAD		22		// 16 channels of 11 bits
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+rc_protocol_t rc_protocol;
+int rc_running;
+rc_parser_t rc_parser;
+int rc_input_mins[RC_MAX_CHANNELS];
+int rc_input_maxes[RC_MAX_CHANNELS];
+
+// last frame, published by the parser through rc_pub
+frame_pub_t rc_pub;
+rc_input_data_t rc_snapshot;
+
+// SBUS gap sync, only touched by the uart reactor thread
+uint64_t rc_last_byte_us;	// micros_since_boot() of the last arrival
+int rc_sbus_synced;			// a gap was seen and no framing error since
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+int rc_input_parse_stream(int bus, const char* data, int len, void* ctx);
+static void rc_publish(rc_input_data_t* frame);
+
+/*******************************************************************************
+* void rc_unpack_11bit(const uint8_t* p, rc_input_data_t* out)
+*
+* SBUS and CRSF share the same payload, 16 channels of 11 bits packed least
+* significant bit first. 172 to 1811 is the usual range, 992 is center.
+*******************************************************************************/
+static void rc_unpack_11bit(const uint8_t* p, rc_input_data_t* out){
+	uint32_t acc = 0;
+	int bits = 0;
+	int i;
+	for(i=0;i<RC_MAX_CHANNELS;i++){
+		while(bits<11){
+			acc |= (uint32_t)(*p++) << bits;
+			bits += 8;
+		}
+		out->ch[i] = (((acc & 0x7FF)*5)/8) + 880;
+		acc >>= 11;
+		bits -= 11;
+	}
+	out->num_channels = RC_MAX_CHANNELS;
+}
+
+/*******************************************************************************
+* uint8_t crsf_crc8(const uint8_t* p, int len)
+*
+* CRC-8/DVB-S2, polynomial 0xD5, over the type and payload bytes
+*******************************************************************************/
+static uint8_t crsf_crc8(const uint8_t* p, int len){
+	uint8_t crc = 0;
+	int i;
+	while(len--){
+		crc ^= *p++;
+		for(i=0;i<8;i++){
+			crc = (crc & 0x80) ? (crc<<1)^0xD5 : crc<<1;
+		}
+	}
+	return crc;
+}
+
+/*******************************************************************************
+* void rc_parser_resync(rc_parser_t* p, int (*is_start)(uint8_t))
+*
+* after a bad frame, drops the first byte and slides the buffer down to the
+* next byte which could start a frame. Bytes already received are reused
+* rather than thrown away so a good frame right behind a bad one survives.
+* False starts found while searching aren't counted again as errors.
+*******************************************************************************/
+static void rc_parser_resync(rc_parser_t* p, int (*is_start)(uint8_t)){
+	int i;
+	if(!p->resyncing) __atomic_add_fetch(&p->errors, 1, __ATOMIC_RELAXED);
+	p->resyncing = 1;
+	for(i=1;i<p->pos;i++){
+		if(is_start(p->buf[i])) break;
+	}
+	memmove(p->buf, p->buf+i, p->pos-i);
+	p->pos -= i;
+}
+
+static int sbus_is_start(uint8_t b){
+	return b==SBUS_HEADER;
+}
+
+static int crsf_is_start(uint8_t b){
+	return b==CRSF_ADDR_FC || b==CRSF_ADDR_RADIO || b==CRSF_ADDR_RX;
+}
+
+/*******************************************************************************
+* void rc_parser_reset(rc_parser_t* p)
+*******************************************************************************/
+void rc_parser_reset(rc_parser_t* p){
+	memset(p, 0, sizeof(rc_parser_t));
+}
+
+/*******************************************************************************
+* int sbus_check(rc_parser_t* p, rc_input_data_t* out, int* got)
+*
+* looks at the bytes buffered so far. Returns the length of the frame at the
+* front of the buffer, setting got if it was channel data now in out. Returns
+* 0 if more bytes are needed or -1 if they can't be a frame.
+*******************************************************************************/
+static int sbus_check(rc_parser_t* p, rc_input_data_t* out, int* got){
+	uint8_t footer;
+	if(p->buf[0]!=SBUS_HEADER) return -1;
+	if(p->pos<SBUS_FRAME_BYTES) return 0;
+	// 0x00 for SBUS, 0x04 0x14 0x24 0x34 for SBUS2 telemetry slots
+	footer = p->buf[SBUS_FRAME_BYTES-1];
+	if(footer!=0x00 && (footer&0x0F)!=0x04) return -1;
+	rc_unpack_11bit(&p->buf[1], out);
+	out->failsafe = (p->buf[23] & (SBUS_FLAG_LOST|SBUS_FLAG_FAILSAFE)) != 0;
+	*got = 1;
+	return SBUS_FRAME_BYTES;
+}
+
+/*******************************************************************************
+* int crsf_check(rc_parser_t* p, rc_input_data_t* out, int* got)
+*
+* same as sbus_check. Frames are address, length, type, payload, crc where
+* length counts type, payload and crc. Only RC channel frames fill out, other
+* valid frames like link statistics are consumed and ignored.
+*******************************************************************************/
+static int crsf_check(rc_parser_t* p, rc_input_data_t* out, int* got){
+	int len;
+	if(!crsf_is_start(p->buf[0])) return -1;
+	if(p->pos<2) return 0;
+	len = p->buf[1];
+	if(len<2 || len>RC_PARSER_BUF_BYTES-2) return -1;
+	if(p->pos<len+2) return 0;
+	if(crsf_crc8(&p->buf[2], len-1)!=p->buf[len+1]) return -1;
+	if(p->buf[2]==CRSF_TYPE_RC && len==CRSF_RC_PAYLOAD+2){
+		rc_unpack_11bit(&p->buf[3], out);
+		out->failsafe = 0; // receivers stop sending when the link drops
+		*got = 1;
+	}
+	return len+2;
+}
+
+/*******************************************************************************
+* int rc_parse_byte(rc_parser_t* p, uint8_t b, rc_input_data_t* out,
+*							rc_check_t check, int (*is_start)(uint8_t))
+*
+* common byte at a time framing for both protocols. After a resync the
+* buffer may hold a whole frame and then some, so keep checking until it
+* needs more bytes.
+*******************************************************************************/
+typedef int (*rc_check_t)(rc_parser_t* p, rc_input_data_t* out, int* got);
+
+static int rc_parse_byte(rc_parser_t* p, uint8_t b, rc_input_data_t* out, \
+								rc_check_t check, int (*is_start)(uint8_t)){
+	int used, got = 0;
+	if(p->pos==0 && !is_start(b)) return 0;
+	p->buf[p->pos++] = b;
+	while(p->pos>0){
+		used = check(p, out, &got);
+		if(used==0) break;
+		if(used<0){
+			rc_parser_resync(p, is_start);
+			continue;
+		}
+		memmove(p->buf, p->buf+used, p->pos-used);
+		p->pos -= used;
+		p->resyncing = 0;
+	}
+	if(got) p->frames++;
+	return got;
+}
+
+/*******************************************************************************
+* int sbus_parse_byte(rc_parser_t* p, uint8_t b, rc_input_data_t* out)
+* int crsf_parse_byte(rc_parser_t* p, uint8_t b, rc_input_data_t* out)
+*
+* feed one received byte. Returns 1 when it completed a channel frame, which
+* has been written to out, otherwise 0.
+*******************************************************************************/
+int sbus_parse_byte(rc_parser_t* p, uint8_t b, rc_input_data_t* out){
+	return rc_parse_byte(p, b, out, sbus_check, sbus_is_start);
+}
+
+int crsf_parse_byte(rc_parser_t* p, uint8_t b, rc_input_data_t* out){
+	return rc_parse_byte(p, b, out, crsf_check, crsf_is_start);
+}
+
+/*******************************************************************************
+* int rc_input_parse_stream(int bus, const char* data, int len, void* ctx)
+*
+* uart reactor callback for SBUS and CRSF, ctx is the rc_parser_t.
+* CRSF frames carry an address byte and crc so the parser finds them on its
+* own. SBUS only has a 0x0F header, which turns up in channel data all the
+* time, so like DSM2 it is framed by the quiet gap between frames instead.
+* After a gap the next byte must be a header. A partial frame cut short by
+* a gap, or a failed header or footer check, drops the buffered bytes and
+* ignores everything up to the next gap rather than hunting for a 0x0F.
+*******************************************************************************/
+int rc_input_parse_stream(int bus, const char* data, int len, void* ctx){
+	rc_parser_t* p = (rc_parser_t*)ctx;
+	rc_input_data_t frame;
+	uint64_t now, errors;
+	int i, ret;
+
+	(void)bus;
+	if(rc_protocol==RC_PROTOCOL_SBUS){
+		now = micros_since_boot();
+		if(now-rc_last_byte_us>SBUS_FRAME_GAP_US){
+			if(p->pos>0) __atomic_add_fetch(&p->errors, 1, __ATOMIC_RELAXED);
+			p->pos = 0;
+			p->resyncing = 0;
+			rc_sbus_synced = 1;
+		}
+		rc_last_byte_us = now;
+	}
+	for(i=0;i<len;i++){
+		if(rc_protocol!=RC_PROTOCOL_SBUS){
+			ret = crsf_parse_byte(p, data[i], &frame);
+			if(ret==1) rc_publish(&frame);
+			continue;
+		}
+		if(!rc_sbus_synced) break;
+		errors = p->errors;
+		if(p->pos==0 && (uint8_t)data[i]!=SBUS_HEADER){
+			__atomic_add_fetch(&p->errors, 1, __ATOMIC_RELAXED);
+		}
+		else ret = sbus_parse_byte(p, data[i], &frame);
+		if(p->errors!=errors){
+			p->pos = 0;
+			p->resyncing = 0;
+			rc_sbus_synced = 0;
+			break;
+		}
+		if(ret==1) rc_publish(&frame);
+	}
+	return len;
+}
+
+/*******************************************************************************
+* void rc_publish(rc_input_data_t* frame)
+*
+* stamps and publishes a frame then wakes rc_input_wait_frame()
+*******************************************************************************/
+static void rc_publish(rc_input_data_t* frame){
+	frame->timestamp_us = micros_since_boot();
+	frame_pub_write(&rc_pub, &rc_snapshot, frame, sizeof(rc_input_data_t));
+	frame_pub_notify(&rc_pub);
+}
+
+/*******************************************************************************
+* int load_rc_calibration(const char* name, int* mins, int* maxes, int n,
+*											int default_min, int default_max)
+*
+* reads n "min max" lines from name in the config directory, shared by all
+* the RC protocols. Channels missing from the file get the defaults. Returns
+* 1 if there was no file and only defaults were used, otherwise 0.
+*******************************************************************************/
+int load_rc_calibration(const char* name, int* mins, int* maxes, int n, \
+											int default_min, int default_max){
+	char file_path[100];
+	FILE* cal;
+	int i;
+
+	strcpy(file_path, CONFIG_DIRECTORY);
+	strcat(file_path, name);
+	cal = fopen(file_path, "r");
+	i = 0;
+	if(cal!=NULL){
+		while(i<n && fscanf(cal, "%d %d", &mins[i], &maxes[i])==2) i++;
+		fclose(cal);
+	}
+	for(;i<n;i++){
+		mins[i] = default_min;
+		maxes[i] = default_max;
+	}
+	if(cal==NULL){
+		printf("\nRC Calibration File %s Doesn't Exist Yet\n", file_path);
+		printf("Using default values for now\n");
+		return 1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_input_start(rc_protocol_t protocol)
+*
+* starts receiving on the DSM2 socket. DSM2 simply starts the DSM2 service.
+* SBUS is 100000 baud 8E2 and CRSF 420000 baud 8N1, both go through the
+* uart reactor.
+*******************************************************************************/
+int rc_input_start(rc_protocol_t protocol){
+	int baud;
+
+	if(rc_running) rc_input_stop();
+	rc_protocol = protocol;
+	if(protocol==RC_PROTOCOL_DSM2){
+		if(initialize_dsm2()<0) return -1;
+		rc_running = 1;
+		return 0;
+	}
+	if(protocol==RC_PROTOCOL_SBUS){
+		baud = SBUS_BAUD_RATE;
+		load_rc_calibration(SBUS_CAL_FILE, rc_input_mins, rc_input_maxes, \
+						RC_MAX_CHANNELS, RC_DEFAULT_MIN, RC_DEFAULT_MAX);
+	}
+	else if(protocol==RC_PROTOCOL_CRSF){
+		baud = CRSF_BAUD_RATE;
+		load_rc_calibration(CRSF_CAL_FILE, rc_input_mins, rc_input_maxes, \
+						RC_MAX_CHANNELS, RC_DEFAULT_MIN, RC_DEFAULT_MAX);
+	}
+	else{
+		printf("ERROR: unknown rc protocol\n");
+		return -1;
+	}
+
+	rc_parser_reset(&rc_parser);
+	frame_pub_clear(&rc_pub, &rc_snapshot, sizeof(rc_snapshot));
+	// the uart is flushed below so the line counts as quiet from here
+	rc_last_byte_us = micros_since_boot();
+	rc_sbus_synced = 0;
+
+	if(initialize_uart_low_latency(RC_UART_BUS, baud, 0.1, 0)){
+		printf("Error, failed to initialize UART%d for RC input\n", \
+															RC_UART_BUS);
+		return -1;
+	}
+	if(protocol==RC_PROTOCOL_SBUS && uart_set_framing(RC_UART_BUS,'E',2)<0){
+		return -1;
+	}
+	flush_uart(RC_UART_BUS);
+	if(start_uart_reactor()<0){
+		return -1;
+	}
+	if(uart_reactor_add(RC_UART_BUS, rc_input_parse_stream, &rc_parser)<0){
+		return -1;
+	}
+	rc_running = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_input_stop()
+*******************************************************************************/
+int rc_input_stop(){
+	if(rc_running==0) return 0;
+	rc_running = 0;
+	if(rc_protocol==RC_PROTOCOL_DSM2){
+		return stop_dsm2_service();
+	}
+	uart_reactor_remove(RC_UART_BUS);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_input_get_data(rc_input_data_t* data)
+*
+* lock-free copy of the latest frame, converted from DSM2 if that's running
+*******************************************************************************/
+int rc_input_get_data(rc_input_data_t* data){
+	dsm2_data_t d;
+	int i;
+
+	if(rc_protocol==RC_PROTOCOL_DSM2){
+		get_dsm2_data(&d);
+		memset(data, 0, sizeof(rc_input_data_t));
+		for(i=0;i<DSM2_MAX_CHANNELS;i++) data->ch[i] = d.ch[i];
+		data->num_channels = d.num_channels;
+		data->timestamp_us = d.timestamp_us;
+		return 0;
+	}
+	frame_pub_read(&rc_pub, data, &rc_snapshot, sizeof(rc_input_data_t));
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_input_wait_frame(float timeout_s)
+*
+* sleeps until the next frame is published. Returns 0 when one arrived or -1
+* on timeout, negative timeouts wait until a frame arrives or EXITING.
+*******************************************************************************/
+int rc_input_wait_frame(float timeout_s){
+	if(rc_protocol==RC_PROTOCOL_DSM2){
+		return wait_dsm2_frame(timeout_s);
+	}
+	return frame_pub_wait(&rc_pub, timeout_s);
+}
+
+/*******************************************************************************
+* int rc_input_get_raw(int ch)
+*
+* channel 1 to RC_MAX_CHANNELS in microseconds, 0 if not being sent
+*******************************************************************************/
+int rc_input_get_raw(int ch){
+	rc_input_data_t d;
+	if(ch<1 || ch>RC_MAX_CHANNELS){
+		printf("please enter a channel between 1 & %d\n", RC_MAX_CHANNELS);
+		return -1;
+	}
+	rc_input_get_data(&d);
+	return d.ch[ch-1];
+}
+
+/*******************************************************************************
+* float rc_input_get_normalized(int ch)
+*
+* -1 to 1 between the calibrated min and max, computed exactly like
+* get_dsm2_ch_normalized() which is used directly for DSM2
+*******************************************************************************/
+float rc_input_get_normalized(int ch){
+	int raw;
+	if(rc_protocol==RC_PROTOCOL_DSM2){
+		return get_dsm2_ch_normalized(ch);
+	}
+	raw = rc_input_get_raw(ch);
+	if(raw<0) return -1;
+	float range = rc_input_maxes[ch-1]-rc_input_mins[ch-1];
+	if(range!=0 && raw!=0){
+		float center = (rc_input_maxes[ch-1]+rc_input_mins[ch-1])/2;
+		return 2*(raw-center)/range;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_input_num_channels()
+*******************************************************************************/
+int rc_input_num_channels(){
+	rc_input_data_t d;
+	rc_input_get_data(&d);
+	return d.num_channels;
+}
+
+/*******************************************************************************
+* int rc_input_ms_since_last_frame()
+*
+* -1 if no frame has arrived yet
+*******************************************************************************/
+int rc_input_ms_since_last_frame(){
+	rc_input_data_t d;
+	rc_input_get_data(&d);
+	if(d.timestamp_us==0) return -1;
+	return (int)((micros_since_boot()-d.timestamp_us)/1000);
+}
+
+/*******************************************************************************
+* int rc_input_is_active()
+*
+* 1 if frames are arriving and the receiver isn't reporting failsafe
+*******************************************************************************/
+int rc_input_is_active(){
+	rc_input_data_t d;
+	int ms;
+	if(rc_running==0) return 0;
+	rc_input_get_data(&d);
+	if(d.timestamp_us==0 || d.failsafe) return 0;
+	ms = (int)((micros_since_boot()-d.timestamp_us)/1000);
+	return ms<=RC_TIMEOUT_MS;
+}
+
+/*******************************************************************************
+* uint64_t rc_input_errors()
+*
+* frames dropped for a bad header, footer, length or crc, or for DSM2
+* the sync losses plus decode errors. Atomic since the reactor thread counts
+* and a 64 bit value would tear on the 32 bit AM335x.
+*******************************************************************************/
+uint64_t rc_input_errors(){
+	if(rc_protocol==RC_PROTOCOL_DSM2){
+		return get_dsm2_sync_losses() + get_dsm2_decode_errors();
+	}
+	return __atomic_load_n(&rc_parser.errors, __ATOMIC_RELAXED);
+}
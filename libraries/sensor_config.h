@@ -9,6 +9,8 @@
 #ifndef ROBOTICS_CAPE_DEFS
 #define ROBOTICS_CAPE_DEFS
 
+#include <stddef.h>	// size_t for the frame publisher
+
 
 /*******************************************************************************
 * Useful Constants
@@ -35,6 +37,8 @@
 // Calibration File Locations
 #define CONFIG_DIRECTORY "/etc/robotics/"
 #define DSM2_CAL_FILE	"dsm2.cal"
+#define SBUS_CAL_FILE	"sbus.cal"
+#define CRSF_CAL_FILE	"crsf.cal"
 #define ACCEL_CAL_FILE 	"accel.cal"
 #define GYRO_CAL_FILE 	"gyro.cal"
 #define MAG_CAL_FILE	"mag.cal"
@@ -141,4 +145,67 @@ int gpio_set_edge(unsigned int gpio, char *edge);
 int gpio_fd_open(unsigned int gpio);
 int gpio_fd_close(int fd);
 int gpio_omap_mux_setup(const char *omap_pin0_name, const char *mode);
+
+/*******************************************************************************
+* Sequence lock
+*
+* Used by the background services to publish small structs of sensor data to
+* any number of reader threads without ever blocking the single writer. The
+* writer brackets its update with seqlock_write_begin() and _end(). Readers
+* copy the struct out after seqlock_read_begin() and must try again if
+* seqlock_read_retry() returns 1, meaning the writer got in the way.
+*******************************************************************************/
+typedef struct seqlock_t{
+	unsigned int seq;	// odd while a write is in progress
+} seqlock_t;
+
+static inline void seqlock_write_begin(seqlock_t* s){
+	__atomic_store_n(&s->seq, s->seq+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqlock_write_end(seqlock_t* s){
+	__atomic_store_n(&s->seq, s->seq+1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int seqlock_read_begin(seqlock_t* s){
+	unsigned int seq;
+	while((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1);
+	return seq;
+}
+
+static inline int seqlock_read_retry(seqlock_t* s, unsigned int seq){
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/*******************************************************************************
+* Frame publisher
+*
+* A seqlock protected snapshot plus a futex counter, shared by the RC input
+* services so a reader can either copy the latest frame or sleep until the
+* next one. frame_pub_write() is for the single parser thread, which then
+* calls frame_pub_notify() once anything else it flags for the new frame is
+* set. That only wakes frame_pub_wait() if someone is sleeping in it.
+* frame_pub_clear() zeroes the snapshot without waking anyone. A negative
+* timeout waits until a frame arrives or the program state becomes EXITING.
+*******************************************************************************/
+typedef struct frame_pub_t{
+	seqlock_t lock;
+	unsigned int futex;	// bumped after each publish
+	int waiters;		// threads inside frame_pub_wait()
+} frame_pub_t;
+
+void frame_pub_clear(frame_pub_t* p, void* snapshot, size_t bytes);
+void frame_pub_write(frame_pub_t* p, void* snapshot, const void* frame, \
+															size_t bytes);
+void frame_pub_notify(frame_pub_t* p);
+void frame_pub_read(frame_pub_t* p, void* out, const void* snapshot, \
+															size_t bytes);
+int  frame_pub_wait(frame_pub_t* p, float timeout_s);
+
+// reads "min max" calibration lines from CONFIG_DIRECTORY, see rc_input.c
+int  load_rc_calibration(const char* name, int* mins, int* maxes, int n, \
+												int default_min, int default_max);
+
 #endif //ROBOTICS_CAPE_DEFS
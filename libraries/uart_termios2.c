@@ -0,0 +1,39 @@
+/*******************************************************************************
+* uart_termios2.c
+*
+* Non-standard baud rates such as 100000 for SBUS or 420000 for CRSF need the
+* kernel's termios2 interface with BOTHER. The kernel's termios2 headers clash
+* with glibc's <termios.h> so this lives in its own file and deliberately
+* doesn't include bb_blue_api.h.
+*******************************************************************************/
+
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#include <asm/ioctls.h>
+
+/*******************************************************************************
+* int uart_set_custom_baud(int fd, int baudrate)
+*
+* sets both input and output speed of an already configured tty to any rate
+* the hardware divider can approximate. Returns 0 on success, -1 on failure.
+*******************************************************************************/
+int uart_set_custom_baud(int fd, int baudrate){
+	struct termios2 tio;
+
+	if(ioctl(fd, TCGETS2, &tio)<0){
+		printf("ERROR: can't get termios2 attributes\n");
+		return -1;
+	}
+	tio.c_cflag &= ~CBAUD;
+	tio.c_cflag |= BOTHER;
+	tio.c_cflag &= ~(CBAUD << IBSHIFT);
+	tio.c_cflag |= BOTHER << IBSHIFT;
+	tio.c_ispeed = baudrate;
+	tio.c_ospeed = baudrate;
+	if(ioctl(fd, TCSETS2, &tio)<0){
+		printf("ERROR: can't set custom baud rate %d\n", baudrate);
+		return -1;
+	}
+	return 0;
+}
@@ -6,6 +6,12 @@
 *******************************************************************************/
 
 #include "bb_blue_api.h"
+#include "sensor_config.h"
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define FRAME_WAIT_POLL_US	100000	// endless waits re-check EXITING this often
 
 /*******************************************************************************
 * @ int null_func()
@@ -161,6 +167,109 @@ uint64_t micros_since_epoch(){
 	return timeval_to_micros(tv);
 }
 
+/*******************************************************************************
+* @ uint64_t micros_since_boot()
+* 
+* like micros_since_epoch() but from CLOCK_MONOTONIC so it never jumps when
+* the system time is set. Use this for measuring intervals.
+*******************************************************************************/
+uint64_t micros_since_boot(){
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_to_micros(ts);
+}
+
+/*******************************************************************************
+* void frame_pub_clear(frame_pub_t* p, void* snapshot, size_t bytes)
+*
+* zeroes the snapshot, used when a service (re)starts
+*******************************************************************************/
+void frame_pub_clear(frame_pub_t* p, void* snapshot, size_t bytes){
+	seqlock_write_begin(&p->lock);
+	memset(snapshot, 0, bytes);
+	seqlock_write_end(&p->lock);
+}
+
+/*******************************************************************************
+* void frame_pub_write(frame_pub_t* p, void* snapshot, const void* frame,
+*															size_t bytes)
+*
+* copies frame into the snapshot, follow with frame_pub_notify()
+*******************************************************************************/
+void frame_pub_write(frame_pub_t* p, void* snapshot, const void* frame, \
+															size_t bytes){
+	seqlock_write_begin(&p->lock);
+	memcpy(snapshot, frame, bytes);
+	seqlock_write_end(&p->lock);
+}
+
+/*******************************************************************************
+* void frame_pub_notify(frame_pub_t* p)
+*
+* wakes frame_pub_wait(), skipping the system call if nobody is waiting
+*******************************************************************************/
+void frame_pub_notify(frame_pub_t* p){
+	__atomic_add_fetch(&p->futex, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&p->waiters, __ATOMIC_SEQ_CST)>0){
+		syscall(SYS_futex, &p->futex, FUTEX_WAKE_PRIVATE, INT_MAX, \
+														NULL, NULL, 0);
+	}
+}
+
+/*******************************************************************************
+* void frame_pub_read(frame_pub_t* p, void* out, const void* snapshot,
+*															size_t bytes)
+*
+* lock-free copy of the snapshot, never blocks the writer
+*******************************************************************************/
+void frame_pub_read(frame_pub_t* p, void* out, const void* snapshot, \
+															size_t bytes){
+	unsigned int seq;
+	do{
+		seq = seqlock_read_begin(&p->lock);
+		memcpy(out, snapshot, bytes);
+	}while(seqlock_read_retry(&p->lock, seq));
+}
+
+/*******************************************************************************
+* int frame_pub_wait(frame_pub_t* p, float timeout_s)
+*
+* sleeps on the futex until the next frame_pub_write(). Returns 0 when one
+* arrived or -1 on timeout or EXITING. Negative timeouts sleep
+* FRAME_WAIT_POLL_US at a time so they still notice EXITING.
+*******************************************************************************/
+int frame_pub_wait(frame_pub_t* p, float timeout_s){
+	unsigned int seq;
+	uint64_t deadline_us = 0, now_us, wait_us;
+	timespec remaining;
+	int ret = -1;
+
+	seq = __atomic_load_n(&p->futex, __ATOMIC_ACQUIRE);
+	if(timeout_s>=0){
+		deadline_us = micros_since_boot() + (uint64_t)(timeout_s*1000000);
+	}
+	__atomic_add_fetch(&p->waiters, 1, __ATOMIC_SEQ_CST);
+	while(get_state()!=EXITING){
+		if(__atomic_load_n(&p->futex, __ATOMIC_ACQUIRE)!=seq){
+			ret = 0;
+			break;
+		}
+		wait_us = FRAME_WAIT_POLL_US;
+		if(timeout_s>=0){
+			now_us = micros_since_boot();
+			if(now_us>=deadline_us) break;
+			if(deadline_us-now_us < wait_us) wait_us = deadline_us-now_us;
+		}
+		remaining.tv_sec = wait_us/1000000;
+		remaining.tv_nsec = (wait_us%1000000)*1000;
+		// returns early on a wake, a signal or if seq already changed
+		syscall(SYS_futex, &p->futex, FUTEX_WAIT_PRIVATE, seq, \
+													&remaining, NULL, 0);
+	}
+	__atomic_sub_fetch(&p->waiters, 1, __ATOMIC_SEQ_CST);
+	return ret;
+}
+
 
 /*******************************************************************************
 * @ int suppress_stdout(int (*func)(void))